@@ -304,9 +304,62 @@ static size_t getPayloadLength(const uint8_t *inputFrame, size_t inputLength, ui
 }
 
 
-enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr, size_t *dataLength)
+void wsUnmask(uint8_t *data, size_t length, const uint8_t *maskingKey, size_t offset)
 {
-    // assert(inputFrame && inputLength);
+    uint8_t key[4];
+    uint32_t key32;
+    uint32_t *data32;
+    size_t words;
+
+    // head: bytes until data is word aligned
+    while (length && ((uintptr_t)data & 3))
+    {
+        *data++ ^= maskingKey[offset++ & 3];
+        --length;
+    }
+
+    // body: the key rotated to the current phase, one word at a time
+    key[0] = maskingKey[offset & 3];
+    key[1] = maskingKey[(offset + 1) & 3];
+    key[2] = maskingKey[(offset + 2) & 3];
+    key[3] = maskingKey[(offset + 3) & 3];
+    memcpy(&key32, key, 4);
+    data32 = (uint32_t *)data;
+    words = length / 4;
+    while (words >= 4)
+    {
+        data32[0] ^= key32;
+        data32[1] ^= key32;
+        data32[2] ^= key32;
+        data32[3] ^= key32;
+        data32 += 4;
+        words -= 4;
+    }
+    while (words--)
+        *data32++ ^= key32;
+
+    // tail: phase is unchanged after whole words
+    data = (uint8_t *)data32;
+    length &= 3;
+    while (length--)
+        *data++ ^= maskingKey[offset++ & 3];
+}
+
+
+void wsParserInit(struct wsParser *parser)
+{
+    parser->frameType = WS_INCOMPLETE_FRAME;
+    parser->headerLength = 2;
+    parser->payloadLength = 0;
+    parser->unmaskedLength = 0;
+    parser->headerDone = FALSE;
+}
+
+
+enum wsFrameType wsParseFrameHeader(struct wsParser *parser, const uint8_t *inputFrame, size_t inputLength)
+{
+    if (parser->headerDone)
+        return parser->frameType;
 
     if (inputLength < 2)
         return WS_INCOMPLETE_FRAME;
@@ -325,41 +378,70 @@ enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint
     }
 
     uint8_t opcode = inputFrame[0] & 0x0F;
-    if (opcode == WS_TEXT_FRAME ||
-            opcode == WS_BINARY_FRAME ||
-            opcode == WS_CLOSING_FRAME ||
-            opcode == WS_PING_FRAME ||
-            opcode == WS_PONG_FRAME
+    if (opcode != WS_TEXT_FRAME &&
+            opcode != WS_BINARY_FRAME &&
+            opcode != WS_CLOSING_FRAME &&
+            opcode != WS_PING_FRAME &&
+            opcode != WS_PONG_FRAME
     )
     {
-        enum wsFrameType frameType = opcode;
+        printf("Unknown F0:%02X\n", inputFrame[0]);
+        return WS_ERROR_FRAME;
+    }
 
-        uint8_t payloadFieldExtraBytes = 0;
-        size_t payloadLength = getPayloadLength(inputFrame, inputLength, &payloadFieldExtraBytes, &frameType);
-        // printf("op=%d len=%d\n", opcode, inputLength);
-        if (payloadLength > 0)
-        {
-            if (payloadLength + 6 + payloadFieldExtraBytes > inputLength) // 4-maskingKey, 2-header
-                return WS_INCOMPLETE_FRAME;
-            uint8_t *maskingKey = &inputFrame[2 + payloadFieldExtraBytes];
+    // 2-header, 4-maskingKey, plus the extended length field
+    switch (inputFrame[1] & 0x7F)
+    {
+    case 0x7E:
+        parser->headerLength = 2 + 2 + 4;
+        break;
+    case 0x7F:
+        parser->headerLength = 2 + 8 + 4;
+        break;
+    default:
+        parser->headerLength = 2 + 4;
+        break;
+    }
+    if (inputLength < parser->headerLength)
+        return WS_INCOMPLETE_FRAME;
 
-            // assert(payloadLength == inputLength - 6 - payloadFieldExtraBytes);
+    enum wsFrameType frameType = opcode;
+    uint8_t payloadFieldExtraBytes = 0;
+    size_t payloadLength = getPayloadLength(inputFrame, inputLength, &payloadFieldExtraBytes, &frameType);
+    if (frameType == WS_ERROR_FRAME || frameType == WS_INCOMPLETE_FRAME)
+        return frameType;
 
-            *dataPtr = &inputFrame[2 + payloadFieldExtraBytes + 4];
-            *dataLength = payloadLength;
-        
-            size_t i;
-            for (i = 0; i < *dataLength; i++)
-            {
-                (*dataPtr)[i] = (*dataPtr)[i] ^ maskingKey[i%4];
-            }
-        }
+    memcpy(parser->maskingKey, &inputFrame[2 + payloadFieldExtraBytes], 4);
+    parser->payloadLength = payloadLength;
+    parser->unmaskedLength = 0;
+    parser->frameType = frameType;
+    parser->headerDone = TRUE;
+    // printf("op=%d len=%d\n", opcode, payloadLength);
+    return frameType;
+}
+
+
+void wsParserUnmask(struct wsParser *parser, uint8_t *data, size_t length)
+{
+    wsUnmask(data, length, parser->maskingKey, parser->unmaskedLength);
+    parser->unmaskedLength += length;
+}
+
+
+enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr, size_t *dataLength)
+{
+    struct wsParser parser;
+    enum wsFrameType frameType;
+
+    wsParserInit(&parser);
+    frameType = wsParseFrameHeader(&parser, inputFrame, inputLength);
+    if (frameType == WS_INCOMPLETE_FRAME || frameType == WS_ERROR_FRAME)
         return frameType;
-    }
-    else
-    {
-        printf("Unknown F0:%02X\n", inputFrame[0]);
-    }
+    if (inputLength - parser.headerLength < parser.payloadLength)
+        return WS_INCOMPLETE_FRAME;
 
-    return WS_ERROR_FRAME;
+    *dataPtr = &inputFrame[parser.headerLength];
+    *dataLength = parser.payloadLength;
+    wsParserUnmask(&parser, *dataPtr, parser.payloadLength);
+    return frameType;
 }
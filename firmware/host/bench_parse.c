@@ -0,0 +1,218 @@
+/*
+ * WebSocket parser benchmark: a stream of masked frames cut into segments
+ * at random and received as recvFrame() does, the header first through
+ * wsParseFrameHeader() and the payload unmasked as each recv() hands it
+ * over, checked against parsing each frame in one go.
+ */
+
+#include <time.h>
+
+#include "esp_common.h"
+#include "websocket.h"
+
+
+#define BENCH_FRAMES 64         // in the stream, sizes as in bench_sizes
+#define BENCH_BYTES (64 << 20)  // parsed per run, a sixteenth of that for segments up to 64 bytes
+#define BENCH_MAX_FRAME (14 + 65535)
+
+static const size_t bench_sizes[] = { 40960, 40960, 40960, 0, 1, 125, 126, 127, 1460, 20481, 65535 };
+
+struct benchFrame
+{
+    size_t offset;      // in the stream
+    size_t length;      // whole frame
+    enum wsFrameType type;
+};
+
+static uint8_t *stream;
+static size_t streamLength;
+static struct benchFrame frames[BENCH_FRAMES];
+static uint8_t *expected[BENCH_FRAMES];   // payloads parsed in one go
+
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// A masked client frame at the end of the stream
+static void addFrame(struct benchFrame *frame, size_t payloadLength, enum wsFrameType type)
+{
+    uint8_t *p = stream + streamLength;
+    uint8_t *mask;
+    size_t n = 0;
+    size_t i;
+
+    p[n++] = 0x80 | type;
+    if (payloadLength < 126)
+    {
+        p[n++] = 0x80 | payloadLength;
+    }
+    else
+    {
+        p[n++] = 0x80 | 126;
+        p[n++] = payloadLength >> 8;
+        p[n++] = payloadLength & 0xff;
+    }
+    mask = p + n;
+    for (i = 0; i < 4; ++i)
+        mask[i] = rand();
+    n += 4;
+    for (i = 0; i < payloadLength; ++i)
+        p[n + i] = rand();
+    frame->offset = streamLength;
+    frame->length = n + payloadLength;
+    frame->type = type;
+    streamLength += frame->length;
+}
+
+
+static void makeStream()
+{
+    uint8_t *dataPtr;
+    size_t dataLength;
+    int k;
+
+    stream = malloc(BENCH_FRAMES * BENCH_MAX_FRAME);
+    for (k = 0; k < BENCH_FRAMES; ++k)
+    {
+        size_t length = bench_sizes[k % (sizeof(bench_sizes) / sizeof(bench_sizes[0]))];
+
+        addFrame(&frames[k], length, length < 126 && (k & 1) ? WS_PING_FRAME : WS_BINARY_FRAME);
+        expected[k] = malloc(frames[k].length);
+        memcpy(expected[k], stream + frames[k].offset, frames[k].length);
+        if (wsParseInputFrame(expected[k], frames[k].length, &dataPtr, &dataLength) != frames[k].type ||
+            dataLength != length)
+        {
+            fprintf(stderr, "bench: frame %d does not parse in one go\n", k);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+// The stream as a socket that hands it over in the segments drawn for the run
+struct benchSocket
+{
+    size_t pos;
+    const uint16_t *segments;   // NULL for as much as is asked for
+    size_t segmentLeft;
+};
+
+
+static size_t benchRecv(struct benchSocket *socket, uint8_t *buffer, size_t length)
+{
+    if (socket->segments && socket->segmentLeft == 0)
+        socket->segmentLeft = *socket->segments++;
+    if (socket->segments && length > socket->segmentLeft)
+        length = socket->segmentLeft;
+    if (length > streamLength - socket->pos)
+        length = streamLength - socket->pos;
+    memcpy(buffer, stream + socket->pos, length);
+    socket->pos += length;
+    socket->segmentLeft -= length;
+    return length;
+}
+
+
+// Read exactly length bytes, as safeRecv() does
+static void benchRecvAll(struct benchSocket *socket, uint8_t *buffer, size_t length)
+{
+    while (length)
+    {
+        size_t readed = benchRecv(socket, buffer, length);
+
+        buffer += readed;
+        length -= readed;
+    }
+}
+
+
+/*
+ * Receive every frame header first, then its payload into buffer one
+ * recv() at a time, unmasking each piece as it comes.
+ * Returns 0, or -1 if a frame came out wrong.
+ */
+static int receiveStream(uint8_t *buffer, const uint16_t *segments, int check)
+{
+    struct benchSocket socket = { 0, segments, 0 };
+    int k;
+
+    for (k = 0; k < BENCH_FRAMES; ++k)
+    {
+        struct wsParser parser;
+        uint8_t header[14];
+        size_t headerLength = 0;
+        enum wsFrameType type;
+
+        wsParserInit(&parser);
+        do
+        {
+            benchRecvAll(&socket, header + headerLength, parser.headerLength - headerLength);
+            headerLength = parser.headerLength;
+            type = wsParseFrameHeader(&parser, header, headerLength);
+        } while (type == WS_INCOMPLETE_FRAME);
+
+        while (parser.unmaskedLength < parser.payloadLength)
+        {
+            uint8_t *p = buffer + parser.unmaskedLength;
+
+            wsParserUnmask(&parser, p, benchRecv(&socket, p, parser.payloadLength - parser.unmaskedLength));
+        }
+        if (check && (type != frames[k].type || parser.headerLength + parser.payloadLength != frames[k].length ||
+                      memcmp(buffer, expected[k] + parser.headerLength, parser.payloadLength) != 0))
+        {
+            fprintf(stderr, "bench: frame %d differs when cut into segments\n", k);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Each byte is copied once, as recv() does. The cuts are drawn up front so
+ * rand() stays out of the timing.
+ */
+static int run(const char *what, size_t maxSegment)
+{
+    static uint8_t buffer[BENCH_MAX_FRAME];
+    uint16_t *segments = NULL;
+    int runs = (maxSegment && maxSegment <= 64 ? BENCH_BYTES / 16 : BENCH_BYTES) / streamLength + 1;
+    double start;
+    size_t i;
+
+    if (maxSegment)
+    {
+        segments = malloc(streamLength * sizeof(segments[0]));
+        for (i = 0; i < streamLength; ++i)
+            segments[i] = 1 + (size_t)rand() % maxSegment;
+    }
+    if (receiveStream(buffer, segments, 1) < 0)
+        return EXIT_FAILURE;
+    start = seconds();
+    for (i = 0; i < runs; ++i)
+        receiveStream(buffer, segments, 0);
+    printf("bench: %-28s %8.1f MB/s\n", what, runs * streamLength / (seconds() - start) / 1e6);
+    free(segments);
+    return EXIT_SUCCESS;
+}
+
+
+int main()
+{
+    int result = EXIT_SUCCESS;
+
+    srand(1);
+    makeStream();
+    printf("bench: %d frames, %zu bytes\n", BENCH_FRAMES, streamLength);
+    result |= run("whole frames", 0);
+    result |= run("TCP segments (1-2920)", 2920);
+    result |= run("small segments (1-64)", 64);
+    result |= run("byte by byte", 1);
+    return result;
+}
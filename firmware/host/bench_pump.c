@@ -0,0 +1,202 @@
+/*
+ * Scan-out pump benchmark: host time lcdPumpPixels() takes per call and
+ * the pump takes to stage pixels of each framebuffer format into SPI
+ * bursts, in cycles at SIM_CPU_MHZ as xmas-sim counts them. Compare formats, builds and commits with each
+ * other, not with the chip. lcd.c is included so its stagers can be timed
+ * on their own, on frames the firmware has just sent to the panel model.
+ * test_panel and test_frames check what they stage.
+ */
+
+#include <time.h>
+
+#include "../user/lcd.c"
+#include "sim.h"
+#include "test.h"
+
+#define BENCH_FRAMES 200
+
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static double pumpSeconds;
+static uint32 pumpCalls;
+
+
+#ifndef LCD_3WIRE
+// The switch lcdSpiWrite() used to be, every pixel went through it twice
+static void __attribute__((noinline)) spiWriteSwitch(int data)
+{
+    int bytePos = lcdDataPos / 4;
+
+    switch (lcdDataPos & 3)
+    {
+    case 0:
+        lcdData[bytePos] |= data << 24;
+        break;
+    case 1:
+        lcdData[bytePos] |= data << 16;
+        break;
+    case 2:
+        lcdData[bytePos] |= data << 8;
+        break;
+    case 3:
+        lcdData[bytePos] |= data;
+        break;
+    }
+    ++lcdDataPos;
+}
+#endif
+
+
+// The timer interrupt, timed
+static void benchPump()
+{
+    double start = seconds();
+
+    lcdPumpPixels();
+    pumpSeconds += seconds() - start;
+    ++pumpCalls;
+}
+
+
+// An empty burst, as lcdSpiSend() leaves it
+static void benchBurst()
+{
+    memset(lcdData, 0, sizeof(lcdData));
+    lcdDataPos = 0;
+#ifdef LCD_3WIRE
+    lcdBitCount = 0;
+#endif
+}
+
+
+/*
+ * Host cycles per pixel to stage the frame in buffer i, in bursts as
+ * lcdFillBurst() fills them, RGB565 byte by byte through the old switch
+ * if bytes is set. The pump is idle, so the buffer is borrowed as the
+ * front one.
+ */
+static double cyclesPerPixel(int i, int bytes)
+{
+    int format = lcdFormat[i];
+    int pixels = LCD_WIDTH * LCD_HEIGHT;
+    double start;
+    int k;
+
+    testSettle();
+    lcdFront = i;
+    start = seconds();
+    for (k = 0; k < BENCH_FRAMES; ++k)
+    {
+        const uint8 *src = lcdFrameBuffers[i];
+        int left = pixels * 2;
+
+        lcdSrcPixel = 0;
+        memset(lcdBlockRow, 0xff, sizeof(lcdBlockRow));
+        while (left)
+        {
+            int n = lcdSpiRoom() & ~1;
+
+            if (n > left)
+                n = left;
+            if (format == LCD_YUV420)
+            {
+                lcdSpiWriteYuv(n / 2);
+            }
+            else if (format == LCD_BLOCKS)
+            {
+                lcdSpiWriteBlocks(n / 2);
+            }
+#ifndef LCD_3WIRE
+            else if (bytes)
+            {
+                int j;
+
+                for (j = 0; j < n; ++j)
+                    spiWriteSwitch(*src++);
+            }
+#endif
+            else
+            {
+                lcdSpiWriteBytes(src, n);
+                src += n;
+            }
+            left -= n;
+            benchBurst();
+        }
+    }
+    lcdFront = -1;
+    return (seconds() - start) * 1e6 * SIM_CPU_MHZ / ((double)BENCH_FRAMES * pixels);
+}
+
+
+// Send a frame of format, a different one for each seed, returns the buffer it is in
+static int frame(int format, int seed)
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    int i;
+
+    for (i = 0; i < LCD_ROW_BYTES(format) * LCD_HEIGHT; ++i)
+        buffer[i] = i * 7 + (i >> 8) + seed;
+    lcdWriteFrameFormat(format);
+    testSettle();
+    for (i = 0; lcdFrameBuffers[i] != buffer; ++i)
+        ;
+    return i;
+}
+
+
+// Whole frames of format through the pump, what each lcdPumpPixels() call costs
+static void pumpFrames(int format, const char *what)
+{
+    int k;
+
+    pumpSeconds = 0;
+    pumpCalls = 0;
+    for (k = 0; k < BENCH_FRAMES / 4; ++k)
+        frame(format, k);
+    printf("bench: %-6s %5u calls a frame, %6.0f cycles a call\n", what, pumpCalls / (BENCH_FRAMES / 4),
+           pumpSeconds * 1e6 * SIM_CPU_MHZ / pumpCalls);
+}
+
+
+int main()
+{
+    double rgb565, yuv, blocks;
+
+    testStart();
+    lcdHalTimerHandler(benchPump);
+    printf("bench: lcdPumpPixels() on full frames, host cycles at %d MHz, simulated registers included\n",
+           SIM_CPU_MHZ);
+    pumpFrames(LCD_RGB565, "RGB565");
+    pumpFrames(LCD_YUV420, "YUV420");
+    pumpFrames(LCD_BLOCKS, "blocks");
+
+    printf("bench: pump staging, host cycles at %d MHz\n", SIM_CPU_MHZ);
+    rgb565 = cyclesPerPixel(frame(LCD_RGB565, 0), 0);
+    printf("bench: RGB565 copied    %6.2f cycles per pixel\n", rgb565);
+#ifndef LCD_3WIRE
+    {
+        double bytes = cyclesPerPixel(frame(LCD_RGB565, 0), 1);
+
+        printf("bench: RGB565 bytewise  %6.2f cycles per pixel through the old switch, %.1fx a copy\n",
+               bytes, bytes / rgb565);
+    }
+#endif
+
+    yuv = cyclesPerPixel(frame(LCD_YUV420, 0), 0);
+    printf("bench: YUV420 converted %6.2f cycles per pixel, %.1fx a copy\n", yuv, yuv / rgb565);
+
+    blocks = cyclesPerPixel(frame(LCD_BLOCKS, 0), 0);
+    printf("bench: blocks expanded  %6.2f cycles per pixel, %.0f per row, %.1fx a copy\n", blocks,
+           blocks * LCD_WIDTH, blocks / rgb565);
+
+    return testFinish();
+}
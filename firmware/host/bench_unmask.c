@@ -0,0 +1,108 @@
+/*
+ * wsUnmask() against the byte at a time loop it replaced, over payload
+ * sizes, buffer alignments and key phases. Every case is checked against
+ * the byte loop before it is timed.
+ */
+
+#include <time.h>
+
+#include "esp_common.h"
+#include "websocket.h"
+
+
+#define BENCH_BYTES (64 << 20)      // unmasked per size and alignment
+#define BENCH_MAX 40960
+
+static const size_t bench_sizes[] = { 1, 3, 4, 7, 16, 64, 125, 1460, 4096, 40960 };
+static const uint8_t bench_key[4] = { 0x12, 0x9a, 0xc5, 0x3f };
+
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// The loop wsParseInputFrame() used to end with
+static void __attribute__((noinline)) unmaskBytes(uint8_t *data, size_t length, const uint8_t *maskingKey, size_t offset)
+{
+    size_t i;
+
+    for (i = 0; i < length; ++i)
+        data[i] ^= maskingKey[(offset + i) % 4];
+}
+
+
+// Every length up to 300 bytes at every alignment and phase, then the sizes timed
+static int check(uint8_t *buffer)
+{
+    static uint8_t reference[BENCH_MAX + 8];
+    size_t length, align, offset;
+    int k;
+
+    for (k = 0; k < 300 + sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++k)
+    {
+        length = k < 300 ? k : bench_sizes[k - 300];
+        for (align = 0; align < 8; ++align)
+        {
+            for (offset = 0; offset < 4; ++offset)
+            {
+                size_t i;
+
+                for (i = 0; i < length + 8; ++i)
+                    buffer[i] = reference[i] = i * 7 + align;
+                wsUnmask(buffer + align, length, bench_key, offset);
+                unmaskBytes(reference + align, length, bench_key, offset);
+                if (memcmp(buffer, reference, length + 8) != 0)
+                {
+                    fprintf(stderr, "bench: wsUnmask wrong for %zu bytes at alignment %zu, key phase %zu\n",
+                            length, align, offset);
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+
+static double nsPerByte(void (*unmask)(uint8_t *, size_t, const uint8_t *, size_t), uint8_t *data, size_t length)
+{
+    size_t runs = BENCH_BYTES / length;
+    double start = seconds();
+    size_t i;
+
+    for (i = 0; i < runs; ++i)
+        unmask(data, length, bench_key, i);
+    return (seconds() - start) * 1e9 / ((double)runs * length);
+}
+
+
+int main()
+{
+    static uint8_t buffer[BENCH_MAX + 8] __attribute__((aligned(16)));
+    size_t align;
+    int k;
+
+    if (check(buffer) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    printf("bench: unmask ns per byte, byte loop / wsUnmask at buffer alignment 0-3\n");
+    for (k = 0; k < sizeof(bench_sizes) / sizeof(bench_sizes[0]); ++k)
+    {
+        size_t length = bench_sizes[k];
+
+        printf("bench: %6zu bytes", length);
+        for (align = 0; align < 4; ++align)
+        {
+            double bytes = nsPerByte(unmaskBytes, buffer + align, length);
+            double words = nsPerByte(wsUnmask, buffer + align, length);
+
+            printf("  %5.3f/%5.3f %4.1fx", bytes, words, bytes / words);
+        }
+        printf("\n");
+    }
+    return EXIT_SUCCESS;
+}
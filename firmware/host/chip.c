@@ -0,0 +1,645 @@
+/*
+ * ESP31 model for the host build, see sim.h
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/xtensa_api.h"
+#include "gpio.h"
+#include "spi_register.h"
+#include "lcd_hal.h"    // the board: which SPI master and pins the panel hangs off
+
+#include "sim.h"
+
+
+#define SIM_REG_BASE 0x60000000
+#define SIM_REG_LEN 0x40000
+#define SIM_REG(addr) simRegs[((addr) - SIM_REG_BASE) / 4]
+#define SIM_TIMER_INT XCHAL_TIMER_INTERRUPT(1)
+#define SIM_WRAP (1ULL << 32)
+
+// Virtual time spent by the task, so that polling loops get somewhere
+#define SIM_BUS_CYCLES 4        // a peripheral register access
+#define SIM_CCOUNT_CYCLES 1     // reading the cycle counter
+
+// Flash timings of a typical 4 MB SPI NOR part
+#define SIM_ERASE_US 45000
+#define SIM_WRITE_BYTES_PER_US 1
+#define SIM_READ_BYTES_PER_US 16
+
+static int simTimeMode;
+static struct timespec simStart;
+static uint64_t simClock;       // virtual time
+
+static pthread_mutex_t simLockMutex;
+static int simLockDepth;        // only touched by the holder of simLockMutex
+static struct simStats simStats;
+
+static uint32 simRegs[SIM_REG_LEN / 4];
+static uint32 simPins;
+static uint64_t simSpiDone;     // cycle the transaction on the wire ends
+static simSpiFn simSpiFunc;
+static void *simSpiCtx;
+static simPinFn simPinFunc;
+static void *simPinCtx;
+
+// CCOMPARE1 and the interrupt it raises. The lock is innermost, never held
+// while running the handler.
+static pthread_mutex_t simTimerMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t simTimerChanged;
+static uint32 simIntsOn;
+static uint64_t simTimerAt;     // cycle the counter next matches CCOMPARE1
+static int simTimerLate;        // CCOMPARE1 was set behind the counter
+static xt_handler simHandler;
+static void *simHandlerArg;
+
+static uint8 simFlashMem[SIM_FLASH_LEN];
+
+
+uint64_t simCycles()
+{
+    struct timespec now;
+
+    if (simTimeMode == SIM_VIRTUAL)
+        return simClock;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)((int64_t)(now.tv_sec - simStart.tv_sec) * 1000000000 +
+                      (now.tv_nsec - simStart.tv_nsec)) * SIM_CPU_MHZ / 1000;
+}
+
+
+uint64_t simMicros()
+{
+    return simCycles() / SIM_CPU_MHZ;
+}
+
+
+int simMode()
+{
+    return simTimeMode;
+}
+
+
+static int simTimerDue(uint64_t now)
+{
+    return (simIntsOn & (1 << SIM_TIMER_INT)) && now >= simTimerAt;
+}
+
+
+// Take the timer interrupt if it is still due
+static void simInterrupt()
+{
+    xt_handler handler;
+    void *arg;
+
+    simLock();      // interrupts are off in critical sections
+    pthread_mutex_lock(&simTimerMutex);
+    if (!simTimerDue(simCycles()))
+    {
+        pthread_mutex_unlock(&simTimerMutex);
+        simUnlock();
+        return;
+    }
+    if (simTimerLate)
+        ++simStats.missedTimers;
+    // The counter runs on, it matches again once it wraps
+    simTimerAt += SIM_WRAP;
+    simTimerLate = 0;
+    handler = simHandler;
+    arg = simHandlerArg;
+    pthread_mutex_unlock(&simTimerMutex);
+
+    ++simStats.interrupts;
+    if (handler)
+        handler(arg);
+    simUnlock();
+}
+
+
+void simPoll()
+{
+    int due;
+
+    if (simTimeMode != SIM_VIRTUAL || simLockDepth)
+        return;
+    pthread_mutex_lock(&simTimerMutex);
+    due = simTimerDue(simClock);
+    pthread_mutex_unlock(&simTimerMutex);
+    if (due)
+        simInterrupt();
+}
+
+
+// The task did something that takes time
+static void simSpend(uint32 cycles)
+{
+    if (simTimeMode != SIM_VIRTUAL)
+        return;
+    simClock += cycles;
+    simPoll();
+}
+
+
+int simRunUntil(uint64_t cycle, int (*stop)(void *ctx), void *ctx)
+{
+    uint64_t next;
+    int due;
+
+    if (simTimeMode != SIM_VIRTUAL)
+    {
+        while (!(stop && stop(ctx)) && simCycles() < cycle)
+        {
+            struct timespec tick = { 0, 100000 };
+            nanosleep(&tick, NULL);
+        }
+        return stop && stop(ctx);
+    }
+    for (;;)
+    {
+        if (stop && stop(ctx))
+            return 1;
+        pthread_mutex_lock(&simTimerMutex);
+        due = (simIntsOn & (1 << SIM_TIMER_INT)) && simTimerAt <= cycle;
+        next = simTimerAt;
+        pthread_mutex_unlock(&simTimerMutex);
+        if (!due)
+            break;
+        if (simClock < next)
+            simClock = next;
+        simInterrupt();
+    }
+    if (cycle != SIM_FOREVER && simClock < cycle)
+        simClock = cycle;
+    return 0;
+}
+
+
+void simSleep(uint32 ms)
+{
+    struct timespec delay;
+
+    if (simTimeMode == SIM_VIRTUAL)
+    {
+        simRunUntil(simClock + (uint64_t)ms * SIM_CPU_MHZ * 1000, NULL, NULL);
+        return;
+    }
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+}
+
+
+// Real time: stands in for the CPU taking the interrupt
+static void *simInterruptTask(void *arg)
+{
+    const uint64_t spin = 50 * SIM_CPU_MHZ;    // host wakeups are no more precise than that
+
+    pthread_mutex_lock(&simTimerMutex);
+    for (;;)
+    {
+        uint64_t now = simCycles();
+        uint64_t ns;
+        struct timespec wake;
+
+        if (simTimerDue(now))
+        {
+            pthread_mutex_unlock(&simTimerMutex);
+            simInterrupt();
+            pthread_mutex_lock(&simTimerMutex);
+            continue;
+        }
+        if (!(simIntsOn & (1 << SIM_TIMER_INT)))
+        {
+            pthread_cond_wait(&simTimerChanged, &simTimerMutex);
+            continue;
+        }
+        if (simTimerAt - now <= spin)
+        {
+            pthread_mutex_unlock(&simTimerMutex);
+            sched_yield();
+            pthread_mutex_lock(&simTimerMutex);
+            continue;
+        }
+        ns = (simTimerAt - spin) * 1000 / SIM_CPU_MHZ;
+        wake.tv_sec = simStart.tv_sec + ns / 1000000000;
+        wake.tv_nsec = simStart.tv_nsec + ns % 1000000000;
+        if (wake.tv_nsec >= 1000000000)
+        {
+            ++wake.tv_sec;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&simTimerChanged, &simTimerMutex, &wake);
+    }
+    return NULL;
+}
+
+
+void simLock()
+{
+    pthread_mutex_lock(&simLockMutex);
+    ++simLockDepth;
+}
+
+
+void simUnlock()
+{
+    --simLockDepth;
+    pthread_mutex_unlock(&simLockMutex);
+    // An interrupt that came due meanwhile is taken now
+    simPoll();
+}
+
+
+unsigned xthal_get_ccount(void)
+{
+    simSpend(SIM_CCOUNT_CYCLES);
+    return (uint32)simCycles();
+}
+
+
+void xthal_set_ccompare(int n, unsigned value)
+{
+    uint64_t now;
+    uint32 ahead;
+
+    if (n != 1)
+        return;
+    pthread_mutex_lock(&simTimerMutex);
+    now = simCycles();
+    ahead = value - (uint32)now;
+    // Setting CCOMPARE acks the interrupt. A value the counter has passed
+    // only matches after it wraps; in real time that is more likely a
+    // host thread losing the CPU than the firmware's doing, so it fires at once.
+    simTimerLate = ahead == 0 || ahead >= (1U << 31);
+    if (simTimerLate && simTimeMode == SIM_REALTIME)
+        simTimerAt = now;
+    else
+        simTimerAt = now + (ahead ? ahead : SIM_WRAP);
+    pthread_cond_signal(&simTimerChanged);
+    pthread_mutex_unlock(&simTimerMutex);
+}
+
+
+unsigned int xt_ints_on(unsigned int mask)
+{
+    unsigned int old;
+
+    pthread_mutex_lock(&simTimerMutex);
+    old = simIntsOn;
+    simIntsOn |= mask;
+    pthread_cond_signal(&simTimerChanged);
+    pthread_mutex_unlock(&simTimerMutex);
+    simPoll();
+    return old;
+}
+
+
+unsigned int xt_ints_off(unsigned int mask)
+{
+    unsigned int old;
+
+    pthread_mutex_lock(&simTimerMutex);
+    old = simIntsOn;
+    simIntsOn &= ~mask;
+    pthread_mutex_unlock(&simTimerMutex);
+    return old;
+}
+
+
+xt_handler xt_set_interrupt_handler(int n, xt_handler f, void *arg)
+{
+    xt_handler old = NULL;
+
+    pthread_mutex_lock(&simTimerMutex);
+    if (n == SIM_TIMER_INT)
+    {
+        old = simHandler;
+        simHandler = f;
+        simHandlerArg = arg;
+    }
+    pthread_mutex_unlock(&simTimerMutex);
+    return old;
+}
+
+
+static int simSpiBusy()
+{
+    return simCycles() < simSpiDone;
+}
+
+
+// CPU cycles the SPI master takes for bits, chip select setup and hold included
+static uint64_t simSpiCycles(int bits)
+{
+    uint32 clock = SIM_REG(SPI_CLOCK(SPIDEV));
+    uint32 user = SIM_REG(SPI_USER(SPIDEV));
+    uint64_t apbCycles = 1;     // per bit, the APB clock is 80MHz
+
+    if (!(clock & SPI_CLK_EQU_SYSCLK))
+    {
+        apbCycles = (((clock >> SPI_CLKDIV_PRE_S) & SPI_CLKDIV_PRE) + 1) *
+                    (((clock >> SPI_CLKCNT_N_S) & SPI_CLKCNT_N) + 1);
+    }
+    if (user & SPI_CS_SETUP)
+        ++bits;
+    if (user & SPI_CS_HOLD)
+        ++bits;
+    return bits * apbCycles * SIM_CPU_MHZ / 80;
+}
+
+
+// The MOSI phase only, that is all the panel needs
+static void simSpiStart()
+{
+    uint8 data[LCD_SPI_WORDS * 4];
+    uint32 user = SIM_REG(SPI_USER(SPIDEV));
+    int bits = ((SIM_REG(SPI_USER1(SPIDEV)) >> SPI_USR_MOSI_BITLEN_S) & SPI_USR_MOSI_BITLEN) + 1;
+    uint64_t now = simCycles();
+    int i;
+
+    if (simSpiBusy())
+        ++simStats.spiBusyStarts;
+    for (i = 0; i < (bits + 7) / 8; ++i)
+    {
+        uint32 word = SIM_REG(SPI_W0(SPIDEV) + (i / 4) * 4);
+
+        if (user & SPI_WR_BYTE_ORDER)
+            data[i] = word >> (24 - 8 * (i & 3));
+        else
+            data[i] = word >> (8 * (i & 3));
+    }
+    simSpiDone = now + simSpiCycles(bits);
+    if (simSpiFunc)
+        simSpiFunc(simSpiCtx, (simPins >> LCD_A0) & 1, data, bits, now);
+}
+
+
+static void simSetPins(uint32 pins)
+{
+    uint32 changed = simPins ^ pins;
+    int pin;
+
+    if ((changed & (1U << LCD_A0)) && simSpiBusy())
+        ++simStats.a0Changes;
+    simPins = pins;
+    for (pin = 0; pin < 32; ++pin)
+    {
+        if ((changed & (1U << pin)) && simPinFunc)
+            simPinFunc(simPinCtx, pin, (pins >> pin) & 1, simCycles());
+    }
+}
+
+
+uint32 simRead(uint32 addr)
+{
+    simSpend(SIM_BUS_CYCLES);
+    if (addr < SIM_REG_BASE || addr >= SIM_REG_BASE + SIM_REG_LEN)
+        return 0;
+    if (addr == SPI_CMD(SPIDEV))
+        return SIM_REG(addr) | (simSpiBusy() ? SPI_USR : 0);
+    return SIM_REG(addr);
+}
+
+
+void simWrite(uint32 addr, uint32 value)
+{
+    simSpend(SIM_BUS_CYCLES);
+    if (addr == GPIO_OUT_W1TS)
+    {
+        simSetPins(simPins | value);
+        return;
+    }
+    if (addr == GPIO_OUT_W1TC)
+    {
+        simSetPins(simPins & ~value);
+        return;
+    }
+    if (addr < SIM_REG_BASE || addr >= SIM_REG_BASE + SIM_REG_LEN)
+        return;
+    if (addr >= SPI_W0(SPIDEV) && addr < SPI_W0(SPIDEV) + LCD_SPI_WORDS * 4 && simSpiBusy())
+        ++simStats.spiBusyWrites;
+    if (addr == SPI_CMD(SPIDEV))
+    {
+        SIM_REG(addr) = value & ~SPI_USR;
+        if (value & SPI_USR)
+            simSpiStart();
+        return;
+    }
+    SIM_REG(addr) = value;
+}
+
+
+void simSpiCapture(simSpiFn fn, void *ctx)
+{
+    simSpiFunc = fn;
+    simSpiCtx = ctx;
+}
+
+
+void simPinWatch(simPinFn fn, void *ctx)
+{
+    simPinFunc = fn;
+    simPinCtx = ctx;
+}
+
+
+void simGetStats(struct simStats *stats)
+{
+    simLock();
+    *stats = simStats;
+    simUnlock();
+}
+
+
+void simInit(int mode)
+{
+    pthread_mutexattr_t recursive;
+    pthread_condattr_t monotonic;
+    pthread_t task;
+    void *dram;
+
+    simTimeMode = mode;
+    clock_gettime(CLOCK_MONOTONIC, &simStart);
+
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&simLockMutex, &recursive);
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&simTimerChanged, &monotonic);
+
+    dram = mmap((void *)SIM_DRAM_ADDR, SIM_DRAM_LEN, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (dram != (void *)SIM_DRAM_ADDR)
+    {
+        fprintf(stderr, "sim: can't map DRAM at 0x%x\n", SIM_DRAM_ADDR);
+        exit(1);
+    }
+    memset(simFlashMem, 0xff, sizeof(simFlashMem));
+    // A client going away is a failed send(), as with lwIP
+    signal(SIGPIPE, SIG_IGN);
+
+    if (mode == SIM_REALTIME)
+        pthread_create(&task, NULL, simInterruptTask, NULL);
+}
+
+
+uint8 *simFlash()
+{
+    return simFlashMem;
+}
+
+
+// The SDK call blocks while the flash chip works
+static void simFlashBusy(uint32 us)
+{
+    uint64_t until;
+
+    if (simTimeMode == SIM_VIRTUAL)
+    {
+        simRunUntil(simClock + (uint64_t)us * SIM_CPU_MHZ, NULL, NULL);
+        return;
+    }
+    until = simCycles() + (uint64_t)us * SIM_CPU_MHZ;
+    while (simCycles() < until)
+        sched_yield();
+}
+
+
+static int simFlashRange(uint32 addr, uint32 size, const void *buffer)
+{
+    if (addr >= SIM_FLASH_LEN || size > SIM_FLASH_LEN - addr || (addr & 3) || (size & 3) ||
+        ((uintptr_t)buffer & 3))
+    {
+        fprintf(stderr, "sim: bad flash access, %u bytes at 0x%x\n", size, addr);
+        ++simStats.flashErrors;
+        return 0;
+    }
+    return 1;
+}
+
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec)
+{
+    if (!simFlashRange(sec * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE, NULL))
+        return SPI_FLASH_RESULT_ERR;
+    memset(simFlashMem + sec * SPI_FLASH_SEC_SIZE, 0xff, SPI_FLASH_SEC_SIZE);
+    simFlashBusy(SIM_ERASE_US);
+    return SPI_FLASH_RESULT_OK;
+}
+
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size)
+{
+    const uint8 *src = (const uint8 *)src_addr;
+    uint32 i;
+
+    if (!simFlashRange(des_addr, size, src_addr))
+        return SPI_FLASH_RESULT_ERR;
+    // Programming only ever clears bits
+    for (i = 0; i < size; ++i)
+        simFlashMem[des_addr + i] &= src[i];
+    simFlashBusy(size / SIM_WRITE_BYTES_PER_US);
+    return SPI_FLASH_RESULT_OK;
+}
+
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size)
+{
+    if (!simFlashRange(src_addr, size, des_addr))
+        return SPI_FLASH_RESULT_ERR;
+    memcpy(des_addr, simFlashMem + src_addr, size);
+    simFlashBusy(size / SIM_READ_BYTES_PER_US);
+    return SPI_FLASH_RESULT_OK;
+}
+
+
+void gpio_config(GPIO_ConfigTypeDef *pGPIOConfig)
+{
+}
+
+
+static uint8 simOpMode = SOFTAP_MODE;
+
+
+uint8 wifi_get_opmode(void)
+{
+    return simOpMode;
+}
+
+
+int wifi_set_opmode(uint8 opmode)
+{
+    simOpMode = opmode;
+    return 1;
+}
+
+
+// The host's network is always up, there is no station to join
+int wifi_station_connect(void)
+{
+    return 1;
+}
+
+
+int wifi_station_disconnect(void)
+{
+    return 1;
+}
+
+
+int wifi_station_set_config(struct station_config *config)
+{
+    return 1;
+}
+
+
+uint8 wifi_station_get_connect_status(void)
+{
+    return STATION_NO_AP_FOUND;
+}
+
+
+const char *system_get_sdk_version(void)
+{
+    return "host";
+}
+
+
+uint32 system_get_cpu_freq(void)
+{
+    return SIM_CPU_MHZ;
+}
+
+
+uint32 system_get_free_heap_size(void)
+{
+    return 0;   // the host heap is not the target's
+}
+
+
+void system_print_meminfo(void)
+{
+}
+
+
+uint32 system_get_time(void)
+{
+    return (uint32)simMicros();
+}
+
+
+void system_restart(void)
+{
+    printf("sim: restart\n");
+    exit(0);
+}
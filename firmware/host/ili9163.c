@@ -0,0 +1,339 @@
+/*
+ * ILI9163 model, see ili9163.h
+ */
+
+#include "esp_common.h"
+#include "lcd_hal.h"    // the pins the panel is wired to
+
+#include "ili9163.h"
+#include "sim.h"
+
+
+#define ILI_READY_US 5000   // after reset, sleep out or software reset
+
+
+// Panel state as after a reset, the memory keeps what it had
+static void iliDefaults(struct ili9163 *panel)
+{
+    panel->sleeping = 1;
+    panel->displayOn = 0;
+    panel->inverted = 0;
+    panel->madctl = 0;
+    panel->colmod = 0x06;   // 18 bits per pixel
+    panel->columnStart = 0;
+    panel->columnEnd = ILI_COLUMNS - 1;
+    panel->pageStart = 0;
+    panel->pageEnd = ILI_ROWS - 1;
+    panel->column = 0;
+    panel->page = 0;
+    panel->command = 0;
+    panel->paramCount = 0;
+    panel->pixelBytes = 0;
+}
+
+
+void iliInit(struct ili9163 *panel, int threeWire)
+{
+    memset(panel, 0, sizeof(*panel));
+    panel->threeWire = threeWire;
+    panel->reset = 1;
+    iliDefaults(panel);
+}
+
+
+static void iliSpi(void *ctx, int a0, const uint8 *data, int bits, uint64_t cycle)
+{
+    iliTransfer(ctx, a0, data, bits, cycle);
+}
+
+
+static void iliPin(void *ctx, int pin, int level, uint64_t cycle)
+{
+    if (pin == LCD_RST)
+        iliResetPin(ctx, level, cycle);
+}
+
+
+void iliConnect(struct ili9163 *panel)
+{
+    simSpiCapture(iliSpi, panel);
+    simPinWatch(iliPin, panel);
+}
+
+
+void iliResetPin(struct ili9163 *panel, int level, uint64_t cycle)
+{
+    if (!level)
+    {
+        panel->reset = 1;
+        iliDefaults(panel);
+    }
+    else if (panel->reset)
+    {
+        panel->reset = 0;
+        panel->readyAt = cycle + (uint64_t)ILI_READY_US * SIM_CPU_MHZ;
+    }
+}
+
+
+// Where the address counter's column and page land in the panel memory
+static uint32 *iliCell(struct ili9163 *panel, uint8 madctl, int column, int page)
+{
+    int x = (madctl & ILI_MV) ? page : column;
+    int y = (madctl & ILI_MV) ? column : page;
+
+    if (x >= ILI_COLUMNS || y >= ILI_ROWS)
+        return NULL;
+    if (madctl & ILI_MX)
+        x = ILI_COLUMNS - 1 - x;
+    if (madctl & ILI_MY)
+        y = ILI_ROWS - 1 - y;
+    return &panel->gram[y][x];
+}
+
+
+static void iliStore(struct ili9163 *panel, uint32 r6, uint32 g6, uint32 b6)
+{
+    uint32 *cell = iliCell(panel, panel->madctl, panel->column, panel->page);
+
+    if (cell)
+    {
+        *cell = (r6 << 12) | (g6 << 6) | b6;
+        ++panel->stats.pixels;
+    }
+    else
+    {
+        ++panel->stats.clipped;
+    }
+    if (panel->column++ >= panel->columnEnd)
+    {
+        panel->column = panel->columnStart;
+        if (panel->page++ >= panel->pageEnd)
+            panel->page = panel->pageStart;
+    }
+}
+
+
+// Colours narrower than the memory are widened by repeating their top bits
+static void iliPixelByte(struct ili9163 *panel, uint8 byte)
+{
+    uint8 *p = panel->pixel;
+    uint32 r, g, b;
+
+    p[panel->pixelBytes++] = byte;
+    switch (panel->colmod & 0x07)
+    {
+    case 0x03:  // 12 bits, two pixels in three bytes
+        if (panel->pixelBytes < 3)
+            return;
+        r = p[0] >> 4;
+        g = p[0] & 0x0f;
+        b = p[1] >> 4;
+        iliStore(panel, (r << 2) | (r >> 2), (g << 2) | (g >> 2), (b << 2) | (b >> 2));
+        r = p[1] & 0x0f;
+        g = p[2] >> 4;
+        b = p[2] & 0x0f;
+        iliStore(panel, (r << 2) | (r >> 2), (g << 2) | (g >> 2), (b << 2) | (b >> 2));
+        break;
+    case 0x05:  // 16 bits
+        if (panel->pixelBytes < 2)
+            return;
+        r = p[0] >> 3;
+        g = ((p[0] & 0x07) << 3) | (p[1] >> 5);
+        b = p[1] & 0x1f;
+        iliStore(panel, (r << 1) | (r >> 4), g, (b << 1) | (b >> 4));
+        break;
+    default:    // 18 bits, a byte per colour
+        if (panel->pixelBytes < 3)
+            return;
+        iliStore(panel, p[0] >> 2, p[1] >> 2, p[2] >> 2);
+        break;
+    }
+    panel->pixelBytes = 0;
+}
+
+
+static void iliCommand(struct ili9163 *panel, uint8 command, uint64_t cycle)
+{
+    ++panel->stats.commands;
+    if (cycle < panel->readyAt)
+        ++panel->stats.early;
+    panel->command = command;
+    panel->paramCount = 0;
+    panel->pixelBytes = 0;
+
+    switch (command)
+    {
+    case 0x01:  // Software Reset
+        iliDefaults(panel);
+        panel->readyAt = cycle + (uint64_t)ILI_READY_US * SIM_CPU_MHZ;
+        break;
+    case 0x10:  // Sleep In
+        panel->sleeping = 1;
+        panel->readyAt = cycle + (uint64_t)ILI_READY_US * SIM_CPU_MHZ;
+        break;
+    case 0x11:  // Sleep Out
+        panel->sleeping = 0;
+        panel->readyAt = cycle + (uint64_t)ILI_READY_US * SIM_CPU_MHZ;
+        break;
+    case 0x20:  // Display Inversion Off
+        panel->inverted = 0;
+        break;
+    case 0x21:  // Display Inversion On
+        panel->inverted = 1;
+        break;
+    case 0x28:  // Display Off
+        panel->displayOn = 0;
+        break;
+    case 0x29:  // Display On
+        panel->displayOn = 1;
+        break;
+    case 0x2c:  // Memory Write
+        panel->column = panel->columnStart;
+        panel->page = panel->pageStart;
+        ++panel->stats.memoryWrites;
+        break;
+    // Settings that only change how the glass is driven
+    case 0x00:  // NOP
+    case 0x13:  // Normal Display Mode On
+    case 0x26:  // Gamma Set
+    case 0x2a:  // Column Address Set
+    case 0x2b:  // Page Address Set
+    case 0x36:  // Memory Access Control
+    case 0x3a:  // Interface Pixel Format
+    case 0xb1:  // Frame Rate Control
+    case 0xb4:  // Display Inversion Control
+    case 0xb7:  // Source Driver Direction Control
+    case 0xc0:  // Power Control 1
+    case 0xc1:  // Power Control 2
+    case 0xc5:  // VCOM Control 1
+    case 0xc7:  // VCOM Offset Control
+    case 0xe0:  // Positive Gamma Correction Setting
+    case 0xe1:  // Negative Gamma Correction Setting
+        break;
+    default:
+        ++panel->stats.unknown;
+        break;
+    }
+}
+
+
+static void iliData(struct ili9163 *panel, uint8 byte)
+{
+    uint8 *p = panel->params;
+
+    if (panel->command == 0x2c)
+    {
+        iliPixelByte(panel, byte);
+        return;
+    }
+    if (panel->paramCount < sizeof(panel->params))
+        p[panel->paramCount] = byte;
+    ++panel->paramCount;
+
+    switch (panel->command)
+    {
+    case 0x2a:
+        if (panel->paramCount == 4)
+        {
+            panel->columnStart = (p[0] << 8) | p[1];
+            panel->columnEnd = (p[2] << 8) | p[3];
+        }
+        break;
+    case 0x2b:
+        if (panel->paramCount == 4)
+        {
+            panel->pageStart = (p[0] << 8) | p[1];
+            panel->pageEnd = (p[2] << 8) | p[3];
+        }
+        break;
+    case 0x36:
+        if (panel->paramCount == 1)
+            panel->madctl = byte;
+        break;
+    case 0x3a:
+        if (panel->paramCount == 1)
+            panel->colmod = byte;
+        break;
+    }
+}
+
+
+void iliTransfer(struct ili9163 *panel, int a0, const uint8 *data, int bits, uint64_t cycle)
+{
+    struct iliStats before = panel->stats;
+    int i;
+
+    ++panel->stats.transactions;
+    if (panel->reset)
+    {
+        panel->stats.bytes += bits / (panel->threeWire ? 9 : 8);
+        panel->stats.ignored += bits / (panel->threeWire ? 9 : 8);
+        return;
+    }
+    if (panel->threeWire)
+    {
+        // Chip select going high drops a word not complete yet
+        for (i = 0; i + 9 <= bits; i += 9)
+        {
+            int word = 0;
+            int k;
+
+            for (k = i; k < i + 9; ++k)
+                word = (word << 1) | ((data[k / 8] >> (7 - k % 8)) & 1);
+            ++panel->stats.bytes;
+            if (word & 0x100)
+                iliData(panel, word & 0xff);
+            else
+                iliCommand(panel, word, cycle);
+        }
+    }
+    else
+    {
+        for (i = 0; i < bits / 8; ++i)
+        {
+            ++panel->stats.bytes;
+            if (a0)
+                iliData(panel, data[i]);
+            else
+                iliCommand(panel, data[i], cycle);
+        }
+    }
+    if (!panel->firstPixelAt && panel->stats.pixels)
+    {
+        panel->firstPixelAt = cycle;
+        panel->beforeFirstPixel = before;
+    }
+}
+
+
+void iliImage(const struct ili9163 *panel, uint8 image[LCD_FRAME_LEN])
+{
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+        {
+            const uint32 *cell = iliCell((struct ili9163 *)panel, ILI_MOUNTING, x, y);
+            int on = panel->displayOn && !panel->sleeping && !panel->reset;
+            uint32 c = on ? *cell ^ (panel->inverted ? 0x3ffff : 0) : 0;
+            uint32 r, g, b;
+            uint16 rgb;
+
+            r = c >> 12;
+            g = (c >> 6) & 0x3f;
+            b = c & 0x3f;
+            if (panel->madctl & ILI_BGR)
+            {
+                uint32 t = r;
+
+                r = b;
+                b = t;
+            }
+            rgb = ((r >> 1) << 11) | (g << 5) | (b >> 1);
+            image[(y * LCD_WIDTH + x) * 2] = rgb >> 8;
+            image[(y * LCD_WIDTH + x) * 2 + 1] = rgb & 0xff;
+        }
+    }
+}
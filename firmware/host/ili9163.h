@@ -0,0 +1,71 @@
+#ifndef __ILI9163_H__
+#define __ILI9163_H__
+
+/*
+ * ILI9163 model fed with the SPI transactions from the chip model. It keeps
+ * the panel's memory and the state that decides where pixels land, and
+ * counts what came over the wire, so a test can check what a viewer would
+ * see and what it cost to get it there.
+ */
+
+#include <stdint.h>
+#include "esp_common.h"
+#include "lcd.h"
+
+#define ILI_COLUMNS 128     // the glass is portrait
+#define ILI_ROWS 160
+#define ILI_MOUNTING 0x60   // MADCTL that shows the picture upright, as lcd.c sets it
+
+// MADCTL bits
+#define ILI_MY 0x80
+#define ILI_MX 0x40
+#define ILI_MV 0x20
+#define ILI_BGR 0x08
+
+struct iliStats
+{
+    uint32 transactions;    // SPI transactions
+    uint32 bytes;           // command, parameter and pixel bytes in them
+    uint32 commands;
+    uint32 memoryWrites;    // RAMWR commands
+    uint32 pixels;          // pixels written to the panel memory
+    uint32 clipped;         // pixels that fell outside of it
+    uint32 unknown;         // commands the model does not know
+    uint32 early;           // commands sent before the panel was ready after reset or sleep out
+    uint32 ignored;         // of the bytes, those sent while the reset pin was held low
+};
+
+struct ili9163
+{
+    int threeWire;          // IM pins strapped for 9-bit words, D/C bit first, A0 unused
+    int reset;              // reset pin held low
+    int sleeping;
+    int displayOn;
+    int inverted;
+    uint8 madctl;
+    uint8 colmod;
+    uint16 columnStart, columnEnd;
+    uint16 pageStart, pageEnd;
+    uint16 column, page;    // the address counter
+    uint8 command;
+    uint8 params[16];
+    int paramCount;
+    uint8 pixel[3];         // bytes of a pixel not complete yet
+    int pixelBytes;
+    uint64_t readyAt;       // cycle from which the panel takes commands
+    uint64_t firstPixelAt;  // cycle the transaction with the first pixel started, 0 before
+    struct iliStats beforeFirstPixel;   // what came over the wire ahead of it
+    uint32 gram[ILI_ROWS][ILI_COLUMNS];     // 18 bits, R6G6B6
+    struct iliStats stats;
+};
+
+// Power on with the reset pin low. threeWire must match how lcd.c was built.
+void iliInit(struct ili9163 *panel, int threeWire);
+// Wire the panel to the chip model as on the board, see lcd_hal.h
+void iliConnect(struct ili9163 *panel);
+void iliResetPin(struct ili9163 *panel, int level, uint64_t cycle);
+void iliTransfer(struct ili9163 *panel, int a0, const uint8 *data, int bits, uint64_t cycle);
+// What a viewer sees as big-endian RGB565 like a framebuffer, black while the display is off
+void iliImage(const struct ili9163 *panel, uint8 image[LCD_FRAME_LEN]);
+
+#endif
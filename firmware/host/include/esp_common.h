@@ -0,0 +1,134 @@
+#ifndef __ESP_COMMON_H__
+#define __ESP_COMMON_H__
+
+/*
+ * Host stand-in for the SDK's esp_common.h: the types, register access and
+ * system calls the firmware uses, served by the chip model in chip.c.
+ * Register addresses are those of the ESP31, only the GPIO outputs and the
+ * SPI3 master behave like hardware, the rest just hold what is written.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+
+#define BIT(nr) (1UL << (nr))
+#define BIT31 0x80000000
+#define BIT30 0x40000000
+#define BIT29 0x20000000
+#define BIT28 0x10000000
+#define BIT27 0x08000000
+#define BIT26 0x04000000
+#define BIT25 0x02000000
+#define BIT24 0x01000000
+#define BIT23 0x00800000
+#define BIT22 0x00400000
+#define BIT21 0x00200000
+#define BIT20 0x00100000
+#define BIT19 0x00080000
+#define BIT18 0x00040000
+#define BIT17 0x00020000
+#define BIT16 0x00010000
+
+#define ICACHE_FLASH_ATTR
+#define IRAM_ATTR
+
+uint32 simRead(uint32 addr);
+void simWrite(uint32 addr, uint32 value);
+
+#define READ_PERI_REG(addr) simRead(addr)
+#define WRITE_PERI_REG(addr, val) simWrite((addr), (val))
+#define CLEAR_PERI_REG_MASK(reg, mask) WRITE_PERI_REG((reg), (READ_PERI_REG(reg) & (~(mask))))
+#define SET_PERI_REG_MASK(reg, mask) WRITE_PERI_REG((reg), (READ_PERI_REG(reg) | (mask)))
+#define SET_PERI_REG_BITS(reg, bit_map, value, shift) \
+    WRITE_PERI_REG((reg), (READ_PERI_REG(reg) & (~((uint32)(bit_map) << (shift)))) | \
+                          ((uint32)((value) & (bit_map)) << (shift)))
+
+// GPIO matrix
+#define GPIO_BASE 0x60004000
+#define GPIO_OUT_W1TS (GPIO_BASE + 0x08)
+#define GPIO_OUT_W1TC (GPIO_BASE + 0x0c)
+#define GPIO_ENABLE (GPIO_BASE + 0x20)
+#define GPIO_FUNC_OUT_SEL4 (GPIO_BASE + 0x540)
+#define GPIO_FUNC_OUT_SEL5 (GPIO_BASE + 0x544)
+#define GPIO_GPIO_FUNC19_OUT_SEL 0x000000ff
+#define GPIO_GPIO_FUNC19_OUT_SEL_S 24
+#define GPIO_GPIO_FUNC20_OUT_SEL 0x000000ff
+#define GPIO_GPIO_FUNC20_OUT_SEL_S 0
+#define GPIO_GPIO_FUNC21_OUT_SEL 0x000000ff
+#define GPIO_GPIO_FUNC21_OUT_SEL_S 8
+#define VSPICLK_OUT_MUX_IDX 63
+#define VSPID_OUT_IDX 65
+#define VSPICS0_OUT_IDX 68
+
+// IO MUX
+#define PERIPHS_IO_MUX 0x60009000
+#define PERIPHS_IO_MUX_GPIO17_U (PERIPHS_IO_MUX + 0x4c)
+#define PERIPHS_IO_MUX_GPIO18_U (PERIPHS_IO_MUX + 0x50)
+#define PERIPHS_IO_MUX_GPIO19_U (PERIPHS_IO_MUX + 0x74)
+#define PERIPHS_IO_MUX_GPIO20_U (PERIPHS_IO_MUX + 0x78)
+#define PERIPHS_IO_MUX_GPIO21_U (PERIPHS_IO_MUX + 0x7c)
+#define MCU_SEL 0x00000007
+#define MCU_SEL_S 12
+
+// WiFi
+#define NULL_MODE 0x00
+#define STATION_MODE 0x01
+#define SOFTAP_MODE 0x02
+#define STATIONAP_MODE 0x03
+
+#define STATION_IDLE 0
+#define STATION_CONNECTING 1
+#define STATION_WRONG_PASSWORD 2
+#define STATION_NO_AP_FOUND 3
+#define STATION_CONNECT_FAIL 4
+#define STATION_GOT_IP 5
+
+struct station_config
+{
+    uint8 ssid[32];
+    uint8 password[64];
+    uint8 bssid_set;
+    uint8 bssid[6];
+};
+
+uint8 wifi_get_opmode(void);
+int wifi_set_opmode(uint8 opmode);
+int wifi_station_connect(void);
+int wifi_station_disconnect(void);
+int wifi_station_set_config(struct station_config *config);
+uint8 wifi_station_get_connect_status(void);
+
+// System
+const char *system_get_sdk_version(void);
+uint32 system_get_cpu_freq(void);
+uint32 system_get_free_heap_size(void);
+void system_print_meminfo(void);
+uint32 system_get_time(void);
+void system_restart(void);
+
+// SPI flash
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum
+{
+    SPI_FLASH_RESULT_OK,
+    SPI_FLASH_RESULT_ERR,
+    SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef INC_FREERTOS_H
+#define INC_FREERTOS_H
+
+/*
+ * Host stand-in for FreeRTOS: tasks are threads, or a single task running
+ * against the virtual clock, see rtos.c
+ */
+
+#include "esp_common.h"
+
+#define portBASE_TYPE int
+typedef uint32 portTickType;
+typedef portTickType TickType_t;
+typedef portBASE_TYPE BaseType_t;
+
+#define portTICK_RATE_MS 10
+#define portMAX_DELAY ((portTickType)0xffffffffUL)
+
+#define pdFALSE ((portBASE_TYPE)0)
+#define pdTRUE ((portBASE_TYPE)1)
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define tskIDLE_PRIORITY 0
+
+// Interrupt handlers run to the end, there is no scheduler to hand over to
+#define portEND_SWITCHING_ISR(xSwitchRequired) ((void)(xSwitchRequired))
+
+#endif
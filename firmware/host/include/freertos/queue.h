@@ -0,0 +1,8 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *xQueueHandle;
+
+#endif
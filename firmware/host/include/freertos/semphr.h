@@ -0,0 +1,17 @@
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *xSemaphoreHandle;
+
+xSemaphoreHandle simSemaphoreCreate(unsigned portBASE_TYPE max, unsigned portBASE_TYPE initial);
+
+#define vSemaphoreCreateBinary(xSemaphore) ((xSemaphore) = simSemaphoreCreate(1, 1))
+#define xSemaphoreCreateCounting(uxMaxCount, uxInitialCount) simSemaphoreCreate((uxMaxCount), (uxInitialCount))
+
+portBASE_TYPE xSemaphoreTake(xSemaphoreHandle xSemaphore, portTickType xBlockTime);
+portBASE_TYPE xSemaphoreGive(xSemaphoreHandle xSemaphore);
+portBASE_TYPE xSemaphoreGiveFromISR(xSemaphoreHandle xSemaphore, portBASE_TYPE *pxHigherPriorityTaskWoken);
+
+#endif
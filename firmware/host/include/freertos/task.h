@@ -0,0 +1,20 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *xTaskHandle;
+typedef void (*pdTASK_CODE)(void *pvParameters);
+
+portBASE_TYPE xTaskCreate(pdTASK_CODE pvTaskCode, const char *pcName, unsigned short usStackDepth,
+                          void *pvParameters, unsigned portBASE_TYPE uxPriority, xTaskHandle *pvCreatedTask);
+void vTaskDelay(portTickType xTicksToDelay);
+portTickType xTaskGetTickCount(void);
+
+// Keeps other tasks and the interrupt handler out, as on the single core target
+void simLock(void);
+void simUnlock(void);
+#define taskENTER_CRITICAL() simLock()
+#define taskEXIT_CRITICAL() simUnlock()
+
+#endif
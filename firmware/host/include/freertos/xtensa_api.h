@@ -0,0 +1,20 @@
+#ifndef __XTENSA_API_H__
+#define __XTENSA_API_H__
+
+/*
+ * The CPU cycle counter and its CCOMPARE timer interrupts, see chip.c
+ */
+
+#include "esp_common.h"
+
+#define XCHAL_TIMER_INTERRUPT(n) ((n) == 0 ? 6 : (n) == 1 ? 15 : 16)
+
+typedef void (*xt_handler)(void *);
+
+unsigned xthal_get_ccount(void);
+void xthal_set_ccompare(int n, unsigned value);
+unsigned int xt_ints_on(unsigned int mask);
+unsigned int xt_ints_off(unsigned int mask);
+xt_handler xt_set_interrupt_handler(int n, xt_handler f, void *arg);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __LWIP_SOCKETS_H__
+#define __LWIP_SOCKETS_H__
+
+/*
+ * Host stand-in for lwIP: the BSD socket calls are the host's own, only
+ * bind() goes through net.c to move the server off port 80
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+int simBind(int s, const struct sockaddr *name, socklen_t namelen);
+#define bind(s, name, namelen) simBind((s), (name), (namelen))
+
+#endif
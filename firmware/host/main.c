@@ -0,0 +1,411 @@
+/*
+ * xmas-sim: the firmware on Linux, serving /video like the device does.
+ * With -b it streams frames to itself over TCP, as a browser would, and
+ * reports how many make it to the panel and how long they take. The SPI
+ * stream drives a model of the panel, so what it shows can be checked
+ * and saved.
+ */
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+#include "lcd.h"
+#include "lcd_hal.h"
+#include "ili9163.h"
+#include "sim.h"
+
+#undef bind
+
+
+#define SIM_WAIT_MS 5000    // for the pump to catch up before giving up on a frame
+
+void user_init(void);
+
+static struct ili9163 panel;
+static FILE *spiDump;
+
+
+// Each transaction goes to the panel and, with -s, to the dump: A0, the bit
+// count as 16 bits little-endian, then the bytes
+static void captureSpi(void *ctx, int a0, const uint8 *data, int bits, uint64_t cycle)
+{
+    uint8 header[3] = { a0, bits & 0xff, bits >> 8 };
+
+    iliTransfer(&panel, a0, data, bits, cycle);
+    if (!spiDump)
+        return;
+    fwrite(header, 1, sizeof(header), spiDump);
+    fwrite(data, 1, (bits + 7) / 8, spiDump);
+}
+
+
+static void panelImage(uint8 image[LCD_FRAME_LEN])
+{
+    taskENTER_CRITICAL();
+    iliImage(&panel, image);
+    taskEXIT_CRITICAL();
+}
+
+
+// What the panel shows as a binary PPM
+static int savePanel(const char *name)
+{
+    static uint8 image[LCD_FRAME_LEN];
+    FILE *f = fopen(name, "wb");
+    int i;
+
+    if (!f)
+    {
+        perror(name);
+        return EXIT_FAILURE;
+    }
+    panelImage(image);
+    fprintf(f, "P6\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+    for (i = 0; i < LCD_FRAME_LEN; i += 2)
+    {
+        uint16 c = image[i] << 8 | image[i + 1];
+        uint8 rgb[3] = { (c >> 11) << 3 | c >> 13, ((c >> 5) & 0x3f) << 2 | ((c >> 9) & 3), (c & 0x1f) << 3 | ((c >> 2) & 7) };
+
+        fwrite(rgb, 1, sizeof(rgb), f);
+    }
+    return fclose(f) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+static int sendAll(int s, const uint8 *data, size_t length)
+{
+    while (length)
+    {
+        ssize_t sent = send(s, data, length, 0);
+
+        if (sent <= 0)
+            return EXIT_FAILURE;
+        data += sent;
+        length -= sent;
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// A binary or control frame as a browser sends it, masked
+static int sendFrame(int s, int opcode, const uint8 *payload, size_t length)
+{
+    static uint8 frame[14 + LCD_FRAME_LEN];
+    size_t n = 0;
+    uint8 *mask;
+    size_t i;
+
+    frame[n++] = 0x80 | opcode;
+    if (length < 126)
+    {
+        frame[n++] = 0x80 | length;
+    }
+    else
+    {
+        frame[n++] = 0x80 | 126;
+        frame[n++] = length >> 8;
+        frame[n++] = length & 0xff;
+    }
+    mask = frame + n;
+    for (i = 0; i < 4; ++i)
+        mask[i] = rand();
+    n += 4;
+    for (i = 0; i < length; ++i)
+        frame[n + i] = payload[i] ^ mask[i & 3];
+    return sendAll(s, frame, n + length);
+}
+
+
+static int connectServer(int port)
+{
+    struct sockaddr_in server;
+    char request[256];
+    char reply[1024];
+    size_t got = 0;
+    int s;
+    int i;
+    int one = 1;
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(port);
+    // The server task may not be listening yet
+    for (i = 0; ; ++i)
+    {
+        s = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(s, (struct sockaddr *)&server, sizeof(server)) == 0)
+            break;
+        close(s);
+        if (i == 100)
+            return -1;
+        usleep(20000);
+    }
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    snprintf(request, sizeof(request),
+             "GET /video HTTP/1.1\r\n"
+             "Host: 127.0.0.1:%d\r\n"
+             "Upgrade: websocket\r\n"
+             "Connection: Upgrade\r\n"
+             "Origin: http://127.0.0.1\r\n"
+             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+             "Sec-WebSocket-Version: 13\r\n\r\n", port);
+    if (sendAll(s, (const uint8 *)request, strlen(request)) == EXIT_FAILURE)
+        return -1;
+    while (got < sizeof(reply) - 1)
+    {
+        ssize_t n = recv(s, reply + got, sizeof(reply) - 1 - got, 0);
+
+        if (n <= 0)
+            return -1;
+        got += n;
+        reply[got] = 0;
+        if (strstr(reply, "\r\n\r\n"))
+            break;
+    }
+    if (strncmp(reply, "HTTP/1.1 101", 12) != 0)
+    {
+        fprintf(stderr, "bench: handshake refused\n");
+        return -1;
+    }
+    return s;
+}
+
+
+// Every pixel changes from one frame to the next, so none of them can be skipped
+static void drawFrame(uint8 *frame, int k)
+{
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+        {
+            uint16 c = ((x + k) & 0x1f) << 11 | ((y * 2 + k) & 0x3f) << 5 | ((x + y + k) & 0x1f);
+
+            frame[(y * LCD_WIDTH + x) * 2] = c >> 8;
+            frame[(y * LCD_WIDTH + x) * 2 + 1] = c & 0xff;
+        }
+    }
+}
+
+
+// Wait until the frames the pump has finished with reach done, or all that
+// were submitted if done is 0. Returns the time they did.
+static double waitFrames(uint32 done, int shownOnly)
+{
+    double start = seconds();
+    struct lcdStats stats;
+    struct timespec poll = { 0, 50000 };
+
+    for (;;)
+    {
+        lcdGetStats(&stats);
+        if ((shownOnly ? stats.shown : stats.shown + stats.dropped) >= (done ? done : stats.submitted))
+            return seconds();
+        if (seconds() - start > SIM_WAIT_MS / 1000.0)
+            return -1;
+        nanosleep(&poll, NULL);
+    }
+}
+
+
+static int bench(int port, int frames, int interval)
+{
+    static uint8 frame[LCD_FRAME_LEN];
+    static uint8 image[LCD_FRAME_LEN];
+    struct lcdStats before;
+    struct lcdStats after;
+    struct simStats sim;
+    double start, sent, done;
+    double latency, latencyMin = 1e9, latencyMax = 0, latencySum = 0;
+    int probes = frames / 10 < 10 ? 10 : frames / 10;
+    uint8 reply[64];
+    int s;
+    int k;
+
+    if ((s = connectServer(port)) < 0)
+    {
+        fprintf(stderr, "bench: can't connect to port %d\n", port);
+        return EXIT_FAILURE;
+    }
+
+    // Throughput: frames as fast as TCP takes them, or one per interval
+    waitFrames(0, 0);
+    lcdGetStats(&before);
+    start = seconds();
+    for (k = 0; k < frames; ++k)
+    {
+        drawFrame(frame, k);
+        if (sendFrame(s, 0x2, frame, sizeof(frame)) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        if (interval)
+            usleep(interval * 1000);
+    }
+    sent = seconds();
+    done = waitFrames(before.shown + before.dropped + frames, 0);
+    lcdGetStats(&after);
+    if (done < 0)
+    {
+        fprintf(stderr, "bench: only %u of %d frames came through\n",
+                after.shown + after.dropped - before.shown - before.dropped, frames);
+        return EXIT_FAILURE;
+    }
+    printf("bench: %d frames sent in %.2f s, %.1f fps\n", frames, sent - start, frames / (sent - start));
+    printf("bench: %u shown, %u dropped, %.1f fps on the panel\n",
+           after.shown - before.shown, after.dropped - before.dropped,
+           (after.shown - before.shown) / (done - start));
+    printf("bench: SPI %u bytes in %u transactions per frame, %u underruns\n",
+           after.frameBytes, after.frameTransactions, after.spiUnderruns - before.spiUnderruns);
+
+    // Latency: one frame at a time, from its first byte to the end of its scan-out
+    for (k = 0; k < probes; ++k)
+    {
+        lcdGetStats(&before);
+        drawFrame(frame, frames + k);
+        start = seconds();
+        if (sendFrame(s, 0x2, frame, sizeof(frame)) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        done = waitFrames(before.shown + 1, 1);
+        if (done < 0)
+        {
+            fprintf(stderr, "bench: frame %d never shown\n", k);
+            return EXIT_FAILURE;
+        }
+        latency = (done - start) * 1000;
+        latencySum += latency;
+        if (latency < latencyMin)
+            latencyMin = latency;
+        if (latency > latencyMax)
+            latencyMax = latency;
+    }
+    printf("bench: latency over %d frames %.2f ms on average, %.2f ms best, %.2f ms worst\n",
+           probes, latencySum / probes, latencyMin, latencyMax);
+
+    // The last of them must be on the glass as sent
+    panelImage(image);
+    if (memcmp(image, frame, LCD_FRAME_LEN) != 0)
+    {
+        fprintf(stderr, "bench: the panel does not show the last frame sent\n");
+        return EXIT_FAILURE;
+    }
+    printf("bench: panel got %u bytes in %u transactions, shows the last frame\n",
+           panel.stats.bytes, panel.stats.transactions);
+
+    simGetStats(&sim);
+    printf("bench: %u interrupts, %u missed timers, SPI %u busy writes, %u busy starts, %u A0 changes\n",
+           sim.interrupts, sim.missedTimers, sim.spiBusyWrites, sim.spiBusyStarts, sim.a0Changes);
+
+    sendFrame(s, 0x8, NULL, 0);
+    while (recv(s, reply, sizeof(reply), 0) > 0)
+        ;
+    close(s);
+    usleep(200000);     // let the server print its stats
+    return EXIT_SUCCESS;
+}
+
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: xmas-sim [-p port] [-s file] [-o file] [-b frames [-i ms]]\n"
+            "  -p port    serve /video on this port instead of 80, default %d\n"
+            "  -s file    write the SPI stream to the panel to file\n"
+            "  -o file    save what the panel shows as PPM on exit\n"
+            "  -b frames  stream frames to the server and report frame rate and latency\n"
+            "  -i ms      pause between frames for -b\n", SIM_PORT);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int port = SIM_PORT;
+    int frames = 0;
+    int interval = 0;
+    const char *image = NULL;
+    int result = EXIT_SUCCESS;
+    sigset_t quit;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:o:b:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            if (!(spiDump = fopen(optarg, "wb")))
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            image = optarg;
+            break;
+        case 'b':
+            frames = atoi(optarg);
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    // Blocked before the task threads start, so only main() sees them
+    sigemptyset(&quit);
+    sigaddset(&quit, SIGINT);
+    sigaddset(&quit, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &quit, NULL);
+    simInit(SIM_REALTIME);
+    simSetPort(port);
+#ifdef LCD_3WIRE
+    iliInit(&panel, 1);
+#else
+    iliInit(&panel, 0);
+#endif
+    iliConnect(&panel);
+    simSpiCapture(captureSpi, NULL);
+    user_init();
+
+    if (frames > 0)
+    {
+        result = bench(port, frames, interval);
+    }
+    else
+    {
+        sigwait(&quit, &opt);
+    }
+    if (image && savePanel(image) == EXIT_FAILURE)
+        result = EXIT_FAILURE;
+    if (spiDump)
+        fclose(spiDump);
+    return result == EXIT_SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,46 @@
+/*
+ * The one lwIP difference on the host: port 80 wants root, the server is
+ * moved to another port
+ */
+
+#include <errno.h>
+
+#include "esp_common.h"
+#include "lwip/sockets.h"
+
+#include "sim.h"
+
+#undef bind
+
+
+static int simPort = SIM_PORT;
+
+
+void simSetPort(int port)
+{
+    simPort = port;
+}
+
+
+int simBind(int s, const struct sockaddr *name, socklen_t namelen)
+{
+    struct sockaddr_in local;
+    int reuse = 1;
+
+    if (name->sa_family != AF_INET || namelen < sizeof(local))
+        return bind(s, name, namelen);
+    memcpy(&local, name, sizeof(local));
+    if (ntohs(local.sin_port) == 80)
+    {
+        printf("sim: port 80 is %d\n", simPort);
+        local.sin_port = htons(simPort);
+    }
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(s, (struct sockaddr *)&local, sizeof(local)) == -1)
+    {
+        // The server would retry for ever
+        fprintf(stderr, "sim: can't bind port %d: %s\n", ntohs(local.sin_port), strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * FreeRTOS calls for the host build, see sim.h. In real time tasks are
+ * threads. In virtual time there is only the calling task, and blocking
+ * runs the timer interrupt until the wait is over.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "sim.h"
+
+
+#define SIM_TICK_CYCLES ((uint64_t)SIM_CPU_MHZ * 1000 * portTICK_RATE_MS)
+
+struct simTask
+{
+    pdTASK_CODE code;
+    void *parameters;
+};
+
+struct simSemaphore
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t given;
+    unsigned portBASE_TYPE count;
+    unsigned portBASE_TYPE max;
+};
+
+
+static void *simTaskStart(void *arg)
+{
+    struct simTask task = *(struct simTask *)arg;
+
+    free(arg);
+    task.code(task.parameters);
+    return NULL;
+}
+
+
+portBASE_TYPE xTaskCreate(pdTASK_CODE pvTaskCode, const char *pcName, unsigned short usStackDepth,
+                          void *pvParameters, unsigned portBASE_TYPE uxPriority, xTaskHandle *pvCreatedTask)
+{
+    struct simTask *task;
+    pthread_t thread;
+
+    if (simMode() == SIM_VIRTUAL)
+    {
+        fprintf(stderr, "sim: no task %s in virtual time\n", pcName);
+        return pdFAIL;
+    }
+    task = malloc(sizeof(*task));
+    task->code = pvTaskCode;
+    task->parameters = pvParameters;
+    if (pthread_create(&thread, NULL, simTaskStart, task) != 0)
+    {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    if (pvCreatedTask)
+        *pvCreatedTask = (xTaskHandle)thread;
+    return pdPASS;
+}
+
+
+void vTaskDelay(portTickType xTicksToDelay)
+{
+    simSleep(xTicksToDelay * portTICK_RATE_MS);
+}
+
+
+portTickType xTaskGetTickCount(void)
+{
+    return (portTickType)(simCycles() / SIM_TICK_CYCLES);
+}
+
+
+xSemaphoreHandle simSemaphoreCreate(unsigned portBASE_TYPE max, unsigned portBASE_TYPE initial)
+{
+    struct simSemaphore *sem = malloc(sizeof(*sem));
+    pthread_condattr_t monotonic;
+
+    pthread_mutex_init(&sem->mutex, NULL);
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&sem->given, &monotonic);
+    sem->count = initial;
+    sem->max = max;
+    return sem;
+}
+
+
+static int simSemaphoreReady(void *ctx)
+{
+    struct simSemaphore *sem = ctx;
+
+    return sem->count > 0;
+}
+
+
+portBASE_TYPE xSemaphoreTake(xSemaphoreHandle xSemaphore, portTickType xBlockTime)
+{
+    struct simSemaphore *sem = xSemaphore;
+    struct timespec until;
+    portBASE_TYPE taken;
+    int timedOut = 0;
+
+    if (simMode() == SIM_VIRTUAL)
+    {
+        if (!sem->count && xBlockTime == portMAX_DELAY &&
+            !simRunUntil(SIM_FOREVER, simSemaphoreReady, sem))
+        {
+            // Nothing left that could give it
+            fprintf(stderr, "sim: task blocked for good\n");
+            abort();
+        }
+        if (!sem->count && xBlockTime)
+            simRunUntil(simCycles() + xBlockTime * SIM_TICK_CYCLES, simSemaphoreReady, sem);
+        if (!sem->count)
+            return pdFALSE;
+        --sem->count;
+        return pdTRUE;
+    }
+
+    if (xBlockTime != portMAX_DELAY)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += xBlockTime * portTICK_RATE_MS / 1000;
+        until.tv_nsec += (xBlockTime * portTICK_RATE_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000)
+        {
+            ++until.tv_sec;
+            until.tv_nsec -= 1000000000;
+        }
+    }
+    pthread_mutex_lock(&sem->mutex);
+    while (!sem->count && xBlockTime && !timedOut)
+    {
+        if (xBlockTime == portMAX_DELAY)
+            pthread_cond_wait(&sem->given, &sem->mutex);
+        else
+            timedOut = pthread_cond_timedwait(&sem->given, &sem->mutex, &until) == ETIMEDOUT;
+    }
+    taken = sem->count > 0;
+    if (taken)
+        --sem->count;
+    pthread_mutex_unlock(&sem->mutex);
+    return taken ? pdTRUE : pdFALSE;
+}
+
+
+portBASE_TYPE xSemaphoreGive(xSemaphoreHandle xSemaphore)
+{
+    struct simSemaphore *sem = xSemaphore;
+    portBASE_TYPE given = pdFALSE;
+
+    pthread_mutex_lock(&sem->mutex);
+    if (sem->count < sem->max)
+    {
+        ++sem->count;
+        pthread_cond_signal(&sem->given);
+        given = pdTRUE;
+    }
+    pthread_mutex_unlock(&sem->mutex);
+    return given;
+}
+
+
+portBASE_TYPE xSemaphoreGiveFromISR(xSemaphoreHandle xSemaphore, portBASE_TYPE *pxHigherPriorityTaskWoken)
+{
+    if (pxHigherPriorityTaskWoken)
+        *pxHigherPriorityTaskWoken = pdTRUE;
+    return xSemaphoreGive(xSemaphore);
+}
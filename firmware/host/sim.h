@@ -0,0 +1,70 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+/*
+ * Runs the firmware on Linux. chip.c models the ESP31 parts it touches,
+ * rtos.c the FreeRTOS calls and net.c the one lwIP difference. Everything
+ * the firmware writes to the panel comes out of simSpiCapture().
+ */
+
+#include <stdint.h>
+#include "esp_common.h"
+
+#define SIM_CPU_MHZ 160
+#define SIM_DRAM_ADDR 0x3ffa0000    // framebuffers in user_main.c live here
+#define SIM_DRAM_LEN 0x20000
+#define SIM_FLASH_LEN 0x400000
+#define SIM_PORT 8080               // the server's port 80 is moved here
+
+#define SIM_FOREVER UINT64_MAX
+
+// How time passes
+#define SIM_REALTIME 0  // the cycle counter follows the host clock, tasks are threads
+#define SIM_VIRTUAL 1   // a single task, time moves as it reads the clock, touches
+                        // registers or blocks, interrupts run in between
+
+struct simStats
+{
+    uint32 interrupts;      // timer interrupts taken
+    uint32 missedTimers;    // timer armed in the past, so it only fired after the counter wrapped
+    uint32 spiBusyWrites;   // SPI_Wn written while a transaction was on the wire
+    uint32 spiBusyStarts;   // transaction started while the last one was on the wire
+    uint32 a0Changes;       // A0 moved while a transaction was on the wire
+    uint32 flashErrors;     // flash calls the SDK would refuse
+};
+
+// Bits of one SPI transaction, MSB first as they went out, with the level of
+// A0 while they did
+typedef void (*simSpiFn)(void *ctx, int a0, const uint8 *data, int bits, uint64_t cycle);
+// An output pin changed
+typedef void (*simPinFn)(void *ctx, int pin, int level, uint64_t cycle);
+
+// Map the DRAM window and reset the chip. Call once, first thing.
+void simInit(int mode);
+int simMode();
+
+uint64_t simCycles();
+uint64_t simMicros();
+
+// Virtual time only: take timer interrupts as they come due until stop(ctx)
+// is true, then move the clock on to cycle. Returns what stop() said last,
+// without moving the clock if it said stop. stop may be NULL.
+int simRunUntil(uint64_t cycle, int (*stop)(void *ctx), void *ctx);
+// Let ms go by, in either mode
+void simSleep(uint32 ms);
+
+void simSpiCapture(simSpiFn fn, void *ctx);
+void simPinWatch(simPinFn fn, void *ctx);
+
+void simGetStats(struct simStats *stats);
+
+// The flash as the SDK calls see it, SIM_FLASH_LEN bytes
+uint8 *simFlash();
+
+// Port the server's port 80 is bound to instead, SIM_PORT by default
+void simSetPort(int port);
+
+// Run the timer interrupt if it is due and the task may be interrupted, virtual time only
+void simPoll();
+
+#endif
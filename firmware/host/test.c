@@ -0,0 +1,141 @@
+/*
+ * Host test helpers, see test.h
+ */
+
+#include <stdarg.h>
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "lcd.h"
+#include "frame.h"
+#include "ili9163.h"
+#include "sim.h"
+#include "test.h"
+
+
+struct ili9163 testPanel;
+uint64_t testBootCycle;
+
+static uint8 *testBuffers[TEST_FB_COUNT] = { (uint8 *)0x3ffa8000, (uint8 *)0x3ffb2000 };
+static int testChecks;
+static int testFailures;
+
+struct testPayload
+{
+    const uint8 *data;
+    size_t left;
+};
+
+void testStart()
+{
+    simInit(SIM_VIRTUAL);
+#ifdef LCD_3WIRE
+    iliInit(&testPanel, 1);
+#else
+    iliInit(&testPanel, 0);
+#endif
+    iliConnect(&testPanel);
+    testBootCycle = simCycles();
+    lcdInit(testBuffers, TEST_FB_COUNT);
+    lcdWriteFrame();
+    frameReset();
+    testSettle();
+}
+
+
+int testCheck(int ok, const char *format, ...)
+{
+    va_list args;
+
+    ++testChecks;
+    if (ok)
+        return ok;
+    ++testFailures;
+    printf("FAIL: ");
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    return ok;
+}
+
+
+// frameReadFn over a payload in memory, reading past its end fails like the server's
+static int testRead(void *ctx, uint8 *buffer, size_t length)
+{
+    struct testPayload *payload = ctx;
+
+    if (length > payload->left)
+        return EXIT_FAILURE;
+    memcpy(buffer, payload->data, length);
+    payload->data += length;
+    payload->left -= length;
+    return EXIT_SUCCESS;
+}
+
+
+int testDisplay(const uint8 *data, size_t length)
+{
+    struct testPayload payload = { data, length };
+
+    return frameDisplay(testRead, &payload, length);
+}
+
+
+void testSettle()
+{
+    testCheck(lcdWaitDone(1000 / portTICK_RATE_MS), "pump still busy after a second");
+}
+
+
+const uint8 *testImage()
+{
+    static uint8 image[LCD_FRAME_LEN];
+
+    testSettle();
+    iliImage(&testPanel, image);
+    return image;
+}
+
+
+int testShows(const uint8 *expected, const char *what)
+{
+    const uint8 *image = testImage();
+    int wrong = 0;
+    int first = -1;
+    int i;
+
+    for (i = 0; i < LCD_FRAME_LEN / 2; ++i)
+    {
+        if (image[i * 2] != expected[i * 2] || image[i * 2 + 1] != expected[i * 2 + 1])
+        {
+            if (first < 0)
+                first = i;
+            ++wrong;
+        }
+    }
+    if (!wrong)
+        return testCheck(1, "%s", what);
+    return testCheck(0, "%s: %d pixels wrong, first at %d,%d is %02x%02x, not %02x%02x", what, wrong,
+                     first % LCD_WIDTH, first / LCD_WIDTH, image[first * 2], image[first * 2 + 1],
+                     expected[first * 2], expected[first * 2 + 1]);
+}
+
+
+int testFinish()
+{
+    struct simStats sim;
+
+    testSettle();
+    simGetStats(&sim);
+    testCheck(!sim.missedTimers, "%u timers armed in the past", sim.missedTimers);
+    testCheck(!sim.spiBusyWrites && !sim.spiBusyStarts,
+              "SPI touched while busy, %u writes and %u starts", sim.spiBusyWrites, sim.spiBusyStarts);
+    testCheck(!sim.a0Changes, "A0 moved %u times while SPI was busy", sim.a0Changes);
+    testCheck(!sim.flashErrors, "%u flash calls refused", sim.flashErrors);
+    testCheck(!testPanel.stats.early, "%u commands before the panel was ready", testPanel.stats.early);
+    testCheck(!testPanel.stats.unknown, "%u unknown panel commands", testPanel.stats.unknown);
+    testCheck(!testPanel.stats.clipped, "%u pixels outside the panel", testPanel.stats.clipped);
+    printf("%d checks, %d failed\n", testChecks, testFailures);
+    return testFailures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
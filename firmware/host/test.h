@@ -0,0 +1,33 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+/*
+ * What the host tests share: the firmware booted in virtual time with the
+ * panel model on the SPI bus, and checks that count what failed.
+ */
+
+#include "esp_common.h"
+#include "lcd.h"
+#include "ili9163.h"
+
+#define TEST_FB_COUNT 2
+
+extern struct ili9163 testPanel;
+extern uint64_t testBootCycle;      // when testStart() called lcdInit()
+
+// Boot like user_init() does and wait for the cleared first frame
+void testStart();
+// Print what failed unless ok, returns ok
+int testCheck(int ok, const char *format, ...) __attribute__((format(printf, 2, 3)));
+// Hand a binary frame payload to frameDisplay() as the server would, returns its result
+int testDisplay(const uint8 *payload, size_t length);
+// Let the pump finish every frame written so far
+void testSettle();
+// What the panel shows once the pump is done, big-endian RGB565
+const uint8 *testImage();
+// Is the panel showing expected, a big-endian RGB565 frame
+int testShows(const uint8 *expected, const char *what);
+// Check the model saw nothing amiss, print the summary and return the exit code
+int testFinish();
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Clip uploads main.js does not send: frames that would nest, commands out
+ * of order, uploads that stop half way and one that runs out of room. None
+ * may leave a clip behind, write past the clip's flash or touch the panel.
+ * Played clips are checked against main.js in test_frames.
+ */
+
+#include "esp_common.h"
+#include "lcd.h"
+#include "frame.h"
+#include "clip.h"
+#include "sim.h"
+#include "test.h"
+
+#define INTERVAL 40
+
+static uint8 message[2 + 1 + LCD_FRAME_LEN];
+static uint8 shown[LCD_FRAME_LEN];
+
+
+// An upload command with the frame bytes after it
+static void command(uint8 cmd, const uint8 *data, size_t length)
+{
+    message[0] = FRAME_CLIP;
+    message[1] = cmd;
+    memcpy(message + 2, data, length);
+    testCheck(testDisplay(message, 2 + length) == EXIT_SUCCESS, "clip command %u: read failed", cmd);
+}
+
+
+static void begin()
+{
+    static const uint8 interval[2] = { INTERVAL >> 8, INTERVAL & 0xff };
+
+    command(CLIP_BEGIN, interval, 2);
+}
+
+
+static void end()
+{
+    command(CLIP_END, NULL, 0);
+}
+
+
+// A frame of one colour, as RECTS or raw
+static void add(int raw, uint16 colour)
+{
+    static uint8 frame[LCD_FRAME_LEN];
+    static const uint8 rects[] = { FRAME_RECTS, 1, 0, 0, 1, 1 };
+    int i;
+
+    for (i = 0; i < LCD_FRAME_LEN; i += 2)
+    {
+        frame[i] = colour >> 8;
+        frame[i + 1] = colour & 0xff;
+    }
+    if (raw)
+    {
+        command(CLIP_ADD, frame, LCD_FRAME_LEN);
+        return;
+    }
+    memcpy(frame, rects, sizeof(rects));
+    command(CLIP_ADD, frame, sizeof(rects) + 2);
+}
+
+
+static void checkClip(int frames, const char *what)
+{
+    int stored = clipOpen();
+
+    testCheck(stored == frames, "%s: %d frames stored, not %d", what, stored, frames);
+}
+
+
+static void testOutOfOrder()
+{
+    static const uint8 timed[] = { FRAME_TIMED, 0, 1, 0, 0, 0, 40, FRAME_RECTS };
+    static const uint8 clip[] = { FRAME_CLIP, CLIP_ERASE };
+
+    begin();
+    add(0, 0xf800);
+    end();
+    checkClip(1, "one frame");
+
+    // Wrapped frames keep their own time or upload clips, a clip holds neither
+    begin();
+    add(0, 0xf800);
+    command(CLIP_ADD, timed, sizeof(timed));
+    end();
+    checkClip(0, "timed frame in a clip");
+    begin();
+    command(CLIP_ADD, clip, sizeof(clip));
+    add(0, 0xf800);
+    end();
+    checkClip(0, "clip command in a clip");
+
+    add(0, 0x07e0);
+    end();
+    checkClip(0, "frame before the clip began");
+    begin();
+    end();
+    checkClip(0, "clip without frames");
+
+    // An upload the connection dropped in the middle of
+    begin();
+    add(1, 0x001f);
+    checkClip(0, "clip not ended");
+    begin();
+    add(1, 0x001f);
+    add(0, 0xffff);
+    end();
+    checkClip(2, "clip begun again");
+    command(CLIP_ERASE, NULL, 0);
+    checkClip(0, "erased clip");
+}
+
+
+// Raw frames until the flash is full: the one after is refused, and the upload with it
+static void testFull()
+{
+    uint8 *flash = simFlash();
+    uint32 last = CLIP_FLASH_ADDR + CLIP_FLASH_SIZE;
+    int fit = (CLIP_FLASH_SIZE - CLIP_SECTOR) / LCD_FRAME_LEN;
+    uint32 i;
+
+    for (i = last; i < SIM_FLASH_LEN; ++i)
+        flash[i] = i * 7;
+    begin();
+    for (i = 0; i <= fit; ++i)
+        add(1, i);
+    end();
+    checkClip(0, "clip too long");
+    for (i = last; i < SIM_FLASH_LEN && flash[i] == (uint8)(i * 7); ++i)
+        ;
+    testCheck(i == SIM_FLASH_LEN, "flash written at 0x%x, past the clip", i);
+
+    begin();
+    for (i = 0; i < fit; ++i)
+        add(1, i);
+    end();
+    checkClip(fit, "clip filling the flash");
+}
+
+
+int main()
+{
+    testStart();
+    memcpy(shown, testImage(), LCD_FRAME_LEN);
+    testOutOfOrder();
+    testFull();
+    testShows(shown, "panel left alone by uploads");
+    return testFinish();
+}
@@ -0,0 +1,211 @@
+/*
+ * Replay what html/main.js sent and drew, see vectors.js: after the
+ * messages up to each S record the panel must show its image exactly, and
+ * the device must have asked for a keyframe where a K record says so and
+ * nowhere else. A clip recorded on the way, its frames in C records, is
+ * played from flash at the end: each frame must show in turn, on time.
+ * Reports the bytes each frame took against a raw one, and the host time
+ * frameDisplay() spent on them, the scan-out left out.
+ *
+ *   test_frames file.vec
+ */
+
+#include <time.h>
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "lcd.h"
+#include "frame.h"
+#include "tile.h"
+#include "clip.h"
+#include "sim.h"
+#include "test.h"
+
+#define CLIP_LOOPS 2
+
+
+struct record
+{
+    uint8 kind;
+    uint32 length;
+    const uint8 *data;
+};
+
+static uint8 *vectors;
+static size_t vectorsLength;
+static size_t vectorsPos;
+
+static const uint8 *clipFrames[CLIP_MAX_FRAMES];
+static int clipCount;
+
+struct clipCheck
+{
+    uint32 interval;        // ms from the clip's header
+    int shown;              // frames played so far
+    uint64_t start;         // us when the first was played
+};
+
+
+static void load(const char *name)
+{
+    FILE *f = fopen(name, "rb");
+    long length;
+
+    if (!f || fseek(f, 0, SEEK_END) != 0 || (length = ftell(f)) < 0)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    rewind(f);
+    vectors = malloc(length + 1);
+    if (fread(vectors, 1, length, f) != length)
+    {
+        perror(name);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    vectorsLength = length;
+}
+
+
+static int next(struct record *record)
+{
+    const uint8 *p = vectors + vectorsPos;
+
+    if (vectorsPos + 5 > vectorsLength)
+        return 0;
+    record->kind = p[0];
+    record->length = p[1] | p[2] << 8 | p[3] << 16 | (uint32)p[4] << 24;
+    record->data = p + 5;
+    if (record->length > vectorsLength - vectorsPos - 5 ||
+        (record->kind == 'S' && record->length != LCD_FRAME_LEN))
+    {
+        fprintf(stderr, "test_frames: bad record at %zu\n", vectorsPos);
+        exit(EXIT_FAILURE);
+    }
+    vectorsPos += 5 + record->length;
+    return 1;
+}
+
+
+static double seconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// clipWaitFn: each frame of the clip shows in turn, then the clock moves to the next
+static int clipWait(void *ctx, uint32 ms)
+{
+    struct clipCheck *check = ctx;
+    uint64_t now = simMicros();
+    uint64_t until = simCycles() + (uint64_t)ms * 1000 * SIM_CPU_MHZ;
+    int64_t late;
+    char what[64];
+
+    if (check->shown == 0)
+        check->start = now;
+    // The clip keeps to whole ticks, so a frame may be up to one early or late
+    late = (int64_t)(now - check->start) - (int64_t)check->shown * check->interval * 1000;
+    testCheck(late > -portTICK_RATE_MS * 1000 && late < portTICK_RATE_MS * 1000,
+              "clip frame %d played %lld us off time", check->shown, (long long)late);
+    snprintf(what, sizeof(what), "clip frame %d", check->shown % clipCount);
+    testShows(clipFrames[check->shown % clipCount], what);
+    ++check->shown;
+    if (check->shown == CLIP_LOOPS * clipCount)
+        return 1;
+    simRunUntil(until, NULL, NULL);
+    return 0;
+}
+
+
+static void clipCheckPlay(const char *name)
+{
+    struct clipHeader header;
+    struct clipStats stats;
+    struct clipCheck check = { 0, 0, 0 };
+
+    memcpy(&header, simFlash() + CLIP_FLASH_ADDR, sizeof(header));
+    testCheck(header.magic == CLIP_MAGIC, "no clip stored");
+    testCheck(header.frames == clipCount, "%u frames in the clip, not %d", header.frames, clipCount);
+    if (header.magic != CLIP_MAGIC || header.frames != clipCount)
+        return;
+    check.interval = header.interval;
+    clipPlay(clipWait, &check);
+    clipGetStats(&stats);
+    testCheck(check.shown == CLIP_LOOPS * clipCount, "clip stopped after %d frames", check.shown);
+    testCheck(stats.loops == CLIP_LOOPS, "clip played %u times, not %d", stats.loops, CLIP_LOOPS);
+    testCheck(!stats.late, "%u clip frames late", stats.late);
+    testCheck(!frameKeyframeWanted(), "keyframe asked for while the clip played");
+    printf("bench: %s: %d frame clip every %u ms, %u bytes in flash\n", name, clipCount, header.interval,
+           header.length);
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct record record;
+    struct tileStats tiles;
+    char what[64];
+    uint32 frames = 0;
+    uint32 bytes = 0;
+    double decoding = 0;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: test_frames file.vec\n");
+        return EXIT_FAILURE;
+    }
+    load(argv[1]);
+    testStart();
+    while (next(&record))
+    {
+        switch (record.kind)
+        {
+        case 'M':
+        {
+            double start = seconds();
+
+            testCheck(testDisplay(record.data, record.length) == EXIT_SUCCESS,
+                      "message of %u bytes after frame %u failed", record.length, frames);
+            decoding += seconds() - start;
+            bytes += record.length;
+            break;
+        }
+        case 'S':
+            snprintf(what, sizeof(what), "frame %u", frames);
+            testShows(record.data, what);
+            testCheck(!frameKeyframeWanted(), "frame %u: keyframe asked for", frames);
+            ++frames;
+            break;
+        case 'K':
+            testCheck(frameKeyframeWanted(), "frame %u: no keyframe asked for", frames);
+            break;
+        case 'C':
+            if (record.length != LCD_FRAME_LEN || clipCount == CLIP_MAX_FRAMES)
+            {
+                fprintf(stderr, "test_frames: bad clip record\n");
+                return EXIT_FAILURE;
+            }
+            clipFrames[clipCount++] = record.data;
+            break;
+        default:
+            fprintf(stderr, "test_frames: unknown record %c\n", record.kind);
+            return EXIT_FAILURE;
+        }
+    }
+    testCheck(frames > 0, "no frames in %s", argv[1]);
+    if (frames)
+        printf("bench: %s: %u frames, %u bytes a frame, %.1f%% of raw, frameDisplay() %.1f us a frame on this host\n",
+               argv[1], frames, bytes / frames, 100.0 * bytes / frames / LCD_FRAME_LEN, decoding * 1e6 / frames);
+    if (clipCount)
+        clipCheckPlay(argv[1]);
+    tileGetStats(&tiles);
+    if (tiles.hits + tiles.misses)
+        printf("bench: %s: tiles %u hits, %u misses, %u evictions, %u fills, %u of %d slots used\n",
+               argv[1], tiles.hits, tiles.misses, tiles.evictions, tiles.fills, tiles.used, TILE_SLOTS);
+    return testFinish();
+}
@@ -0,0 +1,322 @@
+/*
+ * JPEG frames against libjpeg: images encoded by libjpeg in every sampling
+ * the decoder takes must show pixel for pixel as libjpeg decodes them with
+ * the same integer IDCT and plain upsampling. Frames it does not take must
+ * leave the panel alone. Ends with the host time per frame.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <jpeglib.h>
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "lcd.h"
+#include "frame.h"
+#include "jpeg.h"
+#include "test.h"
+
+#define BENCH_FRAMES 200
+
+static uint8 rgb[256 * 256 * 3];
+static uint8 expected[LCD_FRAME_LEN];
+static uint8 scratch[LCD_FRAME_LEN];
+
+
+// Gradients, hard edges and a block of fine detail, different for each seed
+static void drawImage(int width, int height, int seed)
+{
+    int x, y;
+
+    for (y = 0; y < height; ++y)
+    {
+        for (x = 0; x < width; ++x)
+        {
+            uint8 *p = rgb + (y * width + x) * 3;
+
+            p[0] = x * 255 / width;
+            p[1] = y * 255 / height;
+            p[2] = (x + y + seed * 40) & 0xff;
+            if (((x + seed * 7) / 16 + y / 16) % 5 == 0)
+            {
+                p[0] = 255 - p[0];
+                p[2] = seed * 60;
+            }
+            if (x >= 90 && x < 130 && y >= 20 && y < 60 && ((x ^ y) & 4))
+                p[0] = p[1] = p[2] = 240;
+        }
+    }
+}
+
+
+struct encoding
+{
+    const char *what;
+    int width, height;
+    int quality;
+    int h, v;               // luma sampling, 0 for greyscale
+    int restart;            // MCUs per restart interval
+    int progressive;
+};
+
+
+static unsigned char *encode(const struct encoding *e, unsigned long *length)
+{
+    struct jpeg_compress_struct c;
+    struct jpeg_error_mgr err;
+    unsigned char *out = NULL;
+    JSAMPROW row;
+
+    c.err = jpeg_std_error(&err);
+    jpeg_create_compress(&c);
+    jpeg_mem_dest(&c, &out, length);
+    c.image_width = e->width;
+    c.image_height = e->height;
+    c.input_components = 3;
+    c.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&c);
+    jpeg_set_quality(&c, e->quality, TRUE);
+    if (e->h)
+    {
+        c.comp_info[0].h_samp_factor = e->h;
+        c.comp_info[0].v_samp_factor = e->v;
+    }
+    else
+    {
+        jpeg_set_colorspace(&c, JCS_GRAYSCALE);
+    }
+    c.restart_interval = e->restart;
+    if (e->progressive)
+        jpeg_simple_progression(&c);
+    jpeg_start_compress(&c, TRUE);
+    while (c.next_scanline < c.image_height)
+    {
+        row = rgb + c.next_scanline * e->width * 3;
+        jpeg_write_scanlines(&c, &row, 1);
+    }
+    jpeg_finish_compress(&c);
+    jpeg_destroy_compress(&c);
+    return out;
+}
+
+
+// libjpeg's decode, cropped onto a black panel
+static void decodeReference(const unsigned char *jpeg, unsigned long length)
+{
+    struct jpeg_decompress_struct d;
+    struct jpeg_error_mgr err;
+    uint8 line[256 * 3];
+    JSAMPROW row = line;
+    int x;
+
+    d.err = jpeg_std_error(&err);
+    jpeg_create_decompress(&d);
+    jpeg_mem_src(&d, (unsigned char *)jpeg, length);
+    jpeg_read_header(&d, TRUE);
+    d.out_color_space = JCS_RGB;
+    d.dct_method = JDCT_ISLOW;
+    d.do_fancy_upsampling = FALSE;
+    jpeg_start_decompress(&d);
+    memset(expected, 0, sizeof(expected));
+    while (d.output_scanline < d.output_height)
+    {
+        int y = d.output_scanline;
+
+        jpeg_read_scanlines(&d, &row, 1);
+        for (x = 0; x < LCD_WIDTH && x < d.output_width && y < LCD_HEIGHT; ++x)
+        {
+            uint16 c = (line[x * 3] >> 3) << 11 | (line[x * 3 + 1] >> 2) << 5 | line[x * 3 + 2] >> 3;
+
+            expected[(y * LCD_WIDTH + x) * 2] = c >> 8;
+            expected[(y * LCD_WIDTH + x) * 2 + 1] = c & 0xff;
+        }
+    }
+    jpeg_finish_decompress(&d);
+    jpeg_destroy_decompress(&d);
+}
+
+
+// The top rows of the panel against the reference
+static void checkSame(const char *what, int rows)
+{
+    const uint8 *image = testImage();
+    int worst = 0;
+    int off = 0;
+    int i;
+
+    for (i = 0; i < rows * LCD_WIDTH * 2; i += 2)
+    {
+        int a = image[i] << 8 | image[i + 1];
+        int b = expected[i] << 8 | expected[i + 1];
+        int dr = abs((a >> 11) - (b >> 11));
+        int dg = abs(((a >> 5) & 0x3f) - ((b >> 5) & 0x3f));
+        int db = abs((a & 0x1f) - (b & 0x1f));
+        int d = dr > dg ? (dr > db ? dr : db) : (dg > db ? dg : db);
+
+        if (d > worst)
+            worst = d;
+        off += d != 0;
+    }
+    testCheck(!off, "%s: %d pixels off libjpeg, by up to %d", what, off, worst);
+}
+
+
+static void testDecodes()
+{
+    static const struct encoding encodings[] =
+    {
+        { "4:2:0 quality 75", 160, 128, 75, 2, 2, 0, 0 },
+        { "4:4:4 quality 95", 160, 128, 95, 1, 1, 0, 0 },
+        { "4:2:2 quality 50", 160, 128, 50, 2, 1, 0, 0 },
+        { "4:4:0 quality 60", 160, 128, 60, 1, 2, 0, 0 },
+        { "greyscale", 160, 128, 80, 0, 0, 0, 0 },
+        { "restart every 3 MCUs", 160, 128, 75, 2, 2, 3, 0 },
+        { "restart every MCU", 160, 128, 75, 1, 1, 1, 0 },
+        { "smaller than the panel", 100, 61, 75, 2, 2, 0, 0 },
+        { "larger than the panel", 203, 150, 75, 2, 2, 0, 0 },
+    };
+    int k;
+
+    for (k = 0; k < sizeof(encodings) / sizeof(encodings[0]); ++k)
+    {
+        const struct encoding *e = &encodings[k];
+        unsigned long length;
+        unsigned char *jpeg;
+
+        drawImage(e->width, e->height, k);
+        jpeg = encode(e, &length);
+        decodeReference(jpeg, length);
+        testCheck(testDisplay(jpeg, length) == EXIT_SUCCESS, "%s: read failed", e->what);
+        checkSame(e->what, LCD_HEIGHT);
+        free(jpeg);
+    }
+}
+
+
+// main.js pads a JPEG that comes out at exactly LCD_FRAME_LEN after its EOI marker
+static void testPadded()
+{
+    static const struct encoding e = { "padded", 160, 128, 75, 2, 2, 0, 0 };
+    unsigned long length;
+    unsigned char *jpeg;
+    uint8 *padded;
+
+    drawImage(e.width, e.height, 11);
+    jpeg = encode(&e, &length);
+    decodeReference(jpeg, length);
+    padded = calloc(length + 3, 1);
+    memcpy(padded, jpeg, length);
+    testDisplay(padded, length + 3);
+    checkSame("bytes after EOI", LCD_HEIGHT);
+    free(padded);
+    free(jpeg);
+}
+
+
+// Frames the decoder does not take are counted and change nothing
+static void testRejects()
+{
+    static const struct encoding progressive = { "progressive", 160, 128, 75, 2, 2, 0, 1 };
+    static const struct encoding baseline = { "baseline", 160, 128, 75, 2, 2, 0, 0 };
+    struct jpegStats before, after;
+    unsigned long length;
+    unsigned char *jpeg;
+    unsigned long i;
+
+    memcpy(scratch, testImage(), LCD_FRAME_LEN);
+    jpegGetStats(&before);
+
+    drawImage(160, 128, 20);
+    jpeg = encode(&progressive, &length);
+    testCheck(testDisplay(jpeg, length) == EXIT_SUCCESS, "progressive: read failed");
+    testShows(scratch, "progressive JPEG left alone");
+    free(jpeg);
+
+    // 12-bit samples
+    jpeg = encode(&baseline, &length);
+    for (i = 0; i + 4 < length && !(jpeg[i] == 0xff && jpeg[i + 1] == 0xc0); ++i)
+        ;
+    jpeg[i + 4] = 12;
+    testCheck(testDisplay(jpeg, length) == EXIT_SUCCESS, "12-bit: read failed");
+    testShows(scratch, "12-bit JPEG left alone");
+    free(jpeg);
+
+    jpegGetStats(&after);
+    testCheck(after.decoded == before.decoded, "%u bad frames decoded", after.decoded - before.decoded);
+    testCheck(after.bad - before.bad == 2, "%u of 2 bad frames counted", after.bad - before.bad);
+}
+
+
+// A scan cut short still shows, what arrived of it as it should
+static void testTruncated()
+{
+    static const struct encoding e = { "truncated", 160, 128, 75, 2, 2, 0, 0 };
+    struct jpegStats before, after;
+    unsigned long length;
+    unsigned char *jpeg;
+
+    jpegGetStats(&before);
+    drawImage(e.width, e.height, 30);
+    jpeg = encode(&e, &length);
+    decodeReference(jpeg, length);
+    testCheck(testDisplay(jpeg, length / 2) == EXIT_SUCCESS, "truncated: read failed");
+    checkSame("first MCU row of a truncated JPEG", 16);
+    jpegGetStats(&after);
+    testCheck(after.decoded == before.decoded + 1, "truncated JPEG not decoded");
+    free(jpeg);
+}
+
+
+// Read from memory past the format byte, as frameDisplay() hands over
+struct benchReader
+{
+    const uint8 *data;
+};
+
+static int benchRead(void *ctx, uint8 *buffer, size_t length)
+{
+    struct benchReader *reader = ctx;
+
+    memcpy(buffer, reader->data, length);
+    reader->data += length;
+    return EXIT_SUCCESS;
+}
+
+
+// Host time to decode a full frame into a framebuffer, SPI left out
+static void bench()
+{
+    static const struct encoding e = { "bench", 160, 128, 75, 2, 2, 0, 0 };
+    struct timespec start, end;
+    unsigned long length;
+    unsigned char *jpeg;
+    int k;
+
+    drawImage(e.width, e.height, 3);
+    jpeg = encode(&e, &length);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (k = 0; k < BENCH_FRAMES; ++k)
+    {
+        struct benchReader reader = { jpeg + 1 };
+
+        if (jpegReadHeader(benchRead, &reader, length - 1) != JPEG_OK || jpegDecode(scratch) != JPEG_OK)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    testCheck(k == BENCH_FRAMES, "bench frame %d did not decode", k);
+    printf("bench: %lu byte 4:2:0 frame decoded in %.1f us on this host\n", length,
+           ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e3 / BENCH_FRAMES);
+    free(jpeg);
+}
+
+
+int main()
+{
+    testStart();
+    testDecodes();
+    testPadded();
+    testRejects();
+    testTruncated();
+    bench();
+    return testFinish();
+}
@@ -0,0 +1,230 @@
+/*
+ * FRAME_TIMED in virtual time: frames sent at a steady pace but arriving
+ * with jitter must reach the panel at that pace, a frame too late to be
+ * worth showing is dropped without holding up the next, and timed frames
+ * that wrap another timed frame or a clip command are refused.
+ */
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "lcd.h"
+#include "lcd_hal.h"
+#include "frame.h"
+#include "pace.h"
+#include "clip.h"
+#include "sim.h"
+#include "test.h"
+
+#ifdef LCD_3WIRE
+#define WIRE_BITS 9     // per byte
+#else
+#define WIRE_BITS 8
+#endif
+
+#define INTERVAL 50         // sender ms between frames
+#define FRAMES 24
+#define SLACK_US 3000       // how far off its pace a frame may be shown
+
+static uint8 message[7 + LCD_FRAME_LEN];
+static uint8 expected[LCD_FRAME_LEN];
+static uint16 timedSeq;
+
+// Panel pixels written so far, and the time each full frame was done
+static uint32 pixelsBase;
+static uint64_t doneAt[FRAMES];
+static int doneCount;
+
+
+// Full frames are done once as many pixels as they hold have gone to the panel
+static void captureSpi(void *ctx, int a0, const uint8 *data, int bits, uint64_t cycle)
+{
+    iliTransfer(&testPanel, a0, data, bits, cycle);
+    if (doneCount < FRAMES && testPanel.stats.pixels - pixelsBase >= (doneCount + 1) * (LCD_FRAME_LEN / 2))
+        doneAt[doneCount++] = cycle;
+}
+
+
+static void watchFrames()
+{
+    pixelsBase = testPanel.stats.pixels;
+    doneCount = 0;
+}
+
+
+// us a full frame takes on the wire, near enough
+static uint64_t wireUs()
+{
+    return (uint64_t)LCD_FRAME_LEN * WIRE_BITS * lcdHalSpiBitCycles16() / 16 / SIM_CPU_MHZ;
+}
+
+
+static uint64_t us(uint64_t cycle)
+{
+    return cycle / SIM_CPU_MHZ;
+}
+
+
+static void runTo(uint64_t atUs)
+{
+    if (simMicros() < atUs)
+        simRunUntil(atUs * SIM_CPU_MHZ, NULL, NULL);
+}
+
+
+// A raw frame of one colour, wrapped in FRAME_TIMED with sender time pts
+static void sendTimed(uint32 pts, uint16 colour)
+{
+    int i;
+
+    message[0] = FRAME_TIMED;
+    message[1] = timedSeq >> 8;
+    message[2] = timedSeq & 0xff;
+    message[3] = pts >> 24;
+    message[4] = pts >> 16;
+    message[5] = pts >> 8;
+    message[6] = pts;
+    for (i = 0; i < LCD_FRAME_LEN; i += 2)
+    {
+        message[7 + i] = expected[i] = colour >> 8;
+        message[7 + i + 1] = expected[i + 1] = colour & 0xff;
+    }
+    ++timedSeq;
+    testCheck(testDisplay(message, sizeof(message)) == EXIT_SUCCESS, "timed frame %u: read failed", pts);
+}
+
+
+static uint16 colour(int k)
+{
+    return 0x1000 + k * 0x0841;
+}
+
+
+/*
+ * Up to 90 ms of network jitter on a frame every 50 ms: none of it may
+ * show. The first frame is slow, so the pace has to follow the quickest
+ * one from when it comes.
+ */
+static void testJitter()
+{
+    struct lcdStats before, after;
+    struct paceStats pace;
+    uint64_t start = simMicros();
+    uint32 jitter[FRAMES];
+    uint32 seed = 1;
+    int quickest = 0;
+    int k;
+
+    lcdGetStats(&before);
+    watchFrames();
+    for (k = 0; k < FRAMES; ++k)
+    {
+        seed = seed * 1103515245 + 12345;
+        jitter[k] = k ? (seed >> 16) % 90000 : 30000;
+        if (jitter[k] < jitter[quickest])
+            quickest = k;
+        runTo(start + k * INTERVAL * 1000 + jitter[k]);
+        sendTimed(10000 + k * INTERVAL, colour(k));
+    }
+    testShows(expected, "last timed frame");
+    lcdGetStats(&after);
+    paceGetStats(&pace);
+
+    testCheck(doneCount == FRAMES, "%d of %d timed frames shown", doneCount, FRAMES);
+    testCheck(quickest < FRAMES / 2, "quickest frame %d comes too late to tell", quickest);
+    for (k = quickest + 1; k < doneCount; ++k)
+    {
+        int64_t off = (int64_t)(us(doneAt[k]) - start) - (int64_t)k * INTERVAL * 1000 - jitter[quickest] -
+                      (PACE_DELAY_MS * 1000 + wireUs());
+
+        testCheck(off > -SLACK_US && off < SLACK_US, "timed frame %d shown %lld us off its pace", k,
+                  (long long)off);
+    }
+    testCheck(after.timed - before.timed == FRAMES, "%u frames timed", after.timed - before.timed);
+    testCheck(after.presented - before.presented == FRAMES, "%u frames presented", after.presented - before.presented);
+    testCheck(after.lateDrops == before.lateDrops, "%u frames dropped late", after.lateDrops - before.lateDrops);
+    testCheck(pace.jitterMs < 90, "%u ms jitter measured", pace.jitterMs);
+    printf("bench: %d timed frames, %u ms worst jitter, shown %u us after due on average, %u us at worst\n",
+           FRAMES, pace.jitterMs, (after.presentUs - before.presentUs) / FRAMES, after.presentMaxUs);
+}
+
+
+/*
+ * The network stalls and three frames come in at once, the first of them
+ * too late to be worth showing: it is dropped, the second is shown late
+ * and the third on time
+ */
+static void testLate()
+{
+    struct lcdStats before, after;
+    uint64_t start = simMicros();
+    uint64_t stall = start + (3 * INTERVAL + PACE_DELAY_MS + 110) * 1000;
+    int k;
+
+    lcdGetStats(&before);
+    watchFrames();
+    for (k = 0; k < 8; ++k)
+    {
+        runTo(k >= 4 && k <= 6 ? stall : start + k * INTERVAL * 1000);
+        sendTimed(20000 + k * INTERVAL, colour(k));
+    }
+    testShows(expected, "frames after a stall");
+    lcdGetStats(&after);
+    testCheck(after.lateDrops - before.lateDrops == 1, "%u frames dropped late, not 1", after.lateDrops - before.lateDrops);
+    testCheck(doneCount == 7, "%d frames shown, not 7", doneCount);
+    if (doneCount == 7)
+    {
+        int64_t off = (int64_t)(us(doneAt[5]) - us(doneAt[3])) - 3 * INTERVAL * 1000;
+
+        testCheck(off > -SLACK_US && off < SLACK_US, "frame after a stall shown %lld us off its pace",
+                  (long long)off);
+        testCheck(us(doneAt[4]) > us(doneAt[3]) + 2 * INTERVAL * 1000 + SLACK_US,
+                  "frame held up by a stall shown on time");
+    }
+}
+
+
+// Only one level of wrapping, and nothing that uploads a clip
+static void testNested()
+{
+    static const uint8 timedTimed[] = { FRAME_TIMED, 0, 1, 0, 0, 0, 1,
+                                        FRAME_TIMED, 0, 2, 0, 0, 0, 2, FRAME_RECTS, 1, 0, 0, 1, 1, 0xf8, 0 };
+    static const uint8 timedClip[] = { FRAME_TIMED, 0, 3, 0, 0, 0, 3, FRAME_CLIP, CLIP_BEGIN, 0, 40 };
+    static const uint8 add[] = { FRAME_CLIP, CLIP_ADD, FRAME_RECTS, 1, 0, 0, 1, 1, 0, 0x1f };
+    static const uint8 end[] = { FRAME_CLIP, CLIP_END };
+    static const uint8 rect[] = { FRAME_RECTS, 1, 0, 0, 1, 1, 0x07, 0xe0 };
+    struct lcdStats before, after;
+    struct paceStats paceBefore, paceAfter;
+    uint64_t start;
+
+    lcdGetStats(&before);
+    paceGetStats(&paceBefore);
+    testDisplay(timedTimed, sizeof(timedTimed));
+    testShows(expected, "timed frame in a timed frame refused");
+    testDisplay(timedClip, sizeof(timedClip));
+    testDisplay(add, sizeof(add));
+    testDisplay(end, sizeof(end));
+    testCheck(clipOpen() == 0, "clip uploaded from a timed frame");
+
+    // Nothing is left waiting for a time either
+    start = simMicros();
+    testDisplay(rect, sizeof(rect));
+    expected[0] = 0x07;
+    expected[1] = 0xe0;
+    testShows(expected, "untimed frame after refused ones");
+    testCheck(simMicros() - start < 10000, "untimed frame took %llu us", (unsigned long long)(simMicros() - start));
+    lcdGetStats(&after);
+    paceGetStats(&paceAfter);
+    testCheck(after.timed == before.timed, "%u refused frames timed", after.timed - before.timed);
+    testCheck(paceAfter.frames == paceBefore.frames, "%u refused frames paced", paceAfter.frames - paceBefore.frames);
+}
+
+
+int main()
+{
+    testStart();
+    simSpiCapture(captureSpi, NULL);
+    testJitter();
+    testLate();
+    testNested();
+    return testFinish();
+}
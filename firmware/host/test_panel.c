@@ -0,0 +1,445 @@
+/*
+ * The pump against the panel model: what lcd.c sends must put each pixel
+ * format on the glass exactly, in as many bytes as it says it sent
+ */
+
+#include "esp_common.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lcd.h"
+#include "lcd_hal.h"
+#include "ili9163.h"
+#include "sim.h"
+#include "test.h"
+
+#ifdef LCD_3WIRE
+#define WIRE_BITS 9     // per byte
+#else
+#define WIRE_BITS 8
+#endif
+
+// Waits in lcdInitCmds: the reset pulse, after reset and after sleep out
+#define BOOT_DELAYS 3
+#define BOOT_DELAY_MS (150 + 10 + 10)
+#define TURNAROUND_CYCLES 100   // the pump waking to start a transaction or after a wait
+#define SETUP_BYTES (5 + 5 + 1)     // CASET, RASET and RAMWR ahead of each frame
+
+static uint8 expected[LCD_FRAME_LEN];
+
+// Transactions of the frame being watched: when it began and when its pixels did
+static int watching;
+static uint64_t frameAt, pixelsAt;
+static uint32 setupTransactions;
+
+
+static void putPixel(uint8 *frame, int x, int y, uint16 c)
+{
+    frame[(y * LCD_WIDTH + x) * 2] = c >> 8;
+    frame[(y * LCD_WIDTH + x) * 2 + 1] = c & 0xff;
+}
+
+
+static uint16 pattern(int x, int y, int seed)
+{
+    return ((x * 3 + seed) & 0x1f) << 11 | ((y * 5 + x + seed) & 0x3f) << 5 | ((x ^ y ^ seed) & 0x1f);
+}
+
+
+static void captureSpi(void *ctx, int a0, const uint8 *data, int bits, uint64_t cycle)
+{
+    uint32 pixels = testPanel.stats.pixels;
+
+    iliTransfer(&testPanel, a0, data, bits, cycle);
+    if (!watching || pixelsAt)
+        return;
+    if (!frameAt)
+        frameAt = cycle;
+    if (testPanel.stats.pixels > pixels)
+        pixelsAt = cycle;
+    else
+        ++setupTransactions;
+}
+
+
+// Panel bytes and transactions since the last call, checked against what lcd.c counted
+static void checkWire(const char *what, uint32 *bytes)
+{
+    static struct iliStats last;
+    static struct lcdStats lastLcd;
+    struct lcdStats stats;
+
+    lcdGetStats(&stats);
+    testCheck(testPanel.stats.bytes - last.bytes == stats.spiBytes - lastLcd.spiBytes,
+              "%s: panel got %u bytes, lcd.c sent %u", what,
+              testPanel.stats.bytes - last.bytes, stats.spiBytes - lastLcd.spiBytes);
+    testCheck(testPanel.stats.transactions - last.transactions == stats.spiTransactions - lastLcd.spiTransactions,
+              "%s: panel got %u transactions, lcd.c started %u", what,
+              testPanel.stats.transactions - last.transactions, stats.spiTransactions - lastLcd.spiTransactions);
+    testCheck(stats.spiUnderruns == lastLcd.spiUnderruns && stats.aborts == lastLcd.aborts,
+              "%s: %u underruns, %u aborts", what,
+              stats.spiUnderruns - lastLcd.spiUnderruns, stats.aborts - lastLcd.aborts);
+    if (bytes)
+        *bytes = testPanel.stats.bytes - last.bytes;
+    last = testPanel.stats;
+    lastLcd = stats;
+}
+
+
+static void testBoot()
+{
+    const struct iliStats *before;
+    uint64_t wire, took;
+
+    testCheck(!testPanel.reset && !testPanel.sleeping && testPanel.displayOn,
+              "panel out of reset, awake and on");
+    testCheck(testPanel.madctl == ILI_MOUNTING, "MADCTL %02x", testPanel.madctl);
+    testCheck(testPanel.colmod == LCD_RGB565, "COLMOD %02x", testPanel.colmod);
+    memset(expected, 0, sizeof(expected));
+    testShows(expected, "first frame cleared");
+    checkWire("boot", NULL);
+
+    // First pixels after the init sequence's delays and its bytes on the wire, little more
+    before = &testPanel.beforeFirstPixel;
+    wire = (uint64_t)before->bytes * WIRE_BITS * lcdHalSpiBitCycles16() / 16 +
+           (before->transactions + BOOT_DELAYS) * TURNAROUND_CYCLES;
+    took = testPanel.firstPixelAt - testBootCycle;
+    testCheck(testPanel.firstPixelAt && took < (uint64_t)BOOT_DELAY_MS * 1000 * SIM_CPU_MHZ + wire,
+              "first pixel %llu us after lcdInit(), the delays take %u ms and the wire %llu us",
+              (unsigned long long)(took / SIM_CPU_MHZ), BOOT_DELAY_MS, (unsigned long long)(wire / SIM_CPU_MHZ));
+    // Only the dummy transfer lcdInit() primes SPI with goes out before reset ends
+    testCheck(testPanel.stats.ignored <= 1, "%u bytes sent in reset", testPanel.stats.ignored);
+}
+
+
+static void testFullFrame()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    struct lcdStats stats;
+    uint64_t start, wire;
+    uint32 bytes;
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+            putPixel(buffer, x, y, pattern(x, y, 1));
+    }
+    memcpy(expected, buffer, LCD_FRAME_LEN);
+    start = simCycles();
+    lcdWriteFrame();
+    testShows(expected, "full frame");
+    checkWire("full frame", &bytes);
+    lcdGetStats(&stats);
+    testCheck(stats.frameBytes == bytes, "frame bytes %u, panel got %u", stats.frameBytes, bytes);
+    testCheck(bytes >= LCD_FRAME_LEN && bytes < LCD_FRAME_LEN + 64, "%u bytes for a full frame", bytes);
+    // The pump keeps the wire busy: the frame takes little more than its bits
+    wire = ((uint64_t)bytes * WIRE_BITS + 2 * stats.frameTransactions) * lcdHalSpiBitCycles16() / 16;
+    testCheck(simCycles() - start < wire * 21 / 20, "full frame took %llu cycles, the wire %llu",
+              (unsigned long long)(simCycles() - start), (unsigned long long)wire);
+}
+
+
+/*
+ * What a frame costs before its first pixel: the window, 11 bytes. 4-wire
+ * sends each command and its data on their own, 3-wire puts them in the
+ * burst with the first pixels.
+ */
+static void testSetup()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    uint64_t wire, took;
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+            putPixel(buffer, x, y, pattern(x, y, 5));
+    }
+    memcpy(expected, buffer, LCD_FRAME_LEN);
+    watching = 1;
+    frameAt = pixelsAt = 0;
+    setupTransactions = 0;
+    lcdWriteFrame();
+    testShows(expected, "frame after a frame");
+    watching = 0;
+    checkWire("frame after a frame", NULL);
+
+    wire = (uint64_t)SETUP_BYTES * WIRE_BITS * lcdHalSpiBitCycles16() / 16;
+    took = pixelsAt - frameAt;
+#ifdef LCD_3WIRE
+    testCheck(setupTransactions == 0 && took == 0, "%u transactions, %llu cycles before the first pixels",
+              setupTransactions, (unsigned long long)took);
+#else
+    testCheck(setupTransactions == 5, "%u transactions before the first pixels, not 5", setupTransactions);
+    testCheck(took < wire + setupTransactions * TURNAROUND_CYCLES, "%llu cycles before the first pixels, the wire %llu",
+              (unsigned long long)took, (unsigned long long)wire);
+#endif
+    printf("bench: frame setup, %u transactions and %.1f us before the first pixels, "
+           "the window %llu cycles on the wire\n", setupTransactions, (double)took / SIM_CPU_MHZ,
+           (unsigned long long)wire);
+}
+
+
+static void testRowSkip()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    uint32 bytes;
+    int x;
+
+    // The same picture again costs next to nothing
+    memcpy(buffer, expected, LCD_FRAME_LEN);
+    lcdWriteFrame();
+    testShows(expected, "unchanged frame");
+    checkWire("unchanged frame", &bytes);
+    testCheck(bytes < 64, "%u bytes for an unchanged frame", bytes);
+
+    // One changed row costs about a row
+    buffer = lcdGetBuffer(0);
+    memcpy(buffer, expected, LCD_FRAME_LEN);
+    for (x = 0; x < LCD_WIDTH; ++x)
+        putPixel(buffer, x, 77, pattern(x, 77, 9));
+    memcpy(expected, buffer, LCD_FRAME_LEN);
+    lcdWriteFrame();
+    testShows(expected, "one row changed");
+    checkWire("one row changed", &bytes);
+    testCheck(bytes >= LCD_WIDTH * 2 && bytes < LCD_WIDTH * 2 + 64, "%u bytes for one row", bytes);
+}
+
+
+static void testRects()
+{
+    static const struct lcdRect rects[] = { { 3, 5, 20, 7 }, { 100, 90, 60, 38 } };
+    uint8 *buffer = lcdGetBuffer(1);
+    uint32 bytes;
+    int i, x, y;
+
+    for (i = 0; i < 2; ++i)
+    {
+        for (y = rects[i].y; y < rects[i].y + rects[i].h; ++y)
+        {
+            for (x = rects[i].x; x < rects[i].x + rects[i].w; ++x)
+            {
+                putPixel(buffer, x, y, pattern(x, y, 20 + i));
+                putPixel(expected, x, y, pattern(x, y, 20 + i));
+            }
+        }
+    }
+    lcdWriteRects(rects, 2);
+    testShows(expected, "two rectangles");
+    checkWire("two rectangles", &bytes);
+    testCheck(bytes >= (20 * 7 + 60 * 38) * 2 && bytes < (20 * 7 + 60 * 38) * 2 + 64,
+              "%u bytes for two rectangles", bytes);
+}
+
+
+// Four bits a colour, widened the way the panel does
+static void testRgb444()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+        {
+            int r = (x + y) & 15, g = (x * 3) & 15, b = (y ^ x) & 15;
+            uint8 *p = buffer + y * LCD_ROW_BYTES(LCD_RGB444) + (x / 2) * 3;
+
+            if (x & 1)
+            {
+                p[1] = (p[1] & 0xf0) | r;
+                p[2] = (g << 4) | b;
+            }
+            else
+            {
+                p[0] = (r << 4) | g;
+                p[1] = (b << 4) | (p[1] & 0x0f);
+            }
+            putPixel(expected, x, y, ((r << 1) | (r >> 3)) << 11 | ((g << 2) | (g >> 2)) << 5 | ((b << 1) | (b >> 3)));
+        }
+    }
+    lcdWriteFrameFormat(LCD_RGB444);
+    testShows(expected, "12 bit frame");
+    checkWire("12 bit frame", NULL);
+    testCheck(testPanel.colmod == LCD_RGB444, "COLMOD %02x for a 12 bit frame", testPanel.colmod);
+}
+
+
+static void testIndexed()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    uint8 *palette = lcdGetPalette();
+    int i, x, y;
+
+    for (i = 0; i < 16; ++i)
+    {
+        palette[i * 2] = pattern(i, i, 40) >> 8;
+        palette[i * 2 + 1] = pattern(i, i, 40) & 0xff;
+    }
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+        {
+            int index = (x / 10 + y / 8) & 15;
+            uint8 *p = buffer + y * LCD_ROW_BYTES(LCD_INDEXED(4)) + x / 2;
+
+            *p = (x & 1) ? (*p & 0xf0) | index : (index << 4) | (*p & 0x0f);
+            putPixel(expected, x, y, pattern(index, index, 40));
+        }
+    }
+    lcdWriteFrameFormat(LCD_INDEXED(4));
+    testShows(expected, "4 bit indexed frame");
+    checkWire("4 bit indexed frame", NULL);
+    testCheck(testPanel.colmod == LCD_RGB565, "COLMOD %02x after a 12 bit frame", testPanel.colmod);
+}
+
+
+static void testScaled()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT / 2; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH / 2; ++x)
+        {
+            uint16 c = pattern(x, y, 60);
+
+            buffer[(y * LCD_WIDTH / 2 + x) * 2] = c >> 8;
+            buffer[(y * LCD_WIDTH / 2 + x) * 2 + 1] = c & 0xff;
+            putPixel(expected, x * 2, y * 2, c);
+            putPixel(expected, x * 2 + 1, y * 2, c);
+            putPixel(expected, x * 2, y * 2 + 1, c);
+            putPixel(expected, x * 2 + 1, y * 2 + 1, c);
+        }
+    }
+    lcdWriteFrameFormat(LCD_SCALED(1, 1));
+    testShows(expected, "half size frame");
+    checkWire("half size frame", NULL);
+}
+
+
+// BT.601 studio range in floating point, clamped and cut to RGB565 as the panel gets it
+static uint16 yuvReference(int y, int u, int v)
+{
+    double c = 1.164 * (y - 16);
+    double rgb[3] = { c + 1.596 * (v - 128), c - 0.392 * (u - 128) - 0.813 * (v - 128), c + 2.017 * (u - 128) };
+    int i;
+
+    for (i = 0; i < 3; ++i)
+        rgb[i] = rgb[i] < 0 ? 0 : rgb[i] > 255 ? 255 : rgb[i] + 0.5;
+    return ((int)rgb[0] >> 3) << 11 | ((int)rgb[1] >> 2) << 5 | ((int)rgb[2] >> 3);
+}
+
+
+/*
+ * Planar YUV 4:2:0 over the whole range of each plane, converted as it is
+ * scanned out. Fixed point may round a channel one step away from the
+ * reference, never further.
+ */
+static void testYuv420()
+{
+    uint8 *buffer = lcdGetBuffer(0);
+    uint8 *cb = buffer + LCD_WIDTH * LCD_HEIGHT;
+    uint8 *cr = cb + LCD_WIDTH * LCD_HEIGHT / 4;
+    const uint8 *image;
+    int exact = 0, near = 0, off = 0;
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+            buffer[y * LCD_WIDTH + x] = x * 2 + y;
+    }
+    for (y = 0; y < LCD_HEIGHT / 2; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH / 2; ++x)
+        {
+            cb[y * LCD_WIDTH / 2 + x] = x * 4 + y * 3;
+            cr[y * LCD_WIDTH / 2 + x] = (y * 8) ^ (x * 5);
+        }
+    }
+    lcdWriteFrameFormat(LCD_YUV420);
+    image = testImage();
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        for (x = 0; x < LCD_WIDTH; ++x)
+        {
+            int i = y * LCD_WIDTH + x;
+            int j = (y / 2) * (LCD_WIDTH / 2) + x / 2;
+            uint16 want = yuvReference(buffer[i], cb[j], cr[j]);
+            uint16 got = image[i * 2] << 8 | image[i * 2 + 1];
+            int dr = (got >> 11) - (want >> 11);
+            int dg = ((got >> 5) & 0x3f) - ((want >> 5) & 0x3f);
+            int db = (got & 0x1f) - (want & 0x1f);
+
+            if (got == want)
+                ++exact;
+            else if (dr >= -1 && dr <= 1 && dg >= -1 && dg <= 1 && db >= -1 && db <= 1)
+                ++near;
+            else if (off++ == 0)
+                testCheck(0, "YUV pixel %d,%d is %04x, reference %04x", x, y, got, want);
+            putPixel(expected, x, y, got);
+        }
+    }
+    testCheck(off == 0, "%d YUV pixels more than a step off", off);
+    testCheck(exact >= LCD_WIDTH * LCD_HEIGHT * 19 / 20, "only %d of %d YUV pixels exact", exact,
+              LCD_WIDTH * LCD_HEIGHT);
+    checkWire("YUV frame", NULL);
+    testCheck(testPanel.colmod == LCD_RGB565, "COLMOD %02x for a YUV frame", testPanel.colmod);
+}
+
+
+static void commandsDone(void *arg)
+{
+    ++*(int *)arg;
+}
+
+
+// lcdWaitDone() only covers frames, command lists report through their callback
+static int waitCommands(volatile int *done, int count)
+{
+    int i;
+
+    for (i = 0; i < 100 && *done < count; ++i)
+        vTaskDelay(1);
+    return testCheck(*done == count, "command list done %d times, not %d", *done, count);
+}
+
+
+static void testCommands()
+{
+    static const struct lcdCmd invert[] = { { 0x21, 0, 0 } };
+    static const struct lcdCmd normal[] = { { 0x20, 0, 0 } };
+    static uint8 inverted[LCD_FRAME_LEN];
+    static volatile int done = 0;
+    int i;
+
+    lcdQueueCommands(invert, 1, commandsDone, (void *)&done);
+    waitCommands(&done, 1);
+    for (i = 0; i < LCD_FRAME_LEN; ++i)
+        inverted[i] = ~expected[i];
+    testShows(inverted, "inverted by a queued command");
+    lcdQueueCommands(normal, 1, commandsDone, (void *)&done);
+    waitCommands(&done, 2);
+    testShows(expected, "back to normal");
+    checkWire("commands", NULL);
+}
+
+
+int main()
+{
+    testStart();
+    simSpiCapture(captureSpi, NULL);
+    testBoot();
+    testFullFrame();
+    testSetup();
+    testRowSkip();
+    testRects();
+    testRgb444();
+    testIndexed();
+    testScaled();
+    testYuv420();
+    testCommands();
+    return testFinish();
+}
@@ -0,0 +1,239 @@
+/*
+ * clientWorker() on a connection that hands its bytes over in segments of
+ * any size, as TCP may: the handshake, frames cut inside the header, the
+ * masking key, the extended length and the payload, and pings in between,
+ * must show and be answered exactly as when everything arrives whole, and
+ * frames too short for their format are passed over.
+ * recv(), send() and close() on the test's socket are the ones below, see
+ * the Makefile.
+ */
+
+#include "esp_common.h"
+#include "lwip/sockets.h"
+#include "lcd.h"
+#include "frame.h"
+#include "websocket.h"
+#include "test.h"
+
+#define SOCKET 1000             // the connection, no real descriptor
+#define MAX_FRAMES 16
+#define STREAM_LEN (1024 + MAX_FRAMES * (14 + LCD_FRAME_LEN))
+
+void clientWorker(int clientSocket);
+
+ssize_t __real_recv(int s, void *buffer, size_t length, int flags);
+ssize_t __real_send(int s, const void *buffer, size_t length, int flags);
+int __real_close(int s);
+
+// What the client sends, and where the panel must show an image before the bytes at offset are read
+static uint8 stream[STREAM_LEN];
+static size_t streamLength;
+static size_t requestLength;    // the browser sends nothing more until it has the answer
+static struct
+{
+    size_t offset;
+    const uint8 *image;
+} marks[MAX_FRAMES];
+static int markCount;
+
+// The connection as the worker sees it
+static size_t streamPos;
+static size_t segmentLeft;      // of the TCP segment being read
+static size_t maxSegment;       // 0 hands over as much as is asked for
+static int markNext;
+static uint8 replies[4096];
+static size_t repliesLength;
+static int closed;
+
+static uint8 images[3][LCD_FRAME_LEN];
+
+
+ssize_t __wrap_recv(int s, void *buffer, size_t length, int flags)
+{
+    char what[64];
+
+    if (s != SOCKET)
+        return __real_recv(s, buffer, length, flags);
+    // Frames are checked as the next one is about to be read
+    while (markNext < markCount && marks[markNext].offset == streamPos)
+    {
+        snprintf(what, sizeof(what), "image before byte %zu, segments up to %zu", streamPos, maxSegment);
+        testShows(marks[markNext++].image, what);
+    }
+    if (streamPos == streamLength)
+        return 0;
+    if (segmentLeft == 0)
+        segmentLeft = maxSegment ? 1 + (size_t)rand() % maxSegment : streamLength - streamPos;
+    if (streamPos < requestLength && segmentLeft > requestLength - streamPos)
+        segmentLeft = requestLength - streamPos;
+    if (length > segmentLeft)
+        length = segmentLeft;
+    if (length > streamLength - streamPos)
+        length = streamLength - streamPos;
+    memcpy(buffer, stream + streamPos, length);
+    streamPos += length;
+    segmentLeft -= length;
+    return length;
+}
+
+
+ssize_t __wrap_send(int s, const void *buffer, size_t length, int flags)
+{
+    if (s != SOCKET)
+        return __real_send(s, buffer, length, flags);
+    testCheck(!closed, "send after close");
+    if (length > sizeof(replies) - repliesLength)
+        return -1;
+    memcpy(replies + repliesLength, buffer, length);
+    repliesLength += length;
+    return length;
+}
+
+
+int __wrap_close(int s)
+{
+    if (s != SOCKET)
+        return __real_close(s);
+    ++closed;
+    return 0;
+}
+
+
+static void add(const void *data, size_t length)
+{
+    memcpy(stream + streamLength, data, length);
+    streamLength += length;
+}
+
+
+// A frame as a browser sends it, masked, with the length in as few bytes as it fits
+static void addFrame(int opcode, const uint8 *payload, size_t length)
+{
+    uint8 header[8];
+    size_t n = 0;
+    size_t i;
+
+    header[n++] = 0x80 | opcode;
+    if (length < 126)
+    {
+        header[n++] = 0x80 | length;
+    }
+    else
+    {
+        header[n++] = 0x80 | 126;
+        header[n++] = length >> 8;
+        header[n++] = length & 0xff;
+    }
+    for (i = 0; i < 4; ++i)
+        header[n++] = rand();
+    add(header, n);
+    for (i = 0; i < length; ++i)
+        stream[streamLength + i] = payload[i] ^ header[n - 4 + (i & 3)];
+    streamLength += length;
+}
+
+
+// The panel must show image once what was added so far has been read
+static void expect(const uint8 *image)
+{
+    marks[markCount].offset = streamLength;
+    marks[markCount++].image = image;
+}
+
+
+static void makeStream()
+{
+    static const char request[] =
+        "GET /video HTTP/1.1\r\n"
+        "Host: 192.168.4.1\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Origin: http://192.168.4.1\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n";
+    static uint8 rects[6 + 16 * 8 * 2] = { FRAME_RECTS, 1, 40, 30, 16, 8 };
+    // Frames too short to say what they hold are ignored, the connection stays
+    static const uint8 shortRects[] = { FRAME_RECTS };
+    static const uint8 shortScaled[] = { FRAME_SCALED, LCD_WIDTH };
+    static const uint8 shortIndexed[] = { FRAME_INDEXED, 4 };
+    int i;
+
+    for (i = 0; i < LCD_FRAME_LEN; ++i)
+    {
+        images[0][i] = i * 7 + (i >> 9);
+        images[2][i] = rand();
+    }
+    memcpy(images[1], images[0], LCD_FRAME_LEN);
+    for (i = 0; i < 16 * 8; ++i)
+    {
+        int at = ((30 + i / 16) * LCD_WIDTH + 40 + i % 16) * 2;
+
+        rects[6 + i * 2] = images[1][at] = 0xf8 | i;
+        rects[6 + i * 2 + 1] = images[1][at + 1] = i * 3;
+    }
+
+    add(request, sizeof(request) - 1);
+    requestLength = streamLength;
+    addFrame(WS_BINARY_FRAME, images[0], LCD_FRAME_LEN);
+    expect(images[0]);
+    addFrame(WS_PING_FRAME, (const uint8 *)"ping", 4);
+    addFrame(WS_BINARY_FRAME, rects, sizeof(rects));
+    expect(images[1]);
+    addFrame(WS_TEXT_FRAME, (const uint8 *)"hello", 5);
+    addFrame(WS_PING_FRAME, NULL, 0);
+    addFrame(WS_BINARY_FRAME, shortRects, sizeof(shortRects));
+    addFrame(WS_BINARY_FRAME, shortScaled, sizeof(shortScaled));
+    addFrame(WS_BINARY_FRAME, shortIndexed, sizeof(shortIndexed));
+    addFrame(WS_BINARY_FRAME, images[2], LCD_FRAME_LEN);
+    expect(images[2]);
+    addFrame(WS_CLOSING_FRAME, NULL, 0);
+}
+
+
+// The handshake answer, a pong for each ping and the close, nothing else
+static void checkReplies(const char *what)
+{
+    static const uint8 after[] = { 0x80 | WS_PONG_FRAME, 0, 0x80 | WS_PONG_FRAME, 0, 0x80 | WS_CLOSING_FRAME, 0 };
+    const uint8 *end = NULL;
+    size_t i;
+
+    for (i = 0; i + 4 <= repliesLength && !end; ++i)
+    {
+        if (memcmp(replies + i, "\r\n\r\n", 4) == 0)
+            end = replies + i + 4;
+    }
+    testCheck(repliesLength > 12 && memcmp(replies, "HTTP/1.1 101", 12) == 0, "%s: no handshake answer", what);
+    testCheck(end && replies + repliesLength - end == sizeof(after) && memcmp(end, after, sizeof(after)) == 0,
+              "%s: wrong replies after the handshake", what);
+}
+
+
+static void run(const char *what, size_t segment)
+{
+    streamPos = 0;
+    segmentLeft = 0;
+    maxSegment = segment;
+    markNext = 0;
+    repliesLength = 0;
+    closed = 0;
+
+    clientWorker(SOCKET);
+    testCheck(streamPos == streamLength, "%s: connection left after %zu of %zu bytes", what, streamPos,
+              streamLength);
+    testCheck(markNext == markCount, "%s: %d of %d frames checked", what, markNext, markCount);
+    testCheck(closed == 1, "%s: socket closed %d times", what, closed);
+    checkReplies(what);
+}
+
+
+int main()
+{
+    srand(1);
+    testStart();
+    makeStream();
+    run("whole frames", 0);
+    run("TCP segments (1-1460)", 1460);
+    run("small segments (1-7)", 7);
+    run("byte by byte", 1);
+    return testFinish();
+}
@@ -0,0 +1,301 @@
+// Test vectors from the sender itself: html/main.js runs under node with a
+// stand-in video, canvases and WebSocket, and what it sends and what it
+// draws for each frame go to a file test_frames replays on the firmware.
+//
+//   node vectors.js <set> <file>
+//
+// Records are a kind byte, a 32-bit little-endian length and that many bytes:
+//   M  a WebSocket message, a frame payload
+//   S  the 160x128 big-endian RGB565 frame the panel shows after the messages so far
+//   K  the device has asked for a keyframe, no data
+//   C  the next frame of the clip being recorded, as it shows when the clip plays
+"use strict";
+
+const fs = require("fs");
+const path = require("path");
+const vm = require("vm");
+
+const WIDTH = 160;
+const HEIGHT = 128;
+
+// Scenes, each the colour of a pixel of frame t
+const scenes = {
+  // A menu: flat background, bars, glyph-like marks and a moving cursor
+  ui: function (t, x, y) {
+    if (x >= 8 + t * 6 && x < 24 + t * 6 && y >= 100 && y < 116) {
+      return [255, 200, 0];
+    }
+    if (y >= 10 && y < 90 && y % 20 < 14 && x >= 10 && x < 150) {
+      let selected = Math.floor((y - 10) / 20) == t % 4;
+      if (x >= 16 && x < 120 && ((x * 7 + y * 3 + (x >> 2)) % 11) < 4 && y % 20 >= 3 && y % 20 < 11) {
+        return selected ? [0, 0, 0] : [255, 255, 255];
+      }
+      return selected ? [120, 220, 255] : [40, 60, 140];
+    }
+    return [16, 24, 48];
+  },
+  // A moving square and a line of marks on black, where a keyframe is mostly skipped pixels
+  sprite: function (t, x, y) {
+    if (x >= 20 + t * 9 && x < 40 + t * 9 && y >= 30 + t * 4 && y < 50 + t * 4) {
+      return [255, 64 + t * 16, 32];
+    }
+    if (y >= 100 && y < 108 && x >= 10 && x < 10 + t * 12 && (x * 5 + y) % 7 < 3) {
+      return [0, 255, 0];
+    }
+    return [0, 0, 0];
+  },
+  // 8x8 tiles from a set of 300, 200 of them a frame and the rest single colours, so
+  // a 128 slot cache keeps evicting
+  mosaic: function (t, x, y) {
+    let k = (y >> 3) * 20 + (x >> 3);
+    if (k % 8 >= 5) {
+      return [k & 0xF8, 128, 64];
+    }
+    let id = (k * 7 + t * 37) % 300;
+    let on = ((x & 7) + (y & 7) * (1 + id % 5)) % 8 < 3;
+    return on ? [id & 0xFF, (id * 3) & 0xFF, 255 - (id & 0xFF)] : [(id >> 1) & 0xFF, 32, id & 0x80];
+  },
+  // Smooth colour that drifts, like video
+  gradient: function (t, x, y) {
+    return [(x * 3 + t * 5) & 0xFF, (y * 2 + x + t * 3) & 0xFF, (255 - x - y + t * 7) & 0xFF];
+  },
+  // Nothing for any codec to find
+  noise: function (t, x, y) {
+    let h = Math.imul(x * 73856093 ^ y * 19349663 ^ (t + 1) * 83492791, 0x9E3779B1) >>> 0;
+    return [h & 0xFF, (h >> 8) & 0xFF, (h >> 16) & 0xFF];
+  },
+  // One colour, the longest run there is
+  flat: function (t, x, y) {
+    return [200, 16 + t * 8, 90];
+  },
+};
+
+// The browser environment main.js expects
+function makeWindow(out) {
+  let video = { paused: false, ended: false, currentTime: 0, scene: null, t: 0, addEventListener: function () {} };
+  let c1 = { pixels: new Uint8ClampedArray(WIDTH * HEIGHT * 4) };
+  c1.getContext = function () {
+    return {
+      drawImage: function (source, x, y, w, h) {
+        for (let j = 0; j < h; j++) {
+          for (let i = 0; i < w; i++) {
+            let c = scenes[source.scene](source.t, Math.floor(i * WIDTH / w), Math.floor(j * HEIGHT / h));
+            c1.pixels.set([c[0], c[1], c[2], 255], (j * WIDTH + i) * 4);
+          }
+        }
+      },
+      getImageData: function (x, y, w, h) {
+        let data = new Uint8ClampedArray(w * h * 4);
+        for (let j = 0; j < h; j++) {
+          data.set(c1.pixels.subarray(j * WIDTH * 4, (j * WIDTH + w) * 4), j * w * 4);
+        }
+        return { data: data, width: w, height: h };
+      },
+    };
+  };
+  let c2 = {};
+  c2.getContext = function () {
+    return {
+      putImageData: function (frame) {
+        out.shown = frame.data.slice();
+      },
+      drawImage: function () {
+        out.shown = null;
+      },
+    };
+  };
+  let elements = { video: video, c1: c1, c2: c2 };
+  return {
+    document: { getElementById: function (id) { return elements[id]; } },
+    performance: { now: function () { return video.currentTime * 1000; } },
+    setTimeout: function () {},
+    WebSocket: function () {
+      this.send = function (data) {
+        let bytes = ArrayBuffer.isView(data) ? new Uint8Array(data.buffer, data.byteOffset, data.byteLength)
+                                             : new Uint8Array(data);
+        out.records.push(["M", Buffer.from(bytes)]);
+      };
+    },
+    video: video,
+  };
+}
+
+// What the canvas shows, as the panel would: RGB565 of the top bits
+function rgb565(shown) {
+  let image = Buffer.alloc(WIDTH * HEIGHT * 2);
+  for (let i = 0; i < WIDTH * HEIGHT; i++) {
+    let c = ((shown[i * 4] & 0xF8) << 8) | ((shown[i * 4 + 1] & 0xFC) << 3) | (shown[i * 4 + 2] >> 3);
+    image[i * 2] = c >> 8;
+    image[i * 2 + 1] = c & 0xFF;
+  }
+  return image;
+}
+
+// Load main.js into its own context and set it up as the page does
+function makeProcessor(out) {
+  let window = makeWindow(out);
+  let source = fs.readFileSync(path.join(__dirname, "../../html/main.js"), "utf8");
+  let context = vm.createContext(window);
+  let processor = vm.runInContext(source + "\nprocessor;", context);
+  processor.doLoad();
+  return { processor: processor, video: window.video };
+}
+
+// One frame through the encoder, recording what it sends and draws. A
+// frame of a clip leaves the panel as it was.
+function step(out, sender, scene, t) {
+  let p = sender.processor;
+  let clip = p.clipFrames > 0 || p.clipLeft > 0;
+  sender.video.scene = scene;
+  sender.video.t = t;
+  sender.video.currentTime += 0.05;
+  out.shown = null;
+  p.computeFrame();
+  if (out.shown === null) {
+    return;
+  }
+  if (clip) {
+    out.clip = rgb565(out.shown);
+    out.records.push(["C", out.clip], ["S", out.last]);
+  } else {
+    out.last = rgb565(out.shown);
+    out.records.push(["S", out.last]);
+  }
+}
+
+// Run the encoder over frames of [scene, count]
+function encode(out, sender, frames) {
+  for (let [scene, count] of frames) {
+    for (let t = 0; t < count; t++) {
+      step(out, sender, scene, t);
+    }
+  }
+}
+
+// A frame the network loses: the device never sees it and keeps showing the one before
+function lose(out, sender, scene, t) {
+  let first = out.records.length;
+  let last = out.last;
+  step(out, sender, scene, t);
+  out.records.splice(first);
+  out.last = last;
+}
+
+// A frame the device refuses, asking for a keyframe, and the sender hearing of it
+function refuse(out, sender, scene, t) {
+  let last = out.last;
+  step(out, sender, scene, t);
+  out.records.pop();
+  out.records.push(["K", Buffer.alloc(0)], ["S", last]);
+  out.last = last;
+  sender.processor.ws.onmessage({ data: "keyframe" });
+}
+
+// The last frame of a clip as two rectangles that make the message as long
+// as a raw frame, so main.js has to send it padded
+function addPadded(out, sender, scene, t) {
+  let p = sender.processor;
+  let rows = HEIGHT - 1;
+  let tail = WIDTH - 6;
+  let rects = new Uint8Array(2 + 2 * 4 + (rows * WIDTH + tail) * 2);
+  let image = Buffer.from(out.clip);
+  let pixels = new Uint8Array(WIDTH * HEIGHT * 4);
+  for (let y = 0; y < HEIGHT; y++) {
+    for (let x = 0; x < WIDTH; x++) {
+      pixels.set(scenes[scene](t, x, y), (y * WIDTH + x) * 4);
+    }
+  }
+  let drawn = rgb565(pixels);
+  drawn.copy(image, 0, 0, (rows * WIDTH + tail) * 2);
+  rects.set([0x01, 2, 0, 0, WIDTH, rows, 0, rows, tail, 1], 0);
+  rects.set(image.subarray(0, (rows * WIDTH + tail) * 2), 10);
+  p.send(rects);
+  out.clip = image;
+  out.records.push(["C", out.clip], ["S", out.last]);
+}
+
+const sets = {
+  // FRAME_QOI where it comes out smaller than a raw frame, and what main.js falls back to where not
+  qoi: function (out, sender) {
+    let p = sender.processor;
+    p.lossless = true;
+    p.indexed = false;
+    encode(out, sender, [["ui", 6], ["gradient", 3], ["flat", 2], ["noise", 2], ["ui", 2], ["gradient", 2]]);
+  },
+  // FRAME_BLOCKS, drawn as main.js expects the pump to expand them
+  blocks: function (out, sender) {
+    sender.processor.blocks = true;
+    encode(out, sender, [["ui", 3], ["gradient", 3], ["noise", 2], ["flat", 1]]);
+  },
+  // FRAME_YUV420, drawn as main.js expects the pump to convert it
+  yuv: function (out, sender) {
+    sender.processor.yuv420 = true;
+    encode(out, sender, [["ui", 3], ["gradient", 3], ["noise", 2], ["flat", 1]]);
+  },
+  // FRAME_DELTA chains with a keyframe every 5 frames, raw frames where a
+  // delta would not pay, and a lost frame that breaks the chain
+  delta: function (out, sender) {
+    let p = sender.processor;
+    p.delta = true;
+    p.keyInterval = 5;
+    encode(out, sender, [["sprite", 7], ["ui", 3], ["gradient", 2], ["noise", 1], ["sprite", 3]]);
+    lose(out, sender, "sprite", 3);
+    refuse(out, sender, "sprite", 4);
+    encode(out, sender, [["sprite", 4], ["ui", 2], ["flat", 2]]);
+  },
+  // FRAME_TILES: a first frame lost, so the next names slots the device
+  // never filled, then hits, evictions and raw frames in between
+  tiles: function (out, sender) {
+    let p = sender.processor;
+    p.tiles = true;
+    p.indexed = false;
+    lose(out, sender, "ui", 0);
+    refuse(out, sender, "ui", 1);
+    encode(out, sender, [["ui", 4], ["mosaic", 6], ["ui", 2], ["noise", 1], ["ui", 2], ["sprite", 3], ["mosaic", 2]]);
+  },
+  // FRAME_CLIP: a clip recorded in the middle of a delta chain, which must
+  // carry on once it is done, test_frames plays the clip at the end
+  clip: function (out, sender) {
+    let p = sender.processor;
+    p.delta = true;
+    p.keyInterval = 5;
+    p.clipInterval = 40;
+    encode(out, sender, [["sprite", 3]]);
+    p.clipFrames = 7;
+    encode(out, sender, [["ui", 3], ["gradient", 2], ["ui", 1]]);
+    addPadded(out, sender, "noise", 0);
+    for (let t = 3; t < 7; t++) {
+      step(out, sender, "sprite", t);
+    }
+    encode(out, sender, [["ui", 2], ["flat", 1]]);
+  },
+  // FRAME_TIMED around QOI and raw frames, each stamped 50 ms after the last
+  timed: function (out, sender) {
+    let p = sender.processor;
+    p.timed = true;
+    p.lossless = true;
+    p.indexed = false;
+    encode(out, sender, [["ui", 3], ["noise", 1], ["flat", 2], ["gradient", 2], ["ui", 2]]);
+  },
+};
+
+function main() {
+  let [name, file] = process.argv.slice(2);
+  if (!sets[name] || !file) {
+    console.error("usage: node vectors.js " + Object.keys(sets).join("|") + " <file>");
+    process.exit(1);
+  }
+  // The panel starts out black
+  let out = { records: [], shown: null, last: Buffer.alloc(WIDTH * HEIGHT * 2) };
+  sets[name](out, makeProcessor(out));
+  let chunks = [];
+  for (let [kind, data] of out.records) {
+    let header = Buffer.alloc(5);
+    header.write(kind, 0, "latin1");
+    header.writeUInt32LE(data.length, 1);
+    chunks.push(header, data);
+  }
+  fs.writeFileSync(file, Buffer.concat(chunks));
+}
+
+main();
@@ -80,6 +80,21 @@ struct handshake
     enum wsFrameType frameType;
 };
 
+/*
+ * Client frame parser for receiving the header on its own. The decoded
+ * header and the number of payload bytes already unmasked survive between
+ * calls, so the payload can be received in pieces wherever it is needed.
+ */
+struct wsParser
+{
+    enum wsFrameType frameType;
+    size_t headerLength;    // header size once known, minimum bytes needed before that
+    size_t payloadLength;
+    size_t unmaskedLength;  // payload bytes already unmasked in place
+    uint8_t maskingKey[4];
+    uint8_t headerDone;
+};
+
 /**
  * @param inputFrame Pointer to input frame
  * @param inputLength Length of input frame
@@ -114,6 +129,41 @@ void wsMakeFrame(const uint8_t *data, size_t dataLength, uint8_t *outFrame, size
  */
 enum wsFrameType wsParseInputFrame(uint8_t *inputFrame, size_t inputLength, uint8_t **dataPtr, size_t *dataLength);
 
+/**
+ * XOR payload bytes with the masking key, a word at a time where aligned.
+ *
+ * @param data Pointer to payload bytes, unmasked in place
+ * @param length Number of bytes to unmask
+ * @param maskingKey 4-byte masking key from the frame header
+ * @param offset Position of data[0] within the payload, selects the key phase
+ */
+void wsUnmask(uint8_t *data, size_t length, const uint8_t *maskingKey, size_t offset);
+
+/**
+ * @param parser Parser to reset for a new frame
+ */
+void wsParserInit(struct wsParser *parser);
+
+/**
+ * @param parser Parser state, reset with wsParserInit()
+ * @param inputFrame Pointer to frame header bytes
+ * @param inputLength Number of header bytes available
+ * @return Type of frame once the header is complete, WS_INCOMPLETE_FRAME with
+ *         parser->headerLength set to the bytes needed so far otherwise
+ */
+enum wsFrameType wsParseFrameHeader(struct wsParser *parser, const uint8_t *inputFrame, size_t inputLength);
+
+/**
+ * Unmask payload bytes received into a buffer of the caller's choosing,
+ * e.g. after reading the header on its own. Consecutive calls may scatter
+ * the payload over several buffers.
+ *
+ * @param parser Parser state with a complete header
+ * @param data Pointer to the newly received payload bytes
+ * @param length Number of newly received payload bytes
+ */
+void wsParserUnmask(struct wsParser *parser, uint8_t *data, size_t length);
+
 /**
  * @param hs NULL handshake structure
  */
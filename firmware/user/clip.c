@@ -0,0 +1,274 @@
+/*
+ * Clips in SPI flash, see clip.h
+ *
+ * Uploads go through a page buffer so flash is written a page at a time,
+ * each sector erased as the writes reach it. Playback decodes each frame
+ * with frameDisplay(), reading flash straight into the back buffer where
+ * the frame is aligned raw pixels and through a small read-ahead buffer
+ * otherwise.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_common.h"
+#include "lcd.h"
+#include "frame.h"
+#include "clip.h"
+
+#define CLIP_DATA_ADDR (CLIP_FLASH_ADDR + CLIP_SECTOR)
+#define CLIP_DATA_SIZE (CLIP_FLASH_SIZE - CLIP_SECTOR)
+#define CLIP_PAGE 256
+#define CLIP_CHUNK 256
+
+struct clipReader
+{
+    uint32 addr;
+    size_t remain;
+};
+
+static struct clipHeader clipInfo;      // the stored clip, magic is 0 if there is none
+static struct clipHeader clipUpload;    // the clip being uploaded, magic is 0 if none is
+static uint32 clipPage[CLIP_PAGE / 4];
+static int clipPageLen;
+static uint32 clipPageAddr;
+static uint32 clipChunk[CLIP_CHUNK / 4];
+static uint32 clipChunkAddr = 0xffffffff;
+
+static struct clipStats clipStats;
+
+
+int clipOpen()
+{
+    clipChunkAddr = 0xffffffff;
+    if (spi_flash_read(CLIP_FLASH_ADDR, (uint32 *)&clipInfo, sizeof(clipInfo)) != SPI_FLASH_RESULT_OK ||
+        clipInfo.magic != CLIP_MAGIC || clipInfo.frames == 0 || clipInfo.frames > CLIP_MAX_FRAMES ||
+        clipInfo.interval == 0 || clipInfo.length > CLIP_DATA_SIZE)
+    {
+        clipInfo.magic = 0;
+        return 0;
+    }
+    printf("Clip: %u frames every %u ms, %u bytes\n", clipInfo.frames, clipInfo.interval, clipInfo.length);
+    return clipInfo.frames;
+}
+
+
+// Write out the page buffer, erasing each sector on the way in
+static int clipFlush()
+{
+    if (clipPageAddr % CLIP_SECTOR == 0 &&
+        spi_flash_erase_sector(clipPageAddr / CLIP_SECTOR) != SPI_FLASH_RESULT_OK)
+        return CLIP_BAD;
+    if (spi_flash_write(clipPageAddr, clipPage, (clipPageLen + 3) & ~3) != SPI_FLASH_RESULT_OK)
+        return CLIP_BAD;
+    clipPageAddr += CLIP_PAGE;
+    clipPageLen = 0;
+    return CLIP_OK;
+}
+
+
+static int clipAdd(frameReadFn read, void *ctx, size_t length)
+{
+    struct clipEntry entry;
+    uint8 *page = (uint8 *)clipPage;
+    size_t left = length;
+    size_t n;
+
+    if (clipUpload.frames >= CLIP_MAX_FRAMES || clipUpload.length + length > CLIP_DATA_SIZE)
+        return CLIP_BAD;
+    entry.offset = clipUpload.length;
+    entry.length = length;
+    while (left)
+    {
+        n = (left < CLIP_PAGE - clipPageLen) ? left : CLIP_PAGE - clipPageLen;
+        if (read(ctx, page + clipPageLen, n) == EXIT_FAILURE)
+            return CLIP_READ_FAILED;
+        // A clip that uploads clips when played would never end well, and a
+        // clip keeps its own time
+        if (left == length && length != LCD_FRAME_LEN &&
+            (page[clipPageLen] == FRAME_CLIP || page[clipPageLen] == FRAME_TIMED))
+            return CLIP_BAD;
+        clipPageLen += n;
+        left -= n;
+        if (clipPageLen == CLIP_PAGE && clipFlush() != CLIP_OK)
+            return CLIP_BAD;
+    }
+    while (clipPageLen & 3)
+        page[clipPageLen++] = 0xff;
+    if (clipPageLen == CLIP_PAGE && clipFlush() != CLIP_OK)
+        return CLIP_BAD;
+
+    if (spi_flash_write(CLIP_FLASH_ADDR + sizeof(struct clipHeader) + clipUpload.frames * sizeof(entry),
+                        (uint32 *)&entry, sizeof(entry)) != SPI_FLASH_RESULT_OK)
+        return CLIP_BAD;
+    clipUpload.length += (length + 3) & ~3;
+    ++clipUpload.frames;
+    return CLIP_OK;
+}
+
+
+int clipCommand(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 command[3];
+    int result = CLIP_BAD;
+
+    if (length == 0 || read(ctx, command, 1) == EXIT_FAILURE)
+        return length ? CLIP_READ_FAILED : CLIP_BAD;
+    --length;
+
+    switch (command[0])
+    {
+    case CLIP_BEGIN:
+        if (length != 2)
+            break;
+        if (read(ctx, command + 1, 2) == EXIT_FAILURE)
+            return CLIP_READ_FAILED;
+        clipInfo.magic = 0;
+        clipChunkAddr = 0xffffffff;
+        if (spi_flash_erase_sector(CLIP_FLASH_ADDR / CLIP_SECTOR) != SPI_FLASH_RESULT_OK)
+            break;
+        memset(&clipUpload, 0, sizeof(clipUpload));
+        clipUpload.magic = CLIP_MAGIC;
+        clipUpload.interval = (command[1] << 8) | command[2];
+        clipPageAddr = CLIP_DATA_ADDR;
+        clipPageLen = 0;
+        result = (clipUpload.interval > 0) ? CLIP_OK : CLIP_BAD;
+        break;
+    case CLIP_ADD:
+        if (clipUpload.magic != CLIP_MAGIC)
+            break;
+        result = clipAdd(read, ctx, length);
+        break;
+    case CLIP_ADD_PADDED:
+        if (clipUpload.magic != CLIP_MAGIC || length < 1)
+            break;
+        if (read(ctx, command + 1, 1) == EXIT_FAILURE)
+            return CLIP_READ_FAILED;
+        result = clipAdd(read, ctx, length - 1);
+        break;
+    case CLIP_END:
+        if (clipUpload.magic != CLIP_MAGIC || clipUpload.frames == 0)
+            break;
+        if (clipPageLen && clipFlush() != CLIP_OK)
+            break;
+        if (spi_flash_write(CLIP_FLASH_ADDR, (uint32 *)&clipUpload, sizeof(clipUpload)) != SPI_FLASH_RESULT_OK)
+            break;
+        clipUpload.magic = 0;
+        result = clipOpen() ? CLIP_OK : CLIP_BAD;
+        break;
+    case CLIP_ERASE:
+        clipInfo.magic = 0;
+        clipUpload.magic = 0;
+        if (spi_flash_erase_sector(CLIP_FLASH_ADDR / CLIP_SECTOR) == SPI_FLASH_RESULT_OK)
+            result = CLIP_OK;
+        break;
+    }
+
+    if (result != CLIP_OK)
+        clipUpload.magic = 0;
+    return result;
+}
+
+
+// frameReadFn over a frame in flash
+static int clipRead(void *ctx, uint8 *buffer, size_t length)
+{
+    struct clipReader *reader = ctx;
+    size_t n;
+
+    if (length > reader->remain)
+        return EXIT_FAILURE;
+    reader->remain -= length;
+    while (length)
+    {
+        if (reader->addr - clipChunkAddr < CLIP_CHUNK)
+        {
+            n = clipChunkAddr + CLIP_CHUNK - reader->addr;
+            if (n > length)
+                n = length;
+            memcpy(buffer, (uint8 *)clipChunk + (reader->addr - clipChunkAddr), n);
+        }
+        else if (length >= CLIP_CHUNK && !(reader->addr & 3) && ((uintptr_t)buffer & 3) == 0)
+        {
+            // Straight into place, all of a raw frame goes this way
+            n = length & ~3;
+            if (spi_flash_read(reader->addr, (uint32 *)buffer, n) != SPI_FLASH_RESULT_OK)
+                return EXIT_FAILURE;
+        }
+        else
+        {
+            clipChunkAddr = reader->addr & ~3;
+            if (clipChunkAddr > CLIP_FLASH_ADDR + CLIP_FLASH_SIZE - CLIP_CHUNK)
+                clipChunkAddr = CLIP_FLASH_ADDR + CLIP_FLASH_SIZE - CLIP_CHUNK;
+            if (spi_flash_read(clipChunkAddr, clipChunk, CLIP_CHUNK) != SPI_FLASH_RESULT_OK)
+            {
+                clipChunkAddr = 0xffffffff;
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        buffer += n;
+        length -= n;
+        reader->addr += n;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+void clipPlay(clipWaitFn wait, void *ctx)
+{
+    struct clipEntry entry;
+    struct clipReader reader;
+    portTickType start;
+    uint32 due = 0;     // ms after start
+    uint32 now;
+    int i = 0;
+
+    if (clipInfo.magic != CLIP_MAGIC)
+        return;
+
+    start = xTaskGetTickCount();
+    while (1)
+    {
+        if (i == 0)
+        {
+            // Each time round starts like a new connection
+            frameReset();
+            ++clipStats.loops;
+        }
+        if (spi_flash_read(CLIP_FLASH_ADDR + sizeof(struct clipHeader) + i * sizeof(entry),
+                           (uint32 *)&entry, sizeof(entry)) != SPI_FLASH_RESULT_OK ||
+            entry.offset + entry.length > clipInfo.length)
+        {
+            printf("Clip frame %d unreadable\n", i);
+            return;
+        }
+        reader.addr = CLIP_DATA_ADDR + entry.offset;
+        reader.remain = entry.length;
+        if (frameDisplay(clipRead, &reader, entry.length) == EXIT_FAILURE)
+        {
+            printf("Clip frame %d unreadable\n", i);
+            return;
+        }
+        ++clipStats.frames;
+        if (++i == clipInfo.frames)
+            i = 0;
+
+        // Keep to the clip's own clock, but do not rush to catch up after falling behind
+        due += clipInfo.interval;
+        now = (xTaskGetTickCount() - start) * portTICK_RATE_MS;
+        if ((sint32)(due - now) < 0)
+        {
+            ++clipStats.late;
+            due = now;
+        }
+        if (wait(ctx, due - now))
+            return;
+    }
+}
+
+
+void clipGetStats(struct clipStats *stats)
+{
+    *stats = clipStats;
+}
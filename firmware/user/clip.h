@@ -0,0 +1,72 @@
+#ifndef __CLIP_H__
+#define __CLIP_H__
+
+#include "frame.h"
+
+/*
+ * A clip of frames kept in SPI flash and played in a loop while no client
+ * is connected. The first sector at CLIP_FLASH_ADDR holds a clipHeader and
+ * after it a clipEntry per frame. The frames follow from the next sector
+ * on, each 4-byte aligned and exactly the payload of a binary frame on
+ * /video. An empty frame keeps the one before on the panel. The header is
+ * written last, so an interrupted upload leaves no clip behind.
+ *
+ * Layout of the 4 MB flash:
+ *   0x000000 - 0x1fffff  boot loader and application images
+ *   0x200000 - 0x3effff  the clip
+ *   0x3f0000 - 0x3fffff  left to the SDK, RF init data and system
+ *                        parameters live in the last sectors
+ */
+#define CLIP_FLASH_ADDR 0x200000
+#define CLIP_FLASH_SIZE 0x1f0000
+#define CLIP_SECTOR 4096
+#define CLIP_MAGIC 0x50494c43       // "CLIP"
+
+struct clipHeader
+{
+    uint32 magic;
+    uint16 frames;
+    uint16 interval;    // ms from one frame to the next
+    uint32 length;      // bytes of frames, padding included
+    uint32 reserved;
+};
+
+struct clipEntry
+{
+    uint32 offset;      // from the sector after the header
+    uint32 length;
+};
+
+#define CLIP_MAX_FRAMES ((CLIP_SECTOR - sizeof(struct clipHeader)) / sizeof(struct clipEntry))
+
+// Upload commands, the byte after FRAME_CLIP
+#define CLIP_BEGIN 0x01     // then a big-endian interval in ms. Drops the stored clip.
+#define CLIP_ADD 0x02       // then one frame as it would be sent on /video
+#define CLIP_END 0x03       // the clip is complete, it plays from now on
+#define CLIP_ERASE 0x04     // drop the stored clip
+#define CLIP_ADD_PADDED 0x05    // then a byte to skip and a frame as for CLIP_ADD, for frames
+                                // that would make the message as long as a raw frame
+
+#define CLIP_OK 0
+#define CLIP_BAD 1          // out of order, too long or flash failed. The upload is abandoned.
+#define CLIP_READ_FAILED 2  // read() failed, the connection is gone
+
+// Wait up to ms. Returns non-zero to stop playing.
+typedef int (*clipWaitFn)(void *ctx, uint32 ms);
+
+struct clipStats
+{
+    uint32 frames;      // frames shown from flash
+    uint32 loops;       // times round the clip
+    uint32 late;        // frames shown after their time
+};
+
+// Look for a stored clip. Returns its number of frames, 0 if there is none.
+int clipOpen();
+// Run an upload command of length bytes
+int clipCommand(frameReadFn read, void *ctx, size_t length);
+// Play the stored clip from the start, one frame every interval ms, until wait() says to stop
+void clipPlay(clipWaitFn wait, void *ctx);
+void clipGetStats(struct clipStats *stats);
+
+#endif
@@ -0,0 +1,536 @@
+/*
+ * Binary frame formats received on /video
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_common.h"
+#include "lcd.h"
+#include "frame.h"
+#include "jpeg.h"
+#include "qoi.h"
+#include "tile.h"
+#include "clip.h"
+#include "pace.h"
+
+// Last frame of the delta chain, NULL until the next keyframe
+static const uint8 *frameDeltaRef = NULL;
+static uint16 frameDeltaSeq = 0;
+static int frameKeyframeRequest = 0;
+
+
+void frameStreamInit(struct frameStream *stream, frameReadFn read, void *ctx, size_t length)
+{
+    stream->read = read;
+    stream->ctx = ctx;
+    stream->remain = length;
+    stream->pos = stream->len = 0;
+    stream->failed = 0;
+}
+
+
+int frameStreamFill(struct frameStream *stream)
+{
+    size_t len = (stream->remain < FRAME_STREAM_LEN) ? stream->remain : FRAME_STREAM_LEN;
+
+    if (len == 0 || stream->failed)
+        return -1;
+    if (stream->read(stream->ctx, stream->buffer, len) == EXIT_FAILURE)
+    {
+        stream->failed = 1;
+        return -1;
+    }
+    stream->remain -= len;
+    stream->pos = 0;
+    stream->len = len;
+    return 0;
+}
+
+
+static int frameRaw(frameReadFn read, void *ctx)
+{
+    uint8 *buffer = lcdGetBuffer(0);
+
+    frameDeltaRef = NULL;
+    if (read(ctx, buffer, LCD_FRAME_LEN) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    printf("FRM\n");
+    // Also a keyframe, deltas can follow from sequence number 0
+    frameDeltaRef = buffer;
+    frameDeltaSeq = 0;
+    lcdWriteFrame();
+    return EXIT_SUCCESS;
+}
+
+
+static int frameRgb444(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 *buffer;
+
+    if (length != LCD_ROW_BYTES(LCD_RGB444) * LCD_HEIGHT)
+    {
+        printf("Bad RGB444 frame\n");
+        return EXIT_SUCCESS;
+    }
+    buffer = lcdGetBuffer(0);
+    if (read(ctx, buffer, length) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    lcdWriteFrameFormat(LCD_RGB444);
+    return EXIT_SUCCESS;
+}
+
+
+static int frameYuv420(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 *buffer;
+
+    if (length != LCD_ROW_BYTES(LCD_YUV420) * LCD_HEIGHT)
+    {
+        printf("Bad YUV420 frame\n");
+        return EXIT_SUCCESS;
+    }
+    buffer = lcdGetBuffer(0);
+    if (read(ctx, buffer, length) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    lcdWriteFrameFormat(LCD_YUV420);
+    return EXIT_SUCCESS;
+}
+
+
+static int frameBlocks(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 *buffer;
+
+    if (length != LCD_ROW_BYTES(LCD_BLOCKS) * LCD_HEIGHT)
+    {
+        printf("Bad blocks frame\n");
+        return EXIT_SUCCESS;
+    }
+    buffer = lcdGetBuffer(0);
+    if (read(ctx, buffer, length) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    lcdWriteFrameFormat(LCD_BLOCKS);
+    return EXIT_SUCCESS;
+}
+
+
+static int frameScaled(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 size[2];
+    int format;
+    uint8 *buffer;
+
+    if (length < 2)
+    {
+        printf("Bad scaled frame\n");
+        return EXIT_SUCCESS;
+    }
+    if (read(ctx, size, 2) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if ((size[0] != LCD_WIDTH && size[0] != LCD_WIDTH / 2) ||
+        (size[1] != LCD_HEIGHT && size[1] != LCD_HEIGHT / 2) ||
+        length != 2 + size[0] * size[1] * 2)
+    {
+        printf("Bad scaled frame\n");
+        return EXIT_SUCCESS;
+    }
+    if (size[0] == LCD_WIDTH && size[1] == LCD_HEIGHT)
+        format = LCD_RGB565;
+    else
+        format = LCD_SCALED(size[0] != LCD_WIDTH, size[1] != LCD_HEIGHT);
+
+    buffer = lcdGetBuffer(0);
+    if (read(ctx, buffer, length - 2) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    lcdWriteFrameFormat(format);
+    return EXIT_SUCCESS;
+}
+
+
+static int frameIndexed(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 header[2];
+    int format;
+    int colors;
+    uint8 *palette;
+    uint8 *buffer;
+
+    if (length < 2)
+    {
+        printf("Bad indexed frame\n");
+        return EXIT_SUCCESS;
+    }
+    if (read(ctx, header, 2) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if (header[0] != 1 && header[0] != 2 && header[0] != 4 && header[0] != 8)
+    {
+        printf("Bad indexed frame\n");
+        return EXIT_SUCCESS;
+    }
+    format = LCD_INDEXED(header[0]);
+    colors = header[1] ? header[1] : 256;
+    if (colors > (1 << header[0]) || length != 2 + colors * 2 + LCD_ROW_BYTES(format) * LCD_HEIGHT)
+    {
+        printf("Bad indexed frame\n");
+        return EXIT_SUCCESS;
+    }
+
+    buffer = lcdGetBuffer(0);
+    palette = lcdGetPalette();
+    if (read(ctx, palette, colors * 2) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    memset(palette + colors * 2, 0, (LCD_PALETTE_MAX - colors) * 2);
+    if (read(ctx, buffer, LCD_ROW_BYTES(format) * LCD_HEIGHT) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    lcdWriteFrameFormat(format);
+    return EXIT_SUCCESS;
+}
+
+
+static int frameQoi(frameReadFn read, void *ctx, size_t length)
+{
+    int result = qoiDecode(read, ctx, length, lcdGetBuffer(0));
+
+    if (result == QOI_READ_FAILED)
+        return EXIT_FAILURE;
+    if (result == QOI_BAD)
+    {
+        printf("Bad QOI frame\n");
+        return EXIT_SUCCESS;
+    }
+    lcdWriteFrame();
+    return EXIT_SUCCESS;
+}
+
+
+static int frameTiles(frameReadFn read, void *ctx, size_t length)
+{
+    int result = tileDecode(read, ctx, length, lcdGetBuffer(0));
+
+    if (result == TILE_READ_FAILED)
+        return EXIT_FAILURE;
+    if (result == TILE_BAD)
+    {
+        // The sender's copy of the cache can no longer be trusted
+        printf("Bad tile frame\n");
+        tileReset();
+        frameKeyframeRequest = 1;
+        return EXIT_SUCCESS;
+    }
+    lcdWriteFrame();
+    return EXIT_SUCCESS;
+}
+
+
+static int frameClip(frameReadFn read, void *ctx, size_t length)
+{
+    int result = clipCommand(read, ctx, length);
+
+    if (result == CLIP_READ_FAILED)
+        return EXIT_FAILURE;
+    if (result == CLIP_BAD)
+        printf("Bad clip command\n");
+    return EXIT_SUCCESS;
+}
+
+
+static int frameDecode(uint8 format, frameReadFn read, void *ctx, size_t length);
+
+
+static int frameTimed(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 header[7];    // sequence number, timestamp, then the format of the frame
+    int delay;
+    int late;
+    int result;
+
+    if (length < 6)
+    {
+        printf("Bad timed frame\n");
+        return EXIT_SUCCESS;
+    }
+    if (read(ctx, header, 6) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    length -= 6;
+    if (length != LCD_FRAME_LEN && length > 0)
+    {
+        if (read(ctx, header + 6, 1) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        --length;
+        // Only one level of wrapping, and clip uploads are not shown
+        if (header[6] == FRAME_TIMED || header[6] == FRAME_CLIP)
+        {
+            printf("Bad timed frame\n");
+            return EXIT_SUCCESS;
+        }
+    }
+
+    delay = paceDelay((header[0] << 8) | header[1],
+                      ((uint32)header[2] << 24) | (header[3] << 16) | (header[4] << 8) | header[5], &late);
+    lcdPresentIn(delay, late);
+    if (length == LCD_FRAME_LEN)
+        result = frameRaw(read, ctx);
+    else if (length > 0)
+        result = frameDecode(header[6], read, ctx, length);
+    else
+        result = EXIT_SUCCESS;
+    lcdPresentCancel();
+    return result;
+}
+
+
+/*
+ * One pass over the runs, reference pixels in, frame pixels out. Where the
+ * buffer is the reference itself, unchanged pixels are left alone.
+ */
+static int frameDeltaRuns(struct frameStream *stream, const uint8 *ref, uint8 *buffer)
+{
+    uint8 *out = buffer;
+    uint8 *end = buffer + LCD_FRAME_LEN;
+    int op, n, x;
+
+    while ((op = frameStreamByte(stream)) >= 0)
+    {
+        n = (op & 0x3f) + 1;
+        if ((op & 0xc0) == 0xc0)
+        {
+            if ((x = frameStreamByte(stream)) < 0)
+                return EXIT_FAILURE;
+            n = (((op & 0x3f) << 8) | x) + 1;
+        }
+        if (n > (end - out) / 2)
+            return EXIT_FAILURE;
+        n *= 2;
+
+        switch (op & 0xc0)
+        {
+        case 0x00:
+        case 0xc0:
+            if (!ref)
+                memset(out, 0, n);
+            else if (ref != buffer)
+                memcpy(out, ref + (out - buffer), n);
+            out += n;
+            break;
+        case 0x40:
+            for (; n; n -= 2, out += 2)
+            {
+                if ((x = frameStreamByte(stream)) < 0)
+                    return EXIT_FAILURE;
+                out[0] = ref ? ref[out - buffer] : 0;
+                out[1] = (ref ? ref[out - buffer + 1] : 0) ^ x;
+            }
+            break;
+        case 0x80:
+            for (; n; --n, ++out)
+            {
+                if ((x = frameStreamByte(stream)) < 0)
+                    return EXIT_FAILURE;
+                *out = (ref ? ref[out - buffer] : 0) ^ x;
+            }
+            break;
+        }
+    }
+    if (stream->failed)
+        return EXIT_FAILURE;
+
+    if (!ref)
+        memset(out, 0, end - out);
+    else if (ref != buffer)
+        memcpy(out, ref + (out - buffer), end - out);
+    return EXIT_SUCCESS;
+}
+
+
+static int frameDelta(frameReadFn read, void *ctx, size_t length)
+{
+    struct frameStream stream;
+    const uint8 *ref = frameDeltaRef;
+    uint16 seq;
+    int flags;
+    uint8 *buffer;
+
+    frameStreamInit(&stream, read, ctx, length);
+    seq = frameStreamByte(&stream) << 8;
+    seq |= frameStreamByte(&stream);
+    flags = frameStreamByte(&stream);
+    if (flags < 0)
+        return stream.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+
+    if (flags & FRAME_DELTA_KEY)
+    {
+        ref = NULL;
+    }
+    else if (!ref || seq != (uint16)(frameDeltaSeq + 1))
+    {
+        printf("Delta %u does not follow %u, keyframe needed\n", seq, frameDeltaSeq);
+        frameDeltaRef = NULL;
+        frameKeyframeRequest = 1;
+        return EXIT_SUCCESS;
+    }
+
+    // Whatever happens the reference may now be overwritten
+    frameDeltaRef = NULL;
+    buffer = lcdGetBuffer(0);
+    if (frameDeltaRuns(&stream, ref, buffer) == EXIT_FAILURE)
+    {
+        if (stream.failed)
+            return EXIT_FAILURE;
+        printf("Bad delta frame\n");
+        frameKeyframeRequest = 1;
+        return EXIT_SUCCESS;
+    }
+    frameDeltaRef = buffer;
+    frameDeltaSeq = seq;
+    lcdWriteFrame();
+    return EXIT_SUCCESS;
+}
+
+
+static int frameJpeg(frameReadFn read, void *ctx, size_t length)
+{
+    int result;
+
+    // Headers first, so a frame they reject leaves the ring alone. One that
+    // fails later has already taken a buffer, which may have been the frame
+    // waiting to be shown.
+    result = jpegReadHeader(read, ctx, length);
+    if (result == JPEG_OK)
+        result = jpegDecode(lcdGetBuffer(0));
+    if (result == JPEG_READ_FAILED)
+        return EXIT_FAILURE;
+    if (result == JPEG_BAD)
+    {
+        printf("Bad JPEG frame\n");
+        return EXIT_SUCCESS;
+    }
+    lcdWriteFrame();
+    return EXIT_SUCCESS;
+}
+
+
+static int frameRects(frameReadFn read, void *ctx, size_t length)
+{
+    struct lcdRect rects[LCD_MAX_RECTS];
+    uint8 count;
+    size_t pixelLength = 0;
+    uint8 *buffer;
+    int i, y;
+
+    if (length < 1)
+    {
+        printf("Bad rects frame\n");
+        return EXIT_SUCCESS;
+    }
+    if (read(ctx, &count, 1) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if (count < 1 || count > LCD_MAX_RECTS || length < 1 + count * sizeof(struct lcdRect))
+    {
+        printf("Bad rects frame\n");
+        return EXIT_SUCCESS;
+    }
+    if (read(ctx, (uint8 *)rects, count * sizeof(struct lcdRect)) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    for (i = 0; i < count; ++i)
+    {
+        if (rects[i].w == 0 || rects[i].h == 0 ||
+            rects[i].x + rects[i].w > LCD_WIDTH || rects[i].y + rects[i].h > LCD_HEIGHT)
+        {
+            printf("Bad rects frame\n");
+            return EXIT_SUCCESS;
+        }
+        pixelLength += rects[i].w * rects[i].h * 2;
+    }
+    if (length != 1 + count * sizeof(struct lcdRect) + pixelLength)
+    {
+        printf("Bad rects frame\n");
+        return EXIT_SUCCESS;
+    }
+
+    // Rows land in place, the rest of the buffer is never scanned out
+    buffer = lcdGetBuffer(1);
+    for (i = 0; i < count; ++i)
+    {
+        for (y = rects[i].y; y < rects[i].y + rects[i].h; ++y)
+        {
+            if (read(ctx, buffer + (y * LCD_WIDTH + rects[i].x) * 2, rects[i].w * 2) == EXIT_FAILURE)
+                return EXIT_FAILURE;
+        }
+    }
+    lcdWriteRects(rects, count);
+    return EXIT_SUCCESS;
+}
+
+
+void frameReset()
+{
+    frameDeltaRef = NULL;
+    frameKeyframeRequest = 0;
+    tileReset();
+    paceReset();
+}
+
+
+int frameKeyframeWanted()
+{
+    int wanted = frameKeyframeRequest;
+
+    frameKeyframeRequest = 0;
+    return wanted;
+}
+
+
+static int frameDecode(uint8 format, frameReadFn read, void *ctx, size_t length)
+{
+    // Any other frame may take the buffer the delta chain refers to. Clip
+    // uploads only go to flash, the chain carries on after them.
+    if (format == FRAME_DELTA)
+        return frameDelta(read, ctx, length);
+    if (format == FRAME_CLIP)
+        return frameClip(read, ctx, length);
+    frameDeltaRef = NULL;
+
+    switch (format)
+    {
+    case FRAME_RECTS:
+        return frameRects(read, ctx, length);
+    case FRAME_RGB444:
+        return frameRgb444(read, ctx, length);
+    case FRAME_INDEXED:
+        return frameIndexed(read, ctx, length);
+    case FRAME_YUV420:
+        return frameYuv420(read, ctx, length);
+    case FRAME_SCALED:
+        return frameScaled(read, ctx, length);
+    case FRAME_BLOCKS:
+        return frameBlocks(read, ctx, length);
+    case FRAME_QOI:
+        return frameQoi(read, ctx, length);
+    case FRAME_TILES:
+        return frameTiles(read, ctx, length);
+    case FRAME_JPEG:
+        return frameJpeg(read, ctx, length);
+    default:
+        printf("Unknown frame format %02X\n", format);
+        return EXIT_SUCCESS;
+    }
+}
+
+
+int frameDisplay(frameReadFn read, void *ctx, size_t length)
+{
+    uint8 format;
+
+    if (length == LCD_FRAME_LEN)
+        return frameRaw(read, ctx);
+
+    if (length == 0)
+        return EXIT_SUCCESS;
+    if (read(ctx, &format, 1) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    --length;
+
+    // The timed frame's own frame decides what happens to the delta chain
+    if (format == FRAME_TIMED)
+        return frameTimed(read, ctx, length);
+    return frameDecode(format, read, ctx, length);
+}
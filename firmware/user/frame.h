@@ -0,0 +1,105 @@
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+/*
+ * Binary frames on /video. A payload of exactly LCD_FRAME_LEN bytes is a
+ * raw RGB565 frame. Anything else starts with one of the format bytes
+ * below; a tagged frame that would come out at exactly LCD_FRAME_LEN bytes
+ * has to be sent as a raw frame instead.
+ */
+
+// Rectangle list: count, count * { x, y, w, h }, then each rectangle's
+// RGB565 pixels row by row, all 8-bit fields.
+#define FRAME_RECTS 0x01
+
+// Full frame of packed RGB444, LCD_ROW_BYTES(LCD_RGB444) per row: two pixels
+// in three bytes, R0G0 B0R1 G1B1.
+#define FRAME_RGB444 0x02
+
+// Palette-indexed full frame: bits per pixel (1, 2, 4 or 8), colour count
+// (0 for 256), count big-endian RGB565 colours, then LCD_ROW_BYTES() of
+// indices per row, first pixel in the high bits.
+#define FRAME_INDEXED 0x03
+
+// Full frame of planar YUV 4:2:0: LCD_WIDTH x LCD_HEIGHT Y, then U and V at
+// half resolution both ways.
+#define FRAME_YUV420 0x04
+
+// Low resolution RGB565 frame: source width (80 or 160), height (64 or 128),
+// then the pixels row by row. Shown doubled up to LCD_WIDTH x LCD_HEIGHT.
+#define FRAME_SCALED 0x05
+
+// Lossless full frame, QOI-style codes over RGB565 as described in qoi.h
+#define FRAME_QOI 0x06
+
+// Block compressed full frame, 4x4 blocks as in LCD_BLOCKS, 10240 bytes
+#define FRAME_BLOCKS 0x07
+
+// Delta against the previous frame: big-endian 16-bit sequence number,
+// flags, then runs of RGB565 pixels XORed with the reference frame. The
+// reference is black for a keyframe, the frame before for anything else.
+// Pixels after the last run are unchanged. A raw frame counts as keyframe 0.
+//   00nnnnnn                  skip n + 1 pixels
+//   11nnnnnn nnnnnnnn         skip n + 1 pixels, 14-bit n
+//   01nnnnnn, n + 1 bytes     n + 1 pixels, only their low byte XORed
+//   10nnnnnn, 2 * (n + 1)     n + 1 pixels, both bytes XORed
+// A delta that does not follow the last frame shown is dropped and a
+// keyframe requested, see frameKeyframeWanted().
+#define FRAME_DELTA 0x08
+#define FRAME_DELTA_KEY 0x01    // flags: keyframe
+
+// Full frame of 8x8 tiles, cached on the device, coded as in tile.h. A bad
+// tile frame empties the cache and requests a keyframe, after which the
+// sender starts over with an empty cache as well.
+#define FRAME_TILES 0x09
+
+// Clip upload command, stores frames in flash to play without a client.
+// See clip.h.
+#define FRAME_CLIP 0x0a
+
+// Any frame with a presentation time: big-endian 16-bit sequence number,
+// big-endian 32-bit sender timestamp in ms, then the frame. It is decoded
+// at once but only shown at its time, see pace.h.
+#define FRAME_TIMED 0x0b
+
+// Baseline JPEG. The format byte is the first byte of its SOI marker, so
+// MJPEG frames go out unchanged.
+#define FRAME_JPEG 0xff
+
+// Read exactly length payload bytes into buffer
+typedef int (*frameReadFn)(void *ctx, uint8 *buffer, size_t length);
+
+#define FRAME_STREAM_LEN 256
+
+// A payload taken a byte at a time, read FRAME_STREAM_LEN bytes at once
+struct frameStream
+{
+    frameReadFn read;
+    void *ctx;
+    size_t remain;      // payload bytes not buffered yet
+    int pos, len;
+    int failed;         // read() failed
+    uint8 buffer[FRAME_STREAM_LEN];
+};
+
+void frameStreamInit(struct frameStream *stream, frameReadFn read, void *ctx, size_t length);
+// Refill the used up buffer. Returns -1 at the end of the payload or if reading failed.
+int frameStreamFill(struct frameStream *stream);
+
+// Next payload byte, -1 at the end or if reading failed
+static inline int frameStreamByte(struct frameStream *stream)
+{
+    if (stream->pos == stream->len && frameStreamFill(stream) < 0)
+        return -1;
+    return stream->buffer[stream->pos++];
+}
+
+// Decode a binary frame of length bytes and hand it to the LCD.
+// Returns EXIT_FAILURE if reading failed, malformed frames are skipped.
+int frameDisplay(frameReadFn read, void *ctx, size_t length);
+// Forget the last delta frame, cached tiles and the sender's clock, for a new connection
+void frameReset();
+// Whether the sender should be asked for a keyframe. Clears the request.
+int frameKeyframeWanted();
+
+#endif
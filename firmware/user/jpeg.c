@@ -0,0 +1,732 @@
+/*
+ * Baseline JPEG decoder for /video frames
+ *
+ * Huffman coded sequential DCT, 8-bit samples, greyscale or YCbCr with the
+ * luma sampled 1x or 2x either way (4:4:4, 4:2:2, 4:4:0, 4:2:0). The IDCT
+ * is the integer one of the IJG code, chroma is upsampled by repeating
+ * samples. Each MCU goes to RGB565 straight into the framebuffer, so beyond
+ * the tables the decoder only holds one block of coefficients, one MCU of
+ * samples and a small input buffer.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_common.h"
+#include "lcd.h"
+#include "lcd_hal.h"
+#include "frame.h"
+#include "jpeg.h"
+
+#pragma GCC optimize ("O2")
+
+#define JPEG_LOOKUP_BITS 8
+#define JPEG_END 0x100      // pseudo marker for running out of data in a scan
+
+// Markers
+#define JPEG_SOF0 0xc0      // baseline
+#define JPEG_SOF1 0xc1      // extended sequential, fine with 8-bit tables
+#define JPEG_DHT 0xc4
+#define JPEG_RST0 0xd0
+#define JPEG_RST7 0xd7
+#define JPEG_SOI 0xd8
+#define JPEG_EOI 0xd9
+#define JPEG_SOS 0xda
+#define JPEG_DQT 0xdb
+#define JPEG_DRI 0xdd
+
+struct jpegHuffman
+{
+    uint16 lookup[1 << JPEG_LOOKUP_BITS];  // length << 8 | value of codes up to 8 bits, 0 for longer ones
+    sint32 maxCode[17];         // largest code of each length, -1 for none
+    sint32 valueOffset[17];     // index in values of the codes of each length, minus the first code
+    uint8 values[256];
+};
+
+struct jpegComponent
+{
+    uint8 id;
+    uint8 h, v;         // sampling factors
+    uint8 quant;
+    uint8 dc, ac;       // Huffman tables of the scan
+    int predictor;      // previous DC value
+};
+
+static const uint8 jpegZigzag[64] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static struct frameStream jpegStream;
+
+// Entropy coded data
+static uint32 jpegBits = 0;             // next bits of the scan in the low jpegBitCount bits
+static int jpegBitCount = 0;
+static int jpegMarker = 0;              // marker that ended the data so far, 0 if none
+
+// Tables and frame header
+static uint8 jpegQuant[4][64];          // zigzag order
+static struct jpegHuffman jpegHuffman[4];   // DC 0, DC 1, AC 0, AC 1
+static uint8 jpegQuantDefined = 0;      // bit mask of the tables above
+static uint8 jpegHuffmanDefined = 0;
+static struct jpegComponent jpegComponents[3];
+static int jpegComponentCount = 0;
+static int jpegWidth = 0;
+static int jpegHeight = 0;
+static int jpegRestartInterval = 0;
+static size_t jpegLength = 0;
+
+// One MCU of samples: up to 2x2 luma blocks, one block each of Cb and Cr
+static uint8 jpegLuma[16 * 16];
+static uint8 jpegCb[8 * 8];
+static uint8 jpegCr[8 * 8];
+
+static struct jpegStats jpegStats;
+
+
+// Next byte of the JPEG, -1 at the end or if reading failed
+static inline int jpegByte()
+{
+    return frameStreamByte(&jpegStream);
+}
+
+
+static int jpegWord()
+{
+    int hi = jpegByte();
+    int lo = jpegByte();
+
+    if (hi < 0 || lo < 0)
+        return -1;
+    return (hi << 8) | lo;
+}
+
+
+static int jpegSkip(int len)
+{
+    while (len-- > 0)
+    {
+        if (jpegByte() < 0)
+            return JPEG_BAD;
+    }
+    return JPEG_OK;
+}
+
+
+static int jpegReadQuant(int len)
+{
+    int i;
+
+    while (len >= 65)
+    {
+        int pq = jpegByte();
+
+        // 16-bit tables are not baseline
+        if (pq < 0 || (pq >> 4) != 0 || (pq & 15) > 3)
+            return JPEG_BAD;
+        for (i = 0; i < 64; ++i)
+        {
+            int q = jpegByte();
+
+            if (q < 0)
+                return JPEG_BAD;
+            jpegQuant[pq & 15][i] = q;
+        }
+        jpegQuantDefined |= 1 << (pq & 15);
+        len -= 65;
+    }
+    return len ? JPEG_BAD : JPEG_OK;
+}
+
+
+static int jpegReadHuffman(int len)
+{
+    uint8 counts[17];
+    struct jpegHuffman *h;
+    int tc, i, n, total, length, code, k;
+
+    while (len >= 17)
+    {
+        tc = jpegByte();
+        if (tc < 0 || (tc >> 4) > 1 || (tc & 15) > 1)
+            return JPEG_BAD;
+        n = (tc >> 4) * 2 + (tc & 15);
+        h = &jpegHuffman[n];
+
+        total = 0;
+        for (i = 1; i <= 16; ++i)
+        {
+            int c = jpegByte();
+
+            if (c < 0)
+                return JPEG_BAD;
+            counts[i] = c;
+            total += c;
+        }
+        len -= 17;
+        if (total > 256 || total > len)
+            return JPEG_BAD;
+        for (i = 0; i < total; ++i)
+            h->values[i] = jpegByte();
+        len -= total;
+
+        // Canonical codes: each length continues where the shorter ones stopped
+        memset(h->lookup, 0, sizeof(h->lookup));
+        code = 0;
+        k = 0;
+        for (length = 1; length <= 16; ++length)
+        {
+            h->valueOffset[length] = k - code;
+            h->maxCode[length] = counts[length] ? code + counts[length] - 1 : -1;
+            if (code + counts[length] > (1 << length))
+                return JPEG_BAD;
+            for (i = 0; i < counts[length]; ++i, ++code, ++k)
+            {
+                if (length <= JPEG_LOOKUP_BITS)
+                {
+                    int shift = JPEG_LOOKUP_BITS - length;
+                    int j;
+
+                    for (j = 0; j < (1 << shift); ++j)
+                        h->lookup[(code << shift) | j] = (length << 8) | h->values[k];
+                }
+            }
+            code <<= 1;
+        }
+        jpegHuffmanDefined |= 1 << n;
+    }
+    return len ? JPEG_BAD : JPEG_OK;
+}
+
+
+static int jpegReadFrame(int len)
+{
+    int i;
+
+    if (len < 6 || jpegByte() != 8)
+        return JPEG_BAD;
+    jpegHeight = jpegWord();
+    jpegWidth = jpegWord();
+    jpegComponentCount = jpegByte();
+    // A height of 0 would come later in a DNL marker
+    if (jpegHeight <= 0 || jpegWidth <= 0 ||
+        (jpegComponentCount != 1 && jpegComponentCount != 3) || len != 6 + jpegComponentCount * 3)
+        return JPEG_BAD;
+
+    for (i = 0; i < jpegComponentCount; ++i)
+    {
+        struct jpegComponent *c = &jpegComponents[i];
+        int hv;
+
+        c->id = jpegByte();
+        hv = jpegByte();
+        c->quant = jpegByte();
+        c->h = hv >> 4;
+        c->v = hv & 15;
+        if (hv < 0 || c->quant > 3)
+            return JPEG_BAD;
+    }
+    if (jpegComponentCount == 1)
+    {
+        // Non-interleaved, one block per MCU whatever the sampling factors
+        jpegComponents[0].h = 1;
+        jpegComponents[0].v = 1;
+    }
+    else
+    {
+        for (i = 1; i < 3; ++i)
+        {
+            if (jpegComponents[i].h != 1 || jpegComponents[i].v != 1)
+                return JPEG_BAD;
+        }
+        if (jpegComponents[0].h < 1 || jpegComponents[0].h > 2 ||
+            jpegComponents[0].v < 1 || jpegComponents[0].v > 2)
+            return JPEG_BAD;
+    }
+    return JPEG_OK;
+}
+
+
+static int jpegReadScan(int len)
+{
+    int count, i, j;
+
+    count = jpegByte();
+    if (jpegComponentCount == 0 || count != jpegComponentCount || len != 4 + count * 2)
+        return JPEG_BAD;
+    for (i = 0; i < count; ++i)
+    {
+        int id = jpegByte();
+        int tables = jpegByte();
+
+        for (j = 0; j < jpegComponentCount; ++j)
+        {
+            if (jpegComponents[j].id == id)
+                break;
+        }
+        if (j == jpegComponentCount || (tables >> 4) > 1 || (tables & 15) > 1)
+            return JPEG_BAD;
+        jpegComponents[j].dc = tables >> 4;
+        jpegComponents[j].ac = 2 + (tables & 15);
+        if (!(jpegHuffmanDefined & (1 << jpegComponents[j].dc)) ||
+            !(jpegHuffmanDefined & (1 << jpegComponents[j].ac)) ||
+            !(jpegQuantDefined & (1 << jpegComponents[j].quant)))
+            return JPEG_BAD;
+    }
+    // Spectral selection and successive approximation are fixed for baseline
+    if (jpegByte() != 0 || jpegByte() != 63 || jpegByte() != 0)
+        return JPEG_BAD;
+    return JPEG_OK;
+}
+
+
+int jpegReadHeader(frameReadFn read, void *ctx, size_t length)
+{
+    int marker, len, result;
+
+    frameStreamInit(&jpegStream, read, ctx, length);
+    jpegLength = length + 1;
+    jpegQuantDefined = 0;
+    jpegHuffmanDefined = 0;
+    jpegComponentCount = 0;
+    jpegRestartInterval = 0;
+
+    result = (jpegByte() == JPEG_SOI) ? JPEG_OK : JPEG_BAD;
+    while (result == JPEG_OK)
+    {
+        // Markers may be padded with any number of 0xFF
+        if (jpegByte() != 0xff)
+        {
+            result = JPEG_BAD;
+            break;
+        }
+        while ((marker = jpegByte()) == 0xff)
+            ;
+        len = jpegWord() - 2;
+        if (marker < 0 || len < 0)
+        {
+            result = JPEG_BAD;
+            break;
+        }
+
+        switch (marker)
+        {
+        case JPEG_SOF0:
+        case JPEG_SOF1:
+            result = jpegReadFrame(len);
+            break;
+        case JPEG_DHT:
+            result = jpegReadHuffman(len);
+            break;
+        case JPEG_DQT:
+            result = jpegReadQuant(len);
+            break;
+        case JPEG_DRI:
+            jpegRestartInterval = jpegWord();
+            result = (len == 2 && jpegRestartInterval >= 0) ? JPEG_OK : JPEG_BAD;
+            break;
+        case JPEG_SOS:
+            result = jpegReadScan(len);
+            if (result == JPEG_OK)
+                return JPEG_OK;
+            break;
+        default:
+            // Progressive, lossless and arithmetic coded frames are not handled
+            if ((marker >= 0xc0 && marker <= 0xcf) || marker == JPEG_EOI)
+                result = JPEG_BAD;
+            else
+                result = jpegSkip(len);
+            break;
+        }
+    }
+
+    ++jpegStats.bad;
+    return jpegStream.failed ? JPEG_READ_FAILED : result;
+}
+
+
+// Top up the bit buffer to more than 24 bits, zeros once a marker shows up
+static void jpegFillBits()
+{
+    while (jpegBitCount <= 24)
+    {
+        int c = 0;
+
+        if (!jpegMarker)
+        {
+            c = jpegByte();
+            if (c == 0xff)
+            {
+                int next;
+
+                // 0xFF 0x00 is a stuffed 0xFF, anything else a marker
+                while ((next = jpegByte()) == 0xff)
+                    ;
+                if (next != 0)
+                {
+                    jpegMarker = (next < 0) ? JPEG_END : next;
+                    c = 0;
+                }
+            }
+            else if (c < 0)
+            {
+                jpegMarker = JPEG_END;
+                c = 0;
+            }
+        }
+        jpegBits = (jpegBits << 8) | c;
+        jpegBitCount += 8;
+    }
+}
+
+
+static int jpegDecodeSymbol(const struct jpegHuffman *h)
+{
+    int look, length;
+
+    if (jpegBitCount < 16)
+        jpegFillBits();
+    look = h->lookup[(jpegBits >> (jpegBitCount - JPEG_LOOKUP_BITS)) & ((1 << JPEG_LOOKUP_BITS) - 1)];
+    if (look)
+    {
+        jpegBitCount -= look >> 8;
+        return look & 0xff;
+    }
+    for (length = JPEG_LOOKUP_BITS + 1; length <= 16; ++length)
+    {
+        int code = (jpegBits >> (jpegBitCount - length)) & ((1 << length) - 1);
+
+        if (code <= h->maxCode[length])
+        {
+            jpegBitCount -= length;
+            return h->values[code + h->valueOffset[length]];
+        }
+    }
+    return -1;
+}
+
+
+// Next n bits as a signed coefficient value
+static int jpegValue(int n)
+{
+    int v;
+
+    if (jpegBitCount < n)
+        jpegFillBits();
+    jpegBitCount -= n;
+    v = (jpegBits >> jpegBitCount) & ((1 << n) - 1);
+    if (v < (1 << (n - 1)))
+        v -= (1 << n) - 1;
+    return v;
+}
+
+
+// Entropy decode and dequantize one block into natural order
+static int jpegDecodeBlock(struct jpegComponent *c, int *coef)
+{
+    const uint8 *quant = jpegQuant[c->quant];
+    const struct jpegHuffman *ac = &jpegHuffman[c->ac];
+    int s, k;
+
+    memset(coef, 0, 64 * sizeof(*coef));
+    s = jpegDecodeSymbol(&jpegHuffman[c->dc]);
+    if (s < 0 || s > 11)
+        return JPEG_BAD;
+    if (s)
+        c->predictor += jpegValue(s);
+    coef[0] = c->predictor * quant[0];
+
+    for (k = 1; k < 64; ++k)
+    {
+        int rs = jpegDecodeSymbol(ac);
+
+        if (rs < 0)
+            return JPEG_BAD;
+        s = rs & 15;
+        k += rs >> 4;
+        if (s == 0)
+        {
+            // End of block, or a run of 16 zeros
+            if (rs != 0xf0)
+                break;
+            continue;
+        }
+        if (k > 63)
+            return JPEG_BAD;
+        coef[jpegZigzag[k]] = jpegValue(s) * quant[k];
+    }
+    return JPEG_OK;
+}
+
+
+/*
+ * Integer IDCT, the "islow" one from the IJG code: Loeffler, Ligtenberg and
+ * Moschytz with 13-bit constants and 2 extra bits of precision between
+ * the column and the row pass.
+ */
+#define JPEG_CONST_BITS 13
+#define JPEG_PASS1_BITS 2
+#define JPEG_FIX(x) ((int)((x) * (1 << JPEG_CONST_BITS) + 0.5))
+#define JPEG_DESCALE(x, n) (((x) + (1 << ((n) - 1))) >> (n))
+
+static inline int jpegClamp(int v)
+{
+    if ((unsigned)v > 255)
+        v = v < 0 ? 0 : 255;
+    return v;
+}
+
+// Even and odd halves of a 1-D IDCT over in[0], in[step] ... in[7 * step]
+#define JPEG_IDCT_1D(in, step)                                                          \
+    z2 = in[2 * step];                                                                  \
+    z3 = in[6 * step];                                                                  \
+    z1 = (z2 + z3) * JPEG_FIX(0.541196100);                                             \
+    t2 = z1 - z3 * JPEG_FIX(1.847759065);                                               \
+    t3 = z1 + z2 * JPEG_FIX(0.765366865);                                               \
+    t0 = (in[0] + in[4 * step]) * (1 << JPEG_CONST_BITS);                                  \
+    t1 = (in[0] - in[4 * step]) * (1 << JPEG_CONST_BITS);                                  \
+    t10 = t0 + t3;                                                                      \
+    t13 = t0 - t3;                                                                      \
+    t11 = t1 + t2;                                                                      \
+    t12 = t1 - t2;                                                                      \
+    t0 = in[7 * step];                                                                  \
+    t1 = in[5 * step];                                                                  \
+    t2 = in[3 * step];                                                                  \
+    t3 = in[1 * step];                                                                  \
+    z1 = t0 + t3;                                                                       \
+    z2 = t1 + t2;                                                                       \
+    z3 = t0 + t2;                                                                       \
+    z4 = t1 + t3;                                                                       \
+    z5 = (z3 + z4) * JPEG_FIX(1.175875602);                                             \
+    t0 *= JPEG_FIX(0.298631336);                                                        \
+    t1 *= JPEG_FIX(2.053119869);                                                        \
+    t2 *= JPEG_FIX(3.072711026);                                                        \
+    t3 *= JPEG_FIX(1.501321110);                                                        \
+    z1 *= -JPEG_FIX(0.899976223);                                                       \
+    z2 *= -JPEG_FIX(2.562915447);                                                       \
+    z3 = z3 * -JPEG_FIX(1.961570560) + z5;                                              \
+    z4 = z4 * -JPEG_FIX(0.390180644) + z5;                                              \
+    t0 += z1 + z3;                                                                      \
+    t1 += z2 + z4;                                                                      \
+    t2 += z2 + z3;                                                                      \
+    t3 += z1 + z4;
+
+static void jpegIdct(const int *coef, uint8 *out, int stride)
+{
+    int work[64];
+    int t0, t1, t2, t3, t10, t11, t12, t13, z1, z2, z3, z4, z5;
+    int *w;
+    int i;
+
+    for (i = 0; i < 8; ++i)
+    {
+        const int *in = coef + i;
+
+        w = work + i;
+        // Most columns of a typical block only have their DC term
+        if (!(in[8] | in[16] | in[24] | in[32] | in[40] | in[48] | in[56]))
+        {
+            int dc = in[0] * (1 << JPEG_PASS1_BITS);
+
+            w[0] = w[8] = w[16] = w[24] = w[32] = w[40] = w[48] = w[56] = dc;
+            continue;
+        }
+        JPEG_IDCT_1D(in, 8)
+        w[0] = JPEG_DESCALE(t10 + t3, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[56] = JPEG_DESCALE(t10 - t3, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[8] = JPEG_DESCALE(t11 + t2, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[48] = JPEG_DESCALE(t11 - t2, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[16] = JPEG_DESCALE(t12 + t1, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[40] = JPEG_DESCALE(t12 - t1, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[24] = JPEG_DESCALE(t13 + t0, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+        w[32] = JPEG_DESCALE(t13 - t0, JPEG_CONST_BITS - JPEG_PASS1_BITS);
+    }
+
+    // Rows, back to samples with the level shift
+    for (i = 0, w = work; i < 8; ++i, w += 8, out += stride)
+    {
+        JPEG_IDCT_1D(w, 1)
+        #define JPEG_OUT(x) jpegClamp(JPEG_DESCALE(x, JPEG_CONST_BITS + JPEG_PASS1_BITS + 3) + 128)
+        out[0] = JPEG_OUT(t10 + t3);
+        out[7] = JPEG_OUT(t10 - t3);
+        out[1] = JPEG_OUT(t11 + t2);
+        out[6] = JPEG_OUT(t11 - t2);
+        out[2] = JPEG_OUT(t12 + t1);
+        out[5] = JPEG_OUT(t12 - t1);
+        out[3] = JPEG_OUT(t13 + t0);
+        out[4] = JPEG_OUT(t13 - t0);
+        #undef JPEG_OUT
+    }
+}
+
+
+// JFIF YCbCr to RGB, full range, 16.16 fixed point
+#define JPEG_CFIX(x) ((int)((x) * 65536 + 0.5))
+
+static inline void jpegPutPixel(uint8 *p, int r, int g, int b)
+{
+    p[0] = (r & 0xf8) | (g >> 5);
+    p[1] = ((g << 3) & 0xe0) | (b >> 3);
+}
+
+// Convert the MCU at mx, my into the framebuffer, cropped to the image and the panel
+static void jpegStoreMcu(uint8 *buffer, int mx, int my)
+{
+    int sx = jpegComponents[0].h - 1;
+    int sy = jpegComponents[0].v - 1;
+    int mcuWidth = 8 << sx;
+    int x0 = mx * mcuWidth;
+    int y0 = my * (8 << sy);
+    int width = ((jpegWidth < LCD_WIDTH) ? jpegWidth : LCD_WIDTH) - x0;
+    int height = ((jpegHeight < LCD_HEIGHT) ? jpegHeight : LCD_HEIGHT) - y0;
+    int x, y;
+
+    if (width > mcuWidth)
+        width = mcuWidth;
+    if (height > (8 << sy))
+        height = 8 << sy;
+
+    for (y = 0; y < height; ++y)
+    {
+        const uint8 *luma = jpegLuma + y * mcuWidth;
+        uint8 *p = buffer + ((y0 + y) * LCD_WIDTH + x0) * 2;
+
+        if (jpegComponentCount == 1)
+        {
+            for (x = 0; x < width; ++x, p += 2)
+                jpegPutPixel(p, luma[x], luma[x], luma[x]);
+            continue;
+        }
+        for (x = 0; x < width; )
+        {
+            // Chroma terms once per chroma sample
+            int cb = jpegCb[(y >> sy) * 8 + (x >> sx)] - 128;
+            int cr = jpegCr[(y >> sy) * 8 + (x >> sx)] - 128;
+            int rv = (JPEG_CFIX(1.40200) * cr + 32768) >> 16;
+            int guv = (-JPEG_CFIX(0.34414) * cb - JPEG_CFIX(0.71414) * cr + 32768) >> 16;
+            int bu = (JPEG_CFIX(1.77200) * cb + 32768) >> 16;
+            int end = (x | sx) + 1;
+
+            if (end > width)
+                end = width;
+            for (; x < end; ++x, p += 2)
+            {
+                int l = luma[x];
+
+                jpegPutPixel(p, jpegClamp(l + rv), jpegClamp(l + guv), jpegClamp(l + bu));
+            }
+        }
+    }
+}
+
+
+// Step over an RST marker between restart intervals
+static int jpegRestart()
+{
+    int c;
+
+    jpegBitCount = 0;
+    while (!jpegMarker)
+    {
+        // Skip to the marker, there should be nothing but padding before it
+        if ((c = jpegByte()) < 0)
+            return JPEG_BAD;
+        if (c == 0xff)
+        {
+            while ((c = jpegByte()) == 0xff)
+                ;
+            if (c < 0)
+                return JPEG_BAD;
+            if (c != 0)
+                jpegMarker = c;
+        }
+    }
+    if (jpegMarker < JPEG_RST0 || jpegMarker > JPEG_RST7)
+        return JPEG_BAD;
+    jpegMarker = 0;
+    jpegComponents[0].predictor = jpegComponents[1].predictor = jpegComponents[2].predictor = 0;
+    return JPEG_OK;
+}
+
+
+int jpegDecode(uint8 *buffer)
+{
+    uint32 start = lcdHalCycles();
+    int coef[64];
+    int sx = jpegComponents[0].h - 1;
+    int sy = jpegComponents[0].v - 1;
+    int mcusX = (jpegWidth + (8 << sx) - 1) >> (3 + sx);
+    int mcusY = (jpegHeight + (8 << sy) - 1) >> (3 + sy);
+    int mcuWidth = 8 << sx;
+    int todo = jpegRestartInterval;
+    int mx, my, i, bx, by;
+    int result = JPEG_OK;
+
+    jpegBits = 0;
+    jpegBitCount = 0;
+    jpegMarker = 0;
+    jpegComponents[0].predictor = jpegComponents[1].predictor = jpegComponents[2].predictor = 0;
+
+    if (jpegWidth < LCD_WIDTH || jpegHeight < LCD_HEIGHT)
+        memset(buffer, 0, LCD_FRAME_LEN);
+
+    // MCUs below the panel are left undecoded, the rest of the scan is drained
+    if (mcusY > (LCD_HEIGHT + (8 << sy) - 1) >> (3 + sy))
+        mcusY = (LCD_HEIGHT + (8 << sy) - 1) >> (3 + sy);
+
+    for (my = 0; my < mcusY && result == JPEG_OK; ++my)
+    {
+        for (mx = 0; mx < mcusX && result == JPEG_OK; ++mx)
+        {
+            if (jpegRestartInterval && todo-- == 0)
+            {
+                result = jpegRestart();
+                todo = jpegRestartInterval - 1;
+                if (result != JPEG_OK)
+                    break;
+            }
+
+            for (by = 0; by <= sy && result == JPEG_OK; ++by)
+            {
+                for (bx = 0; bx <= sx && result == JPEG_OK; ++bx)
+                {
+                    result = jpegDecodeBlock(&jpegComponents[0], coef);
+                    jpegIdct(coef, jpegLuma + by * 8 * mcuWidth + bx * 8, mcuWidth);
+                }
+            }
+            for (i = 1; i < jpegComponentCount && result == JPEG_OK; ++i)
+            {
+                result = jpegDecodeBlock(&jpegComponents[i], coef);
+                jpegIdct(coef, (i == 1) ? jpegCb : jpegCr, 8);
+            }
+            if (mx * mcuWidth < LCD_WIDTH)
+                jpegStoreMcu(buffer, mx, my);
+        }
+    }
+
+    // A scan cut short just decodes as zeros, only a failed read counts
+    if (jpegStream.failed)
+        result = JPEG_READ_FAILED;
+    if (result == JPEG_OK)
+    {
+        ++jpegStats.decoded;
+        jpegStats.bytes += jpegLength;
+        jpegStats.cycles += lcdHalCycles() - start;
+    }
+    else
+    {
+        ++jpegStats.bad;
+    }
+    return result;
+}
+
+
+void jpegGetStats(struct jpegStats *stats)
+{
+    *stats = jpegStats;
+}
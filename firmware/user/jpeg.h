@@ -0,0 +1,26 @@
+#ifndef __JPEG_H__
+#define __JPEG_H__
+
+#include "frame.h"
+
+#define JPEG_OK 0
+#define JPEG_BAD 1              // not a baseline JPEG this decoder handles
+#define JPEG_READ_FAILED 2      // read() failed, the connection is gone
+
+struct jpegStats
+{
+    uint32 decoded;     // frames decoded into a framebuffer
+    uint32 bad;         // frames rejected, in the headers or the scan
+    uint32 bytes;       // JPEG bytes of the decoded frames
+    uint32 cycles;      // CPU cycles spent in jpegDecode()
+};
+
+// Parse the markers of a length byte JPEG up to its scan. The stream starts
+// after the 0xFF of the SOI marker, frameDisplay() takes that as format byte.
+int jpegReadHeader(frameReadFn read, void *ctx, size_t length);
+// Decode the scan into an RGB565 framebuffer, cropping to LCD_WIDTH x
+// LCD_HEIGHT. Whatever a smaller image leaves uncovered is black.
+int jpegDecode(uint8 *buffer);
+void jpegGetStats(struct jpegStats *stats);
+
+#endif
@@ -32,347 +32,1369 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/queue.h"
-#include "freertos/xtensa_api.h"
 #include "esp_common.h"
-#include "gpio.h"
-#include "spi_register.h"
+#include "lcd_hal.h"
+#include "lcd.h"
 
-// #define TIMING_DEBUG
-#define FPS_COUNTER
+/*
+ * Framebuffer ring. The network side fills lcdBack, lcdPending holds the
+ * newest complete frame and lcdFront is being scanned out by the pump.
+ * The pump only ever moves lcdPending to lcdFront, the task side only
+ * touches the indices inside a short critical section.
+ */
+static uint8 *lcdFrameBuffers[LCD_FB_MAX];
+static int lcdFrameBufferCount = 0;
+static volatile int lcdFront = -1;      // -1 when no frame is being scanned out
+static volatile int lcdPending = -1;    // -1 when no frame is waiting
+static int lcdBack = -1;
 
-#ifdef TIMING_DEBUG
-#define LCD_TEST 23
-#endif
+/*
+ * Frames written after lcdPresentIn() wait in lcdTimed, oldest first, until
+ * the cycle counter reaches their lcdDue. The pump moves them to lcdPending
+ * as they fall due. Anything written while frames wait queues behind them,
+ * due at once, so frames always reach the panel in the order written.
+ */
+static int lcdTimed[LCD_FB_MAX];
+static volatile int lcdTimedCount = 0;
+static uint32 lcdDue[LCD_FB_MAX];
+static int lcdDueSet[LCD_FB_MAX];       // lcdDue came from lcdPresentIn()
+static int lcdPresent = 0;              // the next frame written is timed
+static uint32 lcdPresentDue;
+static uint32 lcdPresentLate;           // cycles after lcdPresentDue a full frame is not worth showing
+
+// Regions to scan out of each buffer, a full frame is a single rectangle
+static struct lcdRect lcdRects[LCD_FB_MAX][LCD_MAX_RECTS];
+static int lcdRectCount[LCD_FB_MAX];
+static int lcdFormat[LCD_FB_MAX];           // LCD_RGB565, LCD_RGB444 or LCD_INDEXED()
+static int lcdPanelFormat = -1;             // COLMOD last sent, -1 if unknown
+static int lcdHashFormat = -1;              // format the panel row hashes were taken in
+static int lcdRowBytes = LCD_WIDTH * 2;     // framebuffer row of the frame being scanned out
+
+// Indexed frames carry an RGB565 palette, stored in wire byte order and hashed as words
+static uint16 lcdPalettes[LCD_FB_MAX][LCD_PALETTE_MAX] __attribute__((aligned(4)));
+static const uint16 *lcdPalette = 0;        // palette of the frame being scanned out
+static int lcdIndexBits = 0;                // its bits per pixel
+
+// Indexed, YUV, scaled and block frames are expanded to RGB565 pixel by pixel while staging
+static void (*lcdExpand)(int pixels) = 0;
+static uint32 lcdSrcPixel = 0;              // next pixel to expand
+
+// Four colours of each block of a block frame, wire order, worked out as the
+// scan-out reaches it. lcdBlockRow[] is the block row they are for, 0xff if none.
+static uint16 lcdBlockColors[LCD_WIDTH / 4][4];
+static uint8 lcdBlockRow[LCD_WIDTH / 4];
 
-#ifdef FPS_COUNTER
-#define LCD_FPS 22
-#endif
+/*
+ * Row hashes of what the panel shows, 0 where unknown. Full frames are
+ * hashed as they are written and the pump only scans out the runs of rows
+ * whose hash changed, so a repeated frame costs no SPI time at all.
+ */
+static uint32 lcdPanelHash[LCD_HEIGHT];
+static uint32 lcdRowHash[LCD_FB_MAX][LCD_HEIGHT];
+static int lcdRowHashed[LCD_FB_MAX];
+
+// Called once each buffer's frame is off the wire or replaced
+static void (*lcdFrameDone[LCD_FB_MAX])(void *arg);
+static void *lcdFrameDoneArg[LCD_FB_MAX];
 
-#define LCD_A0  17
-#define LCD_RST 18
-#define LCD_CS  19
-#define LCD_CLK 20
-#define LCD_SDI 21
+/*
+ * Given by the pump whenever a buffer or command queue slot frees up or a
+ * frame finishes. Tasks re-check their condition after each take, so one
+ * binary semaphore serves every waiter.
+ */
+static xSemaphoreHandle lcdSignal;
+static portBASE_TYPE lcdTaskWoken;
 
-#define SPIDEV 3    // SPI Device 3
+static const struct lcdRect *lcdRect = 0;   // rectangle being scanned out
+static int lcdRectsLeft = 0;
+static int lcdRectStart = 0;                // window not programmed yet
 
-static uint8 *lcdFrameBuffer = 0;
-static uint8 *lcdFramePtr = 0;
+/*
+ * Scan-out walks a chain of spans: contiguous runs of framebuffer bytes,
+ * the same (address, length) pairs a DMA descriptor list would carry. A
+ * full-width rectangle is one span, a narrower one is a span per row.
+ */
+static uint8 *lcdSpanPtr = 0;
+static int lcdSpanLeft = 0;     // bytes left in the current span
+static int lcdSpansLeft = 0;    // spans after the current one in this rectangle
 
-static int lcdDone = 0;
+static struct lcdStats lcdStats;
+static uint32 lcdFrameStartBytes = 0;
+static uint32 lcdFrameStartTransactions = 0;
 
 static uint32_t lcdData[16]; //can contain (16*32/9=)56 9-bit data words.
 
-static int lcdXpos = 0;
-static int lcdYpos = 0;
 
 static int lcdDataPos = 0;
 
+#ifdef LCD_3WIRE
+/*
+ * 3-wire mode: every byte goes out as a 9-bit word, D/C bit first, so
+ * commands and data share a burst and A0 is never touched. Words are
+ * packed MSB first into the byte stream; lcdBitAcc holds the bits that
+ * don't fill a whole byte yet.
+ */
+static uint32 lcdBitAcc = 0;
+static int lcdBitCount = 0;
+
+static int lcdSpiBits()
+{
+    return lcdDataPos * 8 + lcdBitCount;
+}
+
+// Room left in the staging buffer, in panel bytes
+static int lcdSpiRoom()
+{
+    return (LCD_SPI_WORDS * 32 - lcdSpiBits()) / 9;
+}
+#else
+static int lcdSpiBits()
+{
+    return lcdDataPos * 8;
+}
+
+static int lcdSpiRoom()
+{
+    return LCD_SPI_WORDS * 4 - lcdDataPos;
+}
+#endif
+
+
+static void lcdSpiWrite(int data)
+{
+    // This fill data into the SPI buffer only. SPI sends each word LSB first.
+    lcdData[lcdDataPos / 4] |= (uint32)data << ((lcdDataPos & 3) * 8);
+    ++lcdDataPos;
+}
+
 
 static void lcdSpiSend(int isCmd)
 {
     int x = 0;
+    int bits;
 
-    if (lcdDataPos == 0)
+#ifdef LCD_3WIRE
+    if (lcdBitCount)
+    {
+        // flush the partial byte, only lcdSpiBits() of it get clocked out
+        bits = lcdSpiBits();
+        lcdSpiWrite((lcdBitAcc << (8 - lcdBitCount)) & 0xff);
+        lcdBitCount = 0;
+    }
+    else
+        bits = lcdSpiBits();
+#else
+    bits = lcdSpiBits();
+#endif
+    if (bits == 0)
         return;
 
-    while (READ_PERI_REG(SPI_CMD(SPIDEV)) & SPI_USR)
+    while (lcdHalSpiBusy())
         ;
 
+#ifndef LCD_3WIRE
     if (isCmd)
     {
-        GPIO_REG_WRITE(GPIO_OUT_W1TC, (1 << LCD_A0));
+        lcdHalPinClear(LCD_A0);
     }
     else
     {
-        GPIO_REG_WRITE(GPIO_OUT_W1TS, (1 << LCD_A0));
+        lcdHalPinSet(LCD_A0);
     }
+#endif
 
-    for (x = 0; x < 16; x++)
+    for (x = 0; x < (lcdDataPos + 3) / 4; x++)
     {
-        WRITE_PERI_REG(SPI_W0(SPIDEV) + (x * 4), lcdData[x]);  // It seems SPI has 16 32-bit buffer named SPI_W0 ~ SPI_W15
+        lcdHalSpiWord(x, lcdData[x]);
         lcdData[x] = 0;
     }
-    WRITE_PERI_REG(SPI_USER1(SPIDEV), (((lcdDataPos * 8) - 1) << SPI_USR_MOSI_BITLEN_S));
-
-    WRITE_PERI_REG(SPI_CMD(SPIDEV), SPI_USR);
+    lcdHalSpiStart(bits);
+#ifdef LCD_3WIRE
+    lcdStats.spiBytes += bits / 9;
+#else
+    lcdStats.spiBytes += lcdDataPos;
+#endif
+    ++lcdStats.spiTransactions;
     lcdDataPos = 0;
 }
 
 
-static void lcdSpiWrite(int data)
+#ifdef LCD_3WIRE
+// Stage one 9-bit word, D/C in bit 8. Callers check lcdSpiRoom() first.
+static void lcdSpiWrite9(int word)
 {
-    // This fill data into the SPI buffer only
-    int bytePos = lcdDataPos / 4;
-    switch (lcdDataPos & 3)
-    {
-    case 0:
-        lcdData[bytePos] |= data << 24;
-        break;
-    case 1:
-        lcdData[bytePos] |= data << 16;
-        break;
-    case 2:
-        lcdData[bytePos] |= data << 8;
-        break;
-    case 3:
-        lcdData[bytePos] |= data;
-        break;
+    lcdBitAcc = (lcdBitAcc << 9) | word;
+    lcdBitCount += 9;
+    while (lcdBitCount >= 8)
+    {
+        lcdBitCount -= 8;
+        lcdSpiWrite((lcdBitAcc >> lcdBitCount) & 0xff);
     }
-    ++lcdDataPos;
 }
 
 
 static void SPI_WriteCMD(int cmd)
 {
-    if (lcdDataPos != 0) lcdSpiSend(0); // flush previous non-command data
-    lcdSpiWrite(cmd);
-    lcdSpiSend(1);
+    lcdSpiWrite9(cmd & 0xff);   // D/C = 0
 }
 
 
 static void SPI_WriteDAT(int dat)
 {
-    lcdSpiWrite(dat & 0xff);
+    lcdSpiWrite9(0x100 | (dat & 0xff));
 }
+#endif
 
 
+/*
+ * The pump stages the next burst while the previous one is on the wire and
+ * wakes up when that burst should be done, as worked out from the SPI clock
+ * divider and CPU frequency at init. No fixed tick guess, so scan-out tracks
+ * the real wire time at any clock setting.
+ */
+static uint32 lcdBitCycles16 = 0;   // CPU cycles per SPI bit, 12.4 fixed point
+static uint32 lcdBurstCycles = 0;   // wire time of a full burst
+static uint32 lcdLateCycles = 0;    // idle time on the wire counted as an underrun
+static uint32 lcdBurstDone = 0;     // cycle count when the last burst is off the wire
+static uint32 lcdMsCycles = 0;      // CPU cycles per millisecond, for command delays
+static volatile int lcdRunning = 0; // pump timer is armed
+static int lcdWaiting = 0;          // only armed for the first timed frame to fall due
+
+static uint32 lcdWireCycles(int bits)
+{
+    // +2 bit times for CS setup and hold
+    return ((bits + 2) * lcdBitCycles16) >> 4;
+}
 
-// 1000 ticks in-between every 32-bytes SPI data. Is just enough for our LCD controller
-#define SENDTICKS 1000
 
-void lcdPumpPixels()
+/*
+ * Command queue. Panel setup goes through the pump just like pixels: the
+ * caller queues a list of records and the pump stages them between frames,
+ * so no task spins on the SPI busy bit or sleeps through reset delays.
+ */
+struct lcdCmdList
 {
-#ifdef TIMING_DEBUG
-    GPIO_REG_WRITE(GPIO_OUT_W1TS, (1 << LCD_TEST));
+    const struct lcdCmd *cmds;
+    int count;
+    void (*done)(void *arg);
+    void *arg;
+};
+
+#define LCD_CMD_QUEUE 4
+#define LCD_CMD_RESET 0x101     // release the reset pin, only used by lcdInit()
+
+static struct lcdCmdList lcdCmdQueue[LCD_CMD_QUEUE];
+static volatile int lcdCmdHead = 0;     // list being sent, or the next one
+static volatile int lcdCmdTail = 0;
+static int lcdCmdActive = 0;            // the pump is sending lcdCmdQueue[lcdCmdHead]
+
+static const struct lcdCmd *lcdCmd = 0; // next record to stage
+static int lcdCmdsLeft = 0;
+#ifndef LCD_3WIRE
+static int lcdCmdData = 0;              // command byte is out, its data goes next
+static int lcdStagedCmd = 0;            // staged burst is a command byte, A0 low
 #endif
-    if (lcdYpos == 160)
+static int lcdStagedReset = 0;          // release reset as the burst goes out
+static uint32 lcdStagedDelay = 0;       // extra cycles to wait after the burst
+
+// Interface pixel format, sent ahead of a frame when it differs from the last one
+static struct lcdCmd lcdColmod = { 0x3a, 1, 0 };
+
+// Window of the rectangle being scanned out
+static struct lcdCmd lcdWindow[3] =
+{
+    { 0x2a, 4, 0 },     // Column address set
+    { 0x2b, 4, 0 },     // Page address set
+    { 0x2c, 0, 0 },     // Memory write
+};
+
+
+static void lcdSetWindow(const struct lcdRect *rect)
+{
+    lcdWindow[0].data[1] = rect->x;
+    lcdWindow[0].data[3] = rect->x + rect->w - 1;
+    lcdWindow[1].data[1] = rect->y;
+    lcdWindow[1].data[3] = rect->y + rect->h - 1;
+    lcdCmd = lcdWindow;
+    lcdCmdsLeft = 3;
+}
+
+
+static void lcdStartRect()
+{
+    // Packed RGB444, indexed and YUV frames only ever have full-width rectangles
+    if (lcdExpand)
     {
-        // printf("Disp Done\n");
-#ifdef FPS_COUNTER
-        GPIO_REG_WRITE(GPIO_OUT_W1TC, (1 << LCD_FPS));
+        // The span counts expanded RGB565 bytes
+        lcdSrcPixel = lcdRect->y * LCD_WIDTH;
+        lcdSpanLeft = lcdRect->h * LCD_WIDTH * 2;
+        lcdSpansLeft = 0;
+        lcdRectStart = 1;
+        return;
+    }
+    lcdSpanPtr = lcdFrameBuffers[lcdFront] + lcdRect->y * lcdRowBytes + lcdRect->x * 2;
+    if (lcdRect->w == LCD_WIDTH)
+    {
+        lcdSpanLeft = lcdRect->h * lcdRowBytes;
+        lcdSpansLeft = 0;
+    }
+    else
+    {
+        lcdSpanLeft = lcdRect->w * 2;
+        lcdSpansLeft = lcdRect->h - 1;
+    }
+    lcdRectStart = 1;
+}
+
+
+/*
+ * Stage command records into the burst. Stops after a record that wants a
+ * delay, when the burst is full, or in 4-wire mode whenever A0 changes, so
+ * there a command byte and its data are always two bursts.
+ */
+static void lcdFillCmds()
+{
+    while (lcdCmdsLeft)
+    {
+        const struct lcdCmd *c = lcdCmd;
+        int i;
+
+        if (c->cmd > 0xff)
+        {
+            // pin and delay records get a burst of their own
+            if (lcdSpiBits())
+                return;
+            if (c->cmd == LCD_CMD_RESET)
+                lcdStagedReset = 1;
+        }
+        else
+        {
+#ifdef LCD_3WIRE
+            if (lcdSpiRoom() < 1 + c->len)
+                return;
+            SPI_WriteCMD(c->cmd);
+            for (i = 0; i < c->len; ++i)
+                SPI_WriteDAT(c->data[i]);
+#else
+            if (!lcdCmdData)
+            {
+                if (lcdSpiBits())
+                    return;
+                lcdSpiWrite(c->cmd);
+                lcdStagedCmd = 1;
+                if (c->len)
+                {
+                    lcdCmdData = 1;
+                    return;
+                }
+            }
+            else
+            {
+                for (i = 0; i < c->len; ++i)
+                    lcdSpiWrite(c->data[i]);
+                lcdCmdData = 0;
+            }
 #endif
-        // ack int
-        xthal_set_ccompare(1, xthal_get_ccount() - 1);
-        // disable int
-        xt_ints_off(1 << XCHAL_TIMER_INTERRUPT(1));
-        lcdDone = 1;
+        }
+        ++lcdCmd;
+        --lcdCmdsLeft;
+        if (c->delay)
+        {
+            lcdStagedDelay = c->delay * lcdMsCycles;
+            return;
+        }
+#ifndef LCD_3WIRE
         return;
+#endif
     }
-    do
+}
+
+
+static int lcdStaged()
+{
+    return lcdSpiBits() || lcdStagedDelay || lcdStagedReset;
+}
+
+
+#ifdef LCD_3WIRE
+// Stage n framebuffer bytes, each one a 9-bit data word
+static void lcdSpiWriteBytes(const uint8 *src, int n)
+{
+    while (n--)
+        SPI_WriteDAT(*src++);
+}
+#else
+static void lcdSpiWriteBytes(const uint8 *src, int n)
+{
+    uint32_t *dst;
+
+    while (n && (lcdDataPos & 3))
+    {
+        lcdSpiWrite(*src++);
+        --n;
+    }
+    dst = &lcdData[lcdDataPos / 4];
+    lcdDataPos += n & ~3;
+    if (((uintptr_t)src & 3) == 0)
     {
-        SPI_WriteDAT(*lcdFramePtr);
-        ++lcdFramePtr;
-        SPI_WriteDAT(*lcdFramePtr);
-        ++lcdFramePtr;
-        ++lcdXpos;
-    } while (lcdXpos & 31);
+        for (; n >= 4; n -= 4, src += 4)
+            *dst++ = *(const uint32_t *)src;
+    }
+    else
+    {
+        for (; n >= 4; n -= 4, src += 4)
+            *dst++ = ((const uint16_t *)src)[0] | ((uint32_t)((const uint16_t *)src)[1] << 16);
+    }
+    while (n--)
+        lcdSpiWrite(*src++);
+}
+#endif
 
-#ifdef TIMING_DEBUG
-    GPIO_REG_WRITE(GPIO_OUT_W1TC, (1 << LCD_TEST));
+
+static inline void lcdSpiWritePixel(uint32 pixel)
+{
+    // pixel holds the two RGB565 bytes in wire order
+#ifdef LCD_3WIRE
+    SPI_WriteDAT(pixel);
+    SPI_WriteDAT(pixel >> 8);
+#else
+    lcdData[lcdDataPos / 4] |= pixel << ((lcdDataPos & 3) * 8);
+    lcdDataPos += 2;
 #endif
+}
+
+
+// Stage n pixels of an indexed frame, looked up in the palette as they go
+static void lcdSpiWriteIndexed(int n)
+{
+    const uint8 *src = lcdFrameBuffers[lcdFront];
+    int bits = lcdIndexBits;
+    uint32 bit = lcdSrcPixel * bits;
+    uint32 mask = (1 << bits) - 1;
 
-    if (READ_PERI_REG(SPI_CMD(SPIDEV)) & SPI_USR)
+    lcdSrcPixel += n;
+    while (n--)
     {
-        printf("SPI not done!\n");
-        lcdXpos = 0;
-        lcdYpos = 160; // End frame, this one is probably borked anyway.
-        return;
+        // First pixel in the most significant bits of each byte
+        uint32 index = (src[bit >> 3] >> (8 - bits - (bit & 7))) & mask;
+
+        bit += bits;
+        lcdSpiWritePixel(lcdPalette[index]);
     }
-    lcdSpiSend(0);
+}
+
+
+static inline int lcdClamp(int v)
+{
+    if ((unsigned)v > 255)
+        v = v < 0 ? 0 : 255;
+    return v;
+}
+
+
+struct lcdChroma
+{
+    int rv, guv, bu;
+};
 
-    if (lcdXpos >= 128)
+static inline void lcdYuvChroma(struct lcdChroma *c, int u, int v)
+{
+    int d = u - 128;
+    int e = v - 128;
+
+    c->rv = 409 * e + 128;
+    c->guv = -100 * d - 208 * e + 128;
+    c->bu = 516 * d + 128;
+}
+
+
+/*
+ * Stage n pixels of a planar YUV 4:2:0 frame, BT.601 studio range in 8.8
+ * fixed point. The chroma terms are worked out once per pixel pair.
+ */
+static void lcdSpiWriteYuv(int n)
+{
+    const uint8 *luma = lcdFrameBuffers[lcdFront] + lcdSrcPixel;
+    int x = lcdSrcPixel % LCD_WIDTH;
+    int y = lcdSrcPixel / LCD_WIDTH;
+    const uint8 *cb = lcdFrameBuffers[lcdFront] + LCD_WIDTH * LCD_HEIGHT + (y / 2) * (LCD_WIDTH / 2);
+    const uint8 *cr = cb + LCD_WIDTH * LCD_HEIGHT / 4;
+    struct lcdChroma chroma;
+
+    lcdSrcPixel += n;
+    lcdYuvChroma(&chroma, cb[x >> 1], cr[x >> 1]);
+    while (n--)
     {
-        lcdXpos = 0;
-        ++lcdYpos;
+        int c = 298 * (*luma++ - 16);
+        int r = lcdClamp((c + chroma.rv) >> 8);
+        int g = lcdClamp((c + chroma.guv) >> 8);
+        int b = lcdClamp((c + chroma.bu) >> 8);
+
+        lcdSpiWritePixel((r & 0xf8) | (g >> 5) | ((g & 0x1c) << 11) | ((b & 0xf8) << 5));
+        if (++x == LCD_WIDTH)
+        {
+            x = 0;
+            if (!(++y & 1))
+            {
+                cb += LCD_WIDTH / 2;
+                cr += LCD_WIDTH / 2;
+            }
+        }
+        if (!(x & 1) && n)
+            lcdYuvChroma(&chroma, cb[x >> 1], cr[x >> 1]);
     }
+}
+
+
+// Channel by channel, (2 * a + b) / 3 of two RGB565 colours, rounded
+static inline uint32 lcdBlockMix(uint32 a, uint32 b)
+{
+    uint32 r = ((a >> 11) * 2 + (b >> 11) + 1) / 3;
+    uint32 g = (((a >> 5) & 63) * 2 + ((b >> 5) & 63) + 1) / 3;
+    uint32 bl = ((a & 31) * 2 + (b & 31) + 1) / 3;
 
-    xthal_set_ccompare(1, xthal_get_ccount() + SENDTICKS);
-    xt_ints_on(1 << XCHAL_TIMER_INTERRUPT(1));
+    return (r << 11) | (g << 5) | bl;
+}
 
+static void lcdBlockColorsFor(int bx, int by)
+{
+    const uint8 *block = lcdFrameBuffers[lcdFront] + (by * (LCD_WIDTH / 4) + bx) * LCD_BLOCK_BYTES;
+    uint32 c0 = (block[0] << 8) | block[1];
+    uint32 c1 = (block[2] << 8) | block[3];
+    uint32 c2 = lcdBlockMix(c0, c1);
+    uint32 c3 = lcdBlockMix(c1, c0);
+
+    lcdBlockColors[bx][0] = block[0] | (block[1] << 8);
+    lcdBlockColors[bx][1] = block[2] | (block[3] << 8);
+    lcdBlockColors[bx][2] = (c2 >> 8) | ((c2 & 0xff) << 8);
+    lcdBlockColors[bx][3] = (c3 >> 8) | ((c3 & 0xff) << 8);
+    lcdBlockRow[bx] = by;
 }
 
 
-void lcdWriteFrame()
+// Stage n pixels of a block frame. A block's colours are worked out once for its four rows.
+static void lcdSpiWriteBlocks(int n)
 {
-    int index;
-    int col;
-    int x, y;
-    if (!lcdDone)
+    int x = lcdSrcPixel % LCD_WIDTH;
+    int y = lcdSrcPixel / LCD_WIDTH;
+    const uint8 *indices = lcdFrameBuffers[lcdFront] + (y >> 2) * (LCD_WIDTH / 4) * LCD_BLOCK_BYTES + 4 + (y & 3);
+
+    lcdSrcPixel += n;
+    while (n--)
     {
-        printf("LCD not done yet. Skipping frame.\n");
-        return;
+        int bx = x >> 2;
+
+        if (lcdBlockRow[bx] != (y >> 2))
+            lcdBlockColorsFor(bx, y >> 2);
+        lcdSpiWritePixel(lcdBlockColors[bx][(indices[bx * LCD_BLOCK_BYTES] >> (6 - 2 * (x & 3))) & 3]);
+        if (++x == LCD_WIDTH)
+        {
+            x = 0;
+            ++y;
+            indices = lcdFrameBuffers[lcdFront] + (y >> 2) * (LCD_WIDTH / 4) * LCD_BLOCK_BYTES + 4 + (y & 3);
+        }
+    }
+}
+
+
+// Stage n pixels of a low resolution RGB565 frame, doubling pixels and/or lines
+static void lcdSpiWriteScaled(int n)
+{
+    int sx = LCD_SCALE_X(lcdFormat[lcdFront]);
+    int sy = LCD_SCALE_Y(lcdFormat[lcdFront]);
+    int x = lcdSrcPixel % LCD_WIDTH;
+    int y = lcdSrcPixel / LCD_WIDTH;
+    const uint16 *row = (const uint16 *)lcdFrameBuffers[lcdFront] + (y >> sy) * (LCD_WIDTH >> sx);
+
+    lcdSrcPixel += n;
+    while (n--)
+    {
+        lcdSpiWritePixel(row[x >> sx]);     // big-endian in memory is wire order
+        if (++x == LCD_WIDTH)
+        {
+            x = 0;
+            if (!(++y & ((1 << sy) - 1)))
+                row += LCD_WIDTH >> sx;
+        }
     }
+}
 
-    SPI_WriteCMD(0x2a); // Column address set
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x9f); // 0 - 159
-    SPI_WriteCMD(0x2b); // Page address set
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x7f); // 0 - 127
-    SPI_WriteCMD(0x2c); // Memory write
-    lcdFramePtr = lcdFrameBuffer;
-    lcdXpos = 0;
-    lcdYpos = 0;
+
+// Stage the next burst, up to a full SPI buffer. A burst never spans two rectangles.
+static void lcdFillBurst()
+{
+    for (;;)
+    {
+        if (lcdCmdsLeft)
+        {
+            lcdFillCmds();
+            if (lcdCmdsLeft || lcdStagedDelay || lcdStagedReset)
+                return;
+#ifndef LCD_3WIRE
+            if (lcdSpiBits())
+                return;     // A0 is set per burst, pixels go in the next one
+#endif
+        }
+        if (lcdRectsLeft == 0)
+            return;
+        if (!lcdRectStart)
+            break;
+        lcdSetWindow(lcdRect);
+        lcdRectStart = 0;
+    }
+    do
+    {
+        int n = lcdSpiRoom();
+        if (n > lcdSpanLeft)
+            n = lcdSpanLeft;
+        if (lcdExpand)
+        {
+            n &= ~1;    // whole pixels only
+            if (n == 0)
+                break;
+            lcdExpand(n / 2);
+        }
+        else
+        {
+            lcdSpiWriteBytes(lcdSpanPtr, n);
+            lcdSpanPtr += n;
+        }
+        lcdSpanLeft -= n;
+        if (lcdSpanLeft == 0)
+        {
+            if (lcdSpansLeft == 0)
+            {
+                if (--lcdRectsLeft)
+                {
+                    ++lcdRect;
+                    lcdStartRect();
+                }
+                break;
+            }
+            --lcdSpansLeft;
+            lcdSpanPtr += (LCD_WIDTH - lcdRect->w) * 2;
+            lcdSpanLeft = lcdRect->w * 2;
+        }
+    } while (lcdSpiRoom() > 0);
+}
+
+
+// Drop whatever is staged, the current frame or command list ends with it
+static void lcdDropStaged()
+{
+    memset(lcdData, 0, sizeof(lcdData));
     lcdDataPos = 0;
-    lcdDone = 0;
+#ifdef LCD_3WIRE
+    lcdBitCount = 0;
+#else
+    lcdStagedCmd = 0;
+    lcdCmdData = 0;
+#endif
+    if (lcdStagedReset)
+        lcdHalPinSet(LCD_RST);
+    lcdStagedReset = 0;
+    lcdStagedDelay = 0;
+    if (lcdFront >= 0)
+    {
+        memset(lcdPanelHash, 0, sizeof(lcdPanelHash));
+        lcdPanelFormat = -1;
+    }
+    lcdRectsLeft = 0;
+    lcdCmdsLeft = 0;
+}
+
+
+static void lcdWake()
+{
+    xSemaphoreGiveFromISR(lcdSignal, &lcdTaskWoken);
+}
+
+
+static void lcdRetireFrame(int i)
+{
+    void (*done)(void *arg) = lcdFrameDone[i];
+
+    lcdFrameDone[i] = NULL;
+    lcdDueSet[i] = 0;
+    if (done)
+        done(lcdFrameDoneArg[i]);
+}
+
+
+// FNV-1a over 32-bit words, data 4-byte aligned like the framebuffers and palettes
+static uint32 lcdHash(uint32 h, const uint8 *data, int bytes)
+{
+    const uint32 *p = (const uint32 *)data;
+
+    for (bytes /= 4; bytes; --bytes)
+        h = (h ^ *p++) * 16777619u;
+    return h;
+}
+
+
+static void lcdHashRows(int i)
+{
+    const uint8 *p = lcdFrameBuffers[i];
+    int format = lcdFormat[i];
+    uint32 seed = 2166136261u;
+    int y;
+
+    // Same indices through another palette are another row
+    if (LCD_IS_INDEXED(format))
+        seed = lcdHash(seed, (const uint8 *)lcdPalettes[i], (1 << LCD_INDEX_BITS(format)) * 2);
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        uint32 h;
+
+        if (format == LCD_YUV420)
+        {
+            // Luma row and the chroma rows it shares with its neighbour
+            const uint8 *cb = p + LCD_WIDTH * LCD_HEIGHT + (y / 2) * (LCD_WIDTH / 2);
+
+            h = lcdHash(seed, p + y * LCD_WIDTH, LCD_WIDTH);
+            h = lcdHash(h, cb, LCD_WIDTH / 2);
+            h = lcdHash(h, cb + LCD_WIDTH * LCD_HEIGHT / 4, LCD_WIDTH / 2);
+        }
+        else if (LCD_IS_SCALED(format))
+        {
+            int rowBytes = (LCD_WIDTH >> LCD_SCALE_X(format)) * 2;
+
+            h = lcdHash(seed, p + (y >> LCD_SCALE_Y(format)) * rowBytes, rowBytes);
+        }
+        else if (format == LCD_BLOCKS)
+        {
+            // The whole row of blocks, colours and all index rows
+            h = lcdHash(seed, p + (y >> 2) * LCD_ROW_BYTES(format) * 4, LCD_ROW_BYTES(format) * 4);
+        }
+        else
+        {
+            h = lcdHash(seed, p + y * LCD_ROW_BYTES(format), LCD_ROW_BYTES(format));
+        }
+        lcdRowHash[i][y] = h ? h : 1;
+    }
+}
+
+
+// Replace a hashed frame's rectangle by full-width runs of the rows that changed
+static void lcdDiffRows(int i)
+{
+    struct lcdRect *rects = lcdRects[i];
+    int count = 0;
+    int y;
+
+    for (y = 0; y < LCD_HEIGHT; ++y)
+    {
+        if (lcdRowHash[i][y] == lcdPanelHash[y])
+            continue;
+        lcdPanelHash[y] = lcdRowHash[i][y];
+        if (count && (rects[count - 1].y + rects[count - 1].h == y || count == LCD_MAX_RECTS))
+        {
+            // extend the last run, across the gap if out of rectangles
+            rects[count - 1].h = y + 1 - rects[count - 1].y;
+        }
+        else
+        {
+            rects[count].x = 0;
+            rects[count].y = y;
+            rects[count].w = LCD_WIDTH;
+            rects[count].h = 1;
+            ++count;
+        }
+    }
+    lcdRectCount[i] = count;
+}
+
+
+static uint32 lcdRectBytes(const struct lcdRect *rects, int count)
+{
+    uint32 bytes = 0;
+
+    while (count--)
+    {
+        if (rects->w == LCD_WIDTH)
+            bytes += rects->h * lcdRowBytes;
+        else
+            bytes += rects->w * rects->h * 2;
+        ++rects;
+    }
+    return bytes;
+}
+
+
+// Take lcdPending for scan-out
+static void lcdStartFrame()
+{
+    uint32 bytes;
+    int format;
+    int i;
+
+    lcdFront = lcdPending;
+    lcdPending = -1;
+    if (lcdDueSet[lcdFront])
+    {
+        uint32 late = (lcdHalCycles() - lcdDue[lcdFront]) / (lcdMsCycles / 1000);
+
+        ++lcdStats.presented;
+        lcdStats.presentUs += late;
+        if (late > lcdStats.presentMaxUs)
+            lcdStats.presentMaxUs = late;
+        lcdDueSet[lcdFront] = 0;
+    }
+    lcdFrameStartBytes = lcdStats.spiBytes;
+    lcdFrameStartTransactions = lcdStats.spiTransactions;
+
+    format = lcdFormat[lcdFront];
+    lcdRowBytes = LCD_ROW_BYTES(format);
+    lcdExpand = 0;
+    if (LCD_IS_INDEXED(format))
+    {
+        lcdIndexBits = LCD_INDEX_BITS(format);
+        lcdPalette = lcdPalettes[lcdFront];
+        lcdExpand = lcdSpiWriteIndexed;
+    }
+    else if (format == LCD_YUV420)
+    {
+        lcdExpand = lcdSpiWriteYuv;
+    }
+    else if (LCD_IS_SCALED(format))
+    {
+        lcdExpand = lcdSpiWriteScaled;
+    }
+    else if (format == LCD_BLOCKS)
+    {
+        memset(lcdBlockRow, 0xff, sizeof(lcdBlockRow));
+        lcdExpand = lcdSpiWriteBlocks;
+    }
+    if (lcdExpand)
+        format = LCD_RGB565;    // expanded on the fly
+    if (format != lcdPanelFormat)
+    {
+        lcdPanelFormat = format;
+        lcdColmod.data[0] = lcdPanelFormat;
+        lcdCmd = &lcdColmod;
+        lcdCmdsLeft = 1;
+        memset(lcdPanelHash, 0, sizeof(lcdPanelHash));
+    }
+    if (lcdFormat[lcdFront] != lcdHashFormat)
+    {
+        lcdHashFormat = lcdFormat[lcdFront];
+        memset(lcdPanelHash, 0, sizeof(lcdPanelHash));
+    }
+
+    bytes = lcdRectBytes(lcdRects[lcdFront], lcdRectCount[lcdFront]);
+    lcdStats.pixelBytes += bytes;
+    if (lcdRowHashed[lcdFront])
+    {
+        lcdDiffRows(lcdFront);
+        lcdStats.skippedBytes += bytes - lcdRectBytes(lcdRects[lcdFront], lcdRectCount[lcdFront]);
+    }
+    else
+    {
+        // Partial rows, their hashes are unknown from now on
+        for (i = 0; i < lcdRectCount[lcdFront]; ++i)
+            memset(&lcdPanelHash[lcdRects[lcdFront][i].y], 0, lcdRects[lcdFront][i].h * sizeof(uint32));
+    }
+
+    lcdRect = lcdRects[lcdFront];
+    lcdRectsLeft = lcdRectCount[lcdFront];
+    lcdStartRect();
 #ifdef FPS_COUNTER
-    GPIO_REG_WRITE(GPIO_OUT_W1TS, (1 << LCD_FPS));
+    lcdHalPinSet(LCD_FPS);
 #endif
-    lcdPumpPixels();
+    lcdWake();      // a full ring has room again
 }
 
 
-void lcdInit(uint8* buffer)
+// The frame or command list the pump was sending is off the wire
+static void lcdEndStream()
 {
-    GPIO_ConfigTypeDef GConf;
+    if (lcdFront >= 0)
+    {
+#ifdef FPS_COUNTER
+        lcdHalPinClear(LCD_FPS);
+#endif
+        ++lcdStats.shown;
+        lcdStats.frameBytes = lcdStats.spiBytes - lcdFrameStartBytes;
+        lcdStats.frameTransactions = lcdStats.spiTransactions - lcdFrameStartTransactions;
+        if (lcdPending < 0)
+            ++lcdStats.repeated;
+        lcdRetireFrame(lcdFront);
+        lcdFront = -1;
+        lcdWake();
+    }
+    else if (lcdCmdActive)
+    {
+        struct lcdCmdList *list = &lcdCmdQueue[lcdCmdHead];
+
+        lcdCmdActive = 0;
+        lcdCmdHead = (lcdCmdHead + 1) % LCD_CMD_QUEUE;
+        if (list->done)
+            list->done(list->arg);
+        lcdWake();
+    }
+}
+
+
+static int lcdIsFullFrame(const struct lcdRect *rects, int count)
+{
+    return count == 1 && rects[0].w == LCD_WIDTH && rects[0].h == LCD_HEIGHT;
+}
 
-    printf("LCD init\n");
 
-    lcdFrameBuffer = buffer;
+// Move the timed frames that have fallen due to lcdPending, oldest first
+static void lcdReleaseTimed()
+{
+    uint32 now = lcdHalCycles();
+    int i;
+
+    while (lcdTimedCount && (int32_t)(now - lcdDue[lcdTimed[0]]) >= 0)
+    {
+        i = lcdTimed[0];
+        if (lcdPending >= 0)
+        {
+            // Only a full frame may replace a waiting one
+            if (!lcdIsFullFrame(lcdRects[i], lcdRectCount[i]))
+                break;
+            ++lcdStats.dropped;
+            lcdRetireFrame(lcdPending);
+        }
+        lcdPending = i;
+        --lcdTimedCount;
+        memmove(lcdTimed, lcdTimed + 1, lcdTimedCount * sizeof(lcdTimed[0]));
+    }
+}
 
-    for (int i = 0; i < 40960; ++i)
-        lcdFrameBuffer[i] = 0;
 
-    // Config GPIO pins
-    GConf.GPIO_Pin = (1 << LCD_RST) | (1 << LCD_A0);
+// Stage the first burst of the next command list or frame, commands go first
+static int lcdStartStream()
+{
+    lcdReleaseTimed();
+    if (lcdCmdHead != lcdCmdTail)
+    {
+        lcdCmd = lcdCmdQueue[lcdCmdHead].cmds;
+        lcdCmdsLeft = lcdCmdQueue[lcdCmdHead].count;
+        lcdCmdActive = 1;
+        // commands may touch the panel RAM or its pixel format
+        memset(lcdPanelHash, 0, sizeof(lcdPanelHash));
+        lcdPanelFormat = -1;
+    }
+    else if (lcdPending >= 0)
+    {
+        lcdStartFrame();
+    }
+    else
+    {
+        return 0;
+    }
+    lcdFillBurst();
+    return 1;
+}
+
+
+static void lcdPump()
+{
+    uint32 now;
+    int bits;
+    uint32 entry = lcdHalCycles();
+
 #ifdef TIMING_DEBUG
-    GConf.GPIO_Pin |= (1 << LCD_TEST);
+    lcdHalPinSet(LCD_TEST);
 #endif
-#ifdef FPS_COUNTER
-    GConf.GPIO_Pin |= (1 << LCD_FPS);
+    lcdWaiting = 0;
+    if (!lcdStaged())
+    {
+        // Nothing staged, the last burst of the frame or command list is off the wire
+        // printf("Disp Done\n");
+        lcdEndStream();
+        if (!lcdStartStream())
+        {
+            if (lcdTimedCount)
+            {
+                // Sleep until the next timed frame is due, never arming in the past
+                lcdBurstDone = lcdDue[lcdTimed[0]];
+                if ((int32_t)(lcdBurstDone - lcdHalCycles()) < (int32_t)lcdLateCycles)
+                    lcdBurstDone = lcdHalCycles() + lcdLateCycles;
+                lcdWaiting = 1;
+                lcdHalTimerArm(lcdBurstDone);
+                return;
+            }
+            lcdRunning = 0;
+            lcdHalTimerStop();
+            return;
+        }
+    }
+
+    now = lcdHalCycles();
+    if (lcdHalSpiBusy())
+    {
+        if ((int32_t)(now - lcdBurstDone) > (int32_t)lcdBurstCycles)
+        {
+            printf("SPI not done!\n");
+            ++lcdStats.aborts;
+            lcdDropStaged();    // End frame, this one is probably borked anyway.
+            lcdHalTimerArm(now + lcdBurstCycles);
+            return;
+        }
+        ++lcdStats.spiWaits;    // woke a little early, lcdSpiSend() spins for the rest
+    }
+    else if ((int32_t)(now - lcdBurstDone) > (int32_t)lcdLateCycles)
+    {
+        ++lcdStats.spiUnderruns;
+    }
+    if (lcdStagedReset)
+    {
+        lcdHalPinSet(LCD_RST);
+        lcdStagedReset = 0;
+    }
+    bits = lcdSpiBits();
+#ifdef LCD_3WIRE
+    lcdSpiSend(0);
+#else
+    lcdSpiSend(lcdStagedCmd);
+    lcdStagedCmd = 0;
 #endif
-    GConf.GPIO_Pin_high = 0;
-    GConf.GPIO_Mode = GPIO_Mode_Output;
-    GConf.GPIO_Pullup = GPIO_PullUp_DIS;
-    GConf.GPIO_Pulldown = GPIO_PullDown_DIS;
-    GConf.GPIO_IntrType = GPIO_PIN_INTR_DISABLE;
-    gpio_config(&GConf);
-
-    // SPI clk = 13.3MHz (80 / 6)
-    WRITE_PERI_REG(SPI_CLOCK(SPIDEV), (0 << SPI_CLKDIV_PRE_S) | (5 << SPI_CLKCNT_N_S) | (3 << SPI_CLKCNT_L_S) | (0 << SPI_CLKCNT_H_S));
-    WRITE_PERI_REG(SPI_CTRL(SPIDEV), 0);
-    WRITE_PERI_REG(SPI_USER(SPIDEV), SPI_CS_SETUP | SPI_CS_HOLD | SPI_USR_MOSI | SPI_WR_BYTE_ORDER);
-    WRITE_PERI_REG(SPI_USER1(SPIDEV), (9 << SPI_USR_MOSI_BITLEN_S));
-
-    // Route SPI to pins
-    // LCD_CS  VSPICS0 19
-    // LCD_CLK VSPICLK 20
-    // LCD_SDI VSPID   21
-    WRITE_PERI_REG(GPIO_ENABLE, 0xfffffff);
-    SET_PERI_REG_BITS(GPIO_FUNC_OUT_SEL4, GPIO_GPIO_FUNC19_OUT_SEL, VSPICS0_OUT_IDX, GPIO_GPIO_FUNC19_OUT_SEL_S);
-    SET_PERI_REG_BITS(PERIPHS_IO_MUX_GPIO19_U, MCU_SEL, 0, MCU_SEL_S);
-    SET_PERI_REG_BITS(GPIO_FUNC_OUT_SEL5, GPIO_GPIO_FUNC20_OUT_SEL, VSPICLK_OUT_MUX_IDX, GPIO_GPIO_FUNC20_OUT_SEL_S);
-    SET_PERI_REG_BITS(PERIPHS_IO_MUX_GPIO20_U, MCU_SEL, 0, MCU_SEL_S);
-    SET_PERI_REG_BITS(GPIO_FUNC_OUT_SEL5, GPIO_GPIO_FUNC21_OUT_SEL, VSPID_OUT_IDX, GPIO_GPIO_FUNC21_OUT_SEL_S);
-    SET_PERI_REG_BITS(PERIPHS_IO_MUX_GPIO21_U, MCU_SEL, 0, MCU_SEL_S);
+    lcdBurstDone = lcdHalCycles() + lcdWireCycles(bits) + lcdStagedDelay;
+    lcdStagedDelay = 0;
+
+    lcdFillBurst();
+
+#ifdef TIMING_DEBUG
+    lcdHalPinClear(LCD_TEST);
+#endif
+
+    lcdHalTimerArm(lcdBurstDone);
+    lcdStats.pumpCycles += lcdHalCycles() - entry;
+}
+
+
+void lcdPumpPixels()
+{
+    lcdTaskWoken = pdFALSE;
+    lcdPump();
+    portEND_SWITCHING_ISR(lcdTaskWoken);
+}
+
+
+// Start the pump if it is idle or only waiting for a timed frame. Called
+// inside a critical section.
+static void lcdKick()
+{
+    if (lcdRunning && !lcdWaiting)
+        return;
+    lcdRunning = 1;
+    lcdBurstDone = lcdHalCycles();
+    lcdPump();
+}
+
+
+void lcdQueueCommands(const struct lcdCmd *cmds, int count, void (*done)(void *arg), void *arg)
+{
+    struct lcdCmdList *list;
+
+    if (count < 1)
+    {
+        if (done)
+            done(arg);
+        return;
+    }
+    for (;;)
+    {
+        taskENTER_CRITICAL();
+        if ((lcdCmdTail + 1) % LCD_CMD_QUEUE != lcdCmdHead)
+            break;
+        taskEXIT_CRITICAL();
+        xSemaphoreTake(lcdSignal, portMAX_DELAY);
+    }
+    list = &lcdCmdQueue[lcdCmdTail];
+    list->cmds = cmds;
+    list->count = count;
+    list->done = done;
+    list->arg = arg;
+    lcdCmdTail = (lcdCmdTail + 1) % LCD_CMD_QUEUE;
+    lcdKick();
+    taskEXIT_CRITICAL();
+}
+
+
+static int lcdIsTimed(int i)
+{
+    int k;
+
+    for (k = 0; k < lcdTimedCount; ++k)
+    {
+        if (lcdTimed[k] == i)
+            return 1;
+    }
+    return 0;
+}
+
+
+uint8 *lcdGetBuffer(int partial)
+{
+    int i;
+
+    for (;;)
+    {
+        taskENTER_CRITICAL();
+        for (i = 0; i < lcdFrameBufferCount; ++i)
+        {
+            if (i != lcdFront && i != lcdPending && !lcdIsTimed(i))
+                break;
+        }
+        if (i < lcdFrameBufferCount)
+            break;
+        // Ring is full. A full frame about to be received replaces the waiting
+        // one, anything less has to wait for the pump to take it. Frames held
+        // for their presentation time are never replaced.
+        if (!partial && lcdPending >= 0 && lcdIsFullFrame(lcdRects[lcdPending], lcdRectCount[lcdPending]))
+        {
+            i = lcdPending;
+            lcdPending = -1;
+            ++lcdStats.dropped;
+            lcdRetireFrame(i);
+            break;
+        }
+        taskEXIT_CRITICAL();
+        xSemaphoreTake(lcdSignal, portMAX_DELAY);
+    }
+    lcdBack = i;
+    taskEXIT_CRITICAL();
+
+    return lcdFrameBuffers[i];
+}
+
+
+static void lcdSubmit(int format, const struct lcdRect *rects, int count, void (*done)(void *arg), void *arg)
+{
+    int full;
+    int timed;
+
+    if (lcdBack < 0 || count < 1 || count > LCD_MAX_RECTS)
+    {
+        printf("LCD no frame to write.\n");
+        return;
+    }
+    lcdFrameDone[lcdBack] = done;
+    lcdFrameDoneArg[lcdBack] = arg;
+    full = lcdIsFullFrame(rects, count);
+    lcdFormat[lcdBack] = format;
+    lcdRowHashed[lcdBack] = full;
+    if (full)
+        lcdHashRows(lcdBack);
+
+    memcpy(lcdRects[lcdBack], rects, count * sizeof(struct lcdRect));
+    lcdRectCount[lcdBack] = count;
+
+    timed = lcdPresent;
+    lcdPresent = 0;
+    if (timed && full && (int32_t)(lcdHalCycles() - lcdPresentDue) > (int32_t)lcdPresentLate)
+    {
+        // Done too late to be worth showing, the frame after is due already
+        taskENTER_CRITICAL();
+        ++lcdStats.lateDrops;
+        lcdRetireFrame(lcdBack);
+        lcdBack = -1;
+        taskEXIT_CRITICAL();
+        return;
+    }
+
+    taskENTER_CRITICAL();
+    if (timed || lcdTimedCount)
+    {
+        lcdDue[lcdBack] = timed ? lcdPresentDue : lcdHalCycles();
+        lcdDueSet[lcdBack] = timed;
+        lcdTimed[lcdTimedCount++] = lcdBack;
+        lcdBack = -1;
+        ++lcdStats.submitted;
+        if (timed)
+            ++lcdStats.timed;
+        lcdKick();
+        taskEXIT_CRITICAL();
+        return;
+    }
+    taskEXIT_CRITICAL();
+
+    for (;;)
+    {
+        taskENTER_CRITICAL();
+        // Only a full frame may replace a waiting one, partial updates never get lost
+        if (lcdPending < 0 || full)
+            break;
+        taskEXIT_CRITICAL();
+        xSemaphoreTake(lcdSignal, portMAX_DELAY);
+    }
+    if (lcdPending >= 0)
+    {
+        ++lcdStats.dropped;
+        lcdRetireFrame(lcdPending);
+    }
+    lcdPending = lcdBack;
+    lcdBack = -1;
+    ++lcdStats.submitted;
+    lcdKick();
+    taskEXIT_CRITICAL();
+}
+
+
+static const struct lcdRect lcdFullRect = { 0, 0, LCD_WIDTH, LCD_HEIGHT };
+
+
+void lcdWriteRects(const struct lcdRect *rects, int count)
+{
+    lcdSubmit(LCD_RGB565, rects, count, NULL, NULL);
+}
+
+
+void lcdWriteFrame()
+{
+    lcdSubmit(LCD_RGB565, &lcdFullRect, 1, NULL, NULL);
+}
+
+
+uint8 *lcdGetPalette()
+{
+    if (lcdBack < 0)
+        return NULL;
+    return (uint8 *)lcdPalettes[lcdBack];
+}
+
+
+void lcdWriteFrameFormat(int format)
+{
+    if (format != LCD_RGB565 && format != LCD_RGB444 && format != LCD_INDEXED(1) &&
+        format != LCD_INDEXED(2) && format != LCD_INDEXED(4) && format != LCD_INDEXED(8) &&
+        format != LCD_YUV420 && format != LCD_SCALED(1, 0) && format != LCD_SCALED(0, 1) &&
+        format != LCD_SCALED(1, 1) && format != LCD_BLOCKS)
+    {
+        printf("LCD unknown pixel format %d.\n", format);
+        return;
+    }
+    lcdSubmit(format, &lcdFullRect, 1, NULL, NULL);
+}
+
+
+void lcdWriteFrameAsync(uint8 *buffer, void (*done)(void *arg), void *arg)
+{
+    if (lcdBack < 0 || buffer != lcdFrameBuffers[lcdBack])
+    {
+        printf("LCD buffer %p was not from lcdGetBuffer().\n", buffer);
+        return;
+    }
+    lcdSubmit(LCD_RGB565, &lcdFullRect, 1, done, arg);
+}
+
+
+void lcdPresentIn(int ms, int late)
+{
+    lcdPresentDue = lcdHalCycles() + ms * (int32_t)lcdMsCycles;
+    lcdPresentLate = late * lcdMsCycles;
+    lcdPresent = 1;
+}
+
+
+void lcdPresentCancel()
+{
+    lcdPresent = 0;
+}
+
+
+int lcdWaitDone(int ticks)
+{
+    portTickType start = xTaskGetTickCount();
+    int done;
+
+    for (;;)
+    {
+        taskENTER_CRITICAL();
+        done = lcdFront < 0 && lcdPending < 0 && !lcdTimedCount;
+        taskEXIT_CRITICAL();
+        if (done || (portTickType)(xTaskGetTickCount() - start) >= (portTickType)ticks)
+            return done;
+        xSemaphoreTake(lcdSignal, ticks - (xTaskGetTickCount() - start));
+    }
+}
+
+
+void lcdGetStats(struct lcdStats *stats)
+{
+    taskENTER_CRITICAL();
+    *stats = lcdStats;
+    taskEXIT_CRITICAL();
+}
+
+
+static const struct lcdCmd lcdInitCmds[] =
+{
+    { LCD_CMD_DELAY, 0, 150 },  // Reset pulse
+    { LCD_CMD_RESET, 0, 10 },
+    { 0x11, 0, 10 },            // Sleep Out
+    { 0x3a, 1, 0,               // Interface Pixel Format
+        { 0x05 } },             // Control Interface 16 bit/pixel
+    { 0x26, 1, 0,               // Gamma Set
+        { 0x04 } },             // Gamma Curve 3
+    { 0xe0, 15, 0,              // Positive Gamma Correction Setting
+        { 0x3f, 0x25, 0x1c, 0x1e, 0x20, 0x12, 0x2a, 0x90,
+          0x24, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00 } },
+    { 0xe1, 15, 0,              // Positive Gamma Correction Setting
+        { 0x20, 0x20, 0x20, 0x20, 0x05, 0x00, 0x15, 0xa7,
+          0x3d, 0x18, 0x25, 0x2a, 0x2b, 0x2b, 0x3a } },
+    { 0xb1, 2, 0,               // Frame Rate Control
+        { 0x08, 0x08 } },
+    { 0xb4, 1, 0,               // Display Inversion Control
+        { 0x07 } },             // NLA, NLB, NLC
+    { 0xc0, 2, 0,               // Power Control 1
+        { 0x0a,                 // GVDD = 4.3
+          0x02 } },             // VCI1 = 2.7
+    { 0xc1, 1, 0,               // Power Control 1
+        { 0x02 } },
+    { 0xc5, 2, 0,               // VCOM Control 1
+        { 0x4f, 0x5a } },
+    { 0xc7, 1, 0,               // VCOM Offset Control
+        { 0x40 } },
+    { 0x2a, 4, 0,               // Column Address Set
+        { 0x00, 0x00,           // XStart = 0
+          0x00, 0x9f } },       // XEnd = 159
+    { 0x2b, 4, 0,               // Page Address Set
+        { 0x00, 0x00,           // YStart = 0
+          0x00, 0x7f } },       // YEnd = 127
+    { 0x36, 1, 0,               // Memory Access Control
+        { 0x60 } },             // MY, MX
+    { 0xb7, 1, 0,               // Source Driver Direction Control
+        { 0x00 } },             // GM[2:0] = 011, S7 -> S390
+    //  { 0xb8, 1, 0, { 0x01 } },
+    { 0x29, 0, 0 },             // Display on
+};
+
+
+void lcdInit(uint8 **buffers, int count)
+{
+    printf("LCD init\n");
+
+    if (count > LCD_FB_MAX)
+        count = LCD_FB_MAX;
+    for (int i = 0; i < count; ++i)
+    {
+        lcdFrameBuffers[i] = buffers[i];
+        memset(lcdFrameBuffers[i], 0, LCD_FRAME_LEN);
+    }
+    lcdFrameBufferCount = count;
+    lcdBack = 0;    // so a first lcdWriteFrame() shows a cleared screen
+    vSemaphoreCreateBinary(lcdSignal);
+    xSemaphoreTake(lcdSignal, 0);
+
+    lcdHalInit();
+    lcdBitCycles16 = lcdHalSpiBitCycles16();
+    lcdMsCycles = lcdHalMsCycles();
+    lcdBurstCycles = lcdWireCycles(LCD_SPI_WORDS * 32);
+    lcdLateCycles = lcdWireCycles(64);
+    printf("LCD SPI burst %d cycles\n", lcdBurstCycles);
 
     lcdSpiWrite(0); // dummy
     lcdSpiSend(0);
 
-    // Reset
-    vTaskDelay(1);
-    GPIO_REG_WRITE(GPIO_OUT_W1TC, (1 << LCD_RST));
-    vTaskDelay(15);
-    GPIO_REG_WRITE(GPIO_OUT_W1TS, (1 << LCD_RST));
-    vTaskDelay(1);
-
-    SPI_WriteCMD(0x11);     // Sleep Out
-    vTaskDelay(1);
-
-    SPI_WriteCMD(0x3a);     // Interface Pixel Format
-    SPI_WriteDAT(0x05);     // Control Interface 16 bit/pixel
-
-    SPI_WriteCMD(0x26);     // Gamma Set
-    SPI_WriteDAT(0x04);     // Gamma Curve 3
-
-    SPI_WriteCMD(0xe0);     // Positive Gamma Correction Setting
-    SPI_WriteDAT(0x3f);
-    SPI_WriteDAT(0x25);
-    SPI_WriteDAT(0x1c);
-    SPI_WriteDAT(0x1e);
-    SPI_WriteDAT(0x20);
-    SPI_WriteDAT(0x12);
-    SPI_WriteDAT(0x2a);
-    SPI_WriteDAT(0x90);
-    SPI_WriteDAT(0x24);
-    SPI_WriteDAT(0x11);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);
-
-    SPI_WriteCMD(0xe1);     // Positive Gamma Correction Setting
-    SPI_WriteDAT(0x20);
-    SPI_WriteDAT(0x20);
-    SPI_WriteDAT(0x20);
-    SPI_WriteDAT(0x20);
-    SPI_WriteDAT(0x05);
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x15);
-    SPI_WriteDAT(0xa7);
-    SPI_WriteDAT(0x3d);
-    SPI_WriteDAT(0x18);
-    SPI_WriteDAT(0x25);
-    SPI_WriteDAT(0x2a);
-    SPI_WriteDAT(0x2b);
-    SPI_WriteDAT(0x2b);
-    SPI_WriteDAT(0x3a);
-
-    SPI_WriteCMD(0xb1);    // Frame Rate Control
-    SPI_WriteDAT(0x08); 
-    SPI_WriteDAT(0x08);
-
-    SPI_WriteCMD(0xb4);    // Display Inversion Control 
-    SPI_WriteDAT(0x07);    // NLA, NLB, NLC
-
-    SPI_WriteCMD(0xc0);    // Power Control 1
-    SPI_WriteDAT(0x0a);    // GVDD = 4.3
-    SPI_WriteDAT(0x02);    // VCI1 = 2.7  
-
-    SPI_WriteCMD(0xc1);    // Power Control 1
-    SPI_WriteDAT(0x02);
-
-    SPI_WriteCMD(0xc5);    // VCOM Control 1 
-    SPI_WriteDAT(0x4f);
-    SPI_WriteDAT(0x5a);
-
-    SPI_WriteCMD(0xc7);    // VCOM Offset Control
-    SPI_WriteDAT(0x40);
-
-    SPI_WriteCMD(0x2a);    // Column Address Set 
-    SPI_WriteDAT(0x00);    // XStart = 0
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);    // XEnd = 159
-    SPI_WriteDAT(0x9f);
-
-    SPI_WriteCMD(0x2b);    // Page Address Set 
-    SPI_WriteDAT(0x00);    // YStart = 0
-    SPI_WriteDAT(0x00);
-    SPI_WriteDAT(0x00);    // YEnd = 127
-    SPI_WriteDAT(0x7f);
-    
-    SPI_WriteCMD(0x36);    // Memory Access Control
-    SPI_WriteDAT(0x60);    // MY, MX
-    
-    SPI_WriteCMD(0xb7);    // Source Driver Direction Control
-    SPI_WriteDAT(0x00);    // GM[2:0] = 011, S7 -> S390 
-    
-    //  SPI_WriteCMD(0xb8);
-    //  SPI_WriteDAT(0x01);
-
-    SPI_WriteCMD(0x29);    // Display on
-
-    //SPI_WriteCMD(0x2c);
-    //lcdSpiSend(0);
-
-    xt_set_interrupt_handler(XCHAL_TIMER_INTERRUPT(1), lcdPumpPixels, NULL);
-
-    lcdDone = 1;
+    // The pump sends the init sequence, reset and sleep-out delays included,
+    // while the caller carries on. Frames written meanwhile wait their turn.
+    lcdHalTimerHandler(lcdPumpPixels);
+    lcdHalPinClear(LCD_RST);
+    lcdQueueCommands(lcdInitCmds, sizeof(lcdInitCmds) / sizeof(lcdInitCmds[0]), NULL, NULL);
 }
-
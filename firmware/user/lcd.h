@@ -1,7 +1,105 @@
 #ifndef __LCD_H__
 #define __LCD_H__
 
-void lcdInit(uint8 *buffer);
+#define LCD_WIDTH 160
+#define LCD_HEIGHT 128
+#define LCD_FRAME_LEN (LCD_WIDTH * LCD_HEIGHT * 2)
+
+// Framebuffer pixel formats, the values are the panel's COLMOD settings
+#define LCD_RGB565 0x05     // 2 bytes per pixel, big-endian
+#define LCD_RGB444 0x03     // 3 bytes per 2 pixels: R0G0 B0R1 G1B1
+// 1, 2, 4 or 8 bit palette indices, first pixel in the high bits. Scanned out as RGB565.
+#define LCD_INDEXED(bits) (0x10 | (bits))
+#define LCD_IS_INDEXED(format) ((format) & 0x10)
+#define LCD_INDEX_BITS(format) ((format) & 0x0f)
+// Planar YUV 4:2:0: Y plane, then quarter size U and V planes. Scanned out as RGB565.
+#define LCD_YUV420 0x20
+// RGB565 at half width and/or half height, pixels and lines doubled on scan-out
+#define LCD_SCALED(x, y) (0x40 | (x) | ((y) << 1))
+#define LCD_IS_SCALED(format) ((format) & 0x40)
+#define LCD_SCALE_X(format) ((format) & 1)
+#define LCD_SCALE_Y(format) (((format) >> 1) & 1)
+// 4x4 blocks at 4 bits per pixel, row by row. Each block is two big-endian RGB565
+// colours, then a byte of 2-bit indices per pixel row, first pixel in the high bits.
+// Indices 2 and 3 pick the colours 1/3 and 2/3 of the way from the first to the
+// second. Scanned out as RGB565.
+#define LCD_BLOCKS 0x80
+#define LCD_BLOCK_BYTES 8
+// Framebuffer bytes per row, on average for YUV 4:2:0, line-doubled and block frames
+#define LCD_ROW_BYTES(format) (LCD_IS_INDEXED(format) ? LCD_WIDTH * LCD_INDEX_BITS(format) / 8 : \
+                               LCD_IS_SCALED(format) ? (LCD_WIDTH * 2 >> LCD_SCALE_X(format)) >> LCD_SCALE_Y(format) : \
+                               (format) == LCD_RGB444 || (format) == LCD_YUV420 ? LCD_WIDTH * 3 / 2 : \
+                               (format) == LCD_BLOCKS ? LCD_WIDTH / 4 * LCD_BLOCK_BYTES / 4 : \
+                               LCD_WIDTH * 2)
+#define LCD_PALETTE_MAX 256
+#define LCD_FB_MAX 3
+#define LCD_MAX_RECTS 16
+#define LCD_CMD_DATA_MAX 16
+#define LCD_CMD_DELAY 0x100     // no command, only the delay
+
+struct lcdRect
+{
+    uint8 x, y;
+    uint8 w, h;
+};
+
+// A panel command and its parameter bytes, followed by delay ms of quiet
+struct lcdCmd
+{
+    uint16 cmd;
+    uint8 len;
+    uint8 delay;
+    uint8 data[LCD_CMD_DATA_MAX];
+};
+
+struct lcdStats
+{
+    uint32 submitted;   // frames handed over by lcdWriteFrame()/lcdWriteRects()
+    uint32 shown;       // frames completely scanned out
+    uint32 dropped;     // frames replaced by a newer one before scan-out
+    uint32 repeated;    // scan-outs that ended with no new frame waiting
+    uint32 spiBytes;            // command and data bytes put on the wire
+    uint32 spiTransactions;     // SPI transactions started
+    uint32 frameBytes;          // spiBytes of the last completed frame
+    uint32 frameTransactions;   // spiTransactions of the last completed frame
+    uint32 spiWaits;            // pump woke before the previous burst was done
+    uint32 spiUnderruns;        // pump woke late and the wire sat idle
+    uint32 aborts;              // frames cut short because SPI never finished
+    uint32 pumpCycles;          // CPU cycles spent staging and sending bursts
+    uint32 pixelBytes;          // framebuffer bytes written for scan-out
+    uint32 skippedBytes;        // of those, rows left out as the panel already shows them
+    uint32 timed;               // frames held back for lcdPresentIn()
+    uint32 lateDrops;           // of those, dropped as they were done too late
+    uint32 presented;           // of those, scanned out
+    uint32 presentUs;           // total us from when those were due to their scan-out
+    uint32 presentMaxUs;        // the worst of those
+};
+
+// buffers hold LCD_FRAME_LEN bytes each and are 4-byte aligned
+void lcdInit(uint8 **buffers, int count);
+// Get a framebuffer to draw into. Pass partial if only some rectangles will be valid.
+uint8 *lcdGetBuffer(int partial);
+// Scan out the whole buffer from lcdGetBuffer()
 void lcdWriteFrame();
+// Palette of the buffer from lcdGetBuffer(), LCD_PALETTE_MAX big-endian RGB565 entries
+uint8 *lcdGetPalette();
+// Scan out the whole buffer from lcdGetBuffer(), holding pixels in format
+void lcdWriteFrameFormat(int format);
+// Scan out only the given rectangles of the buffer from lcdGetBuffer()
+void lcdWriteRects(const struct lcdRect *rects, int count);
+// Like lcdWriteFrame(), done(arg) runs once buffer is free again: from the pump
+// interrupt after scan-out, or from the writing task if a newer frame replaced it.
+void lcdWriteFrameAsync(uint8 *buffer, void (*done)(void *arg), void *arg);
+// Hold the next frame written back until ms from now. A full frame done more
+// than late ms after that is dropped instead, the frame after is due already.
+void lcdPresentIn(int ms, int late);
+// Forget lcdPresentIn() when no frame was written after all
+void lcdPresentCancel();
+// Block until every frame written so far is on the screen. Returns 0 on timeout.
+int lcdWaitDone(int ticks);
+// Have the pump send count commands between frames. cmds must stay valid until
+// done(arg), which is called from the pump interrupt. done may be NULL.
+void lcdQueueCommands(const struct lcdCmd *cmds, int count, void (*done)(void *arg), void *arg);
+void lcdGetStats(struct lcdStats *stats);
 
 #endif
@@ -0,0 +1,67 @@
+/*
+ * ESP31 glue for the LCD driver
+ */
+
+#include "esp_common.h"
+#include "gpio.h"
+#include "lcd_hal.h"
+
+
+void lcdHalInit()
+{
+    GPIO_ConfigTypeDef GConf;
+
+    // Config GPIO pins
+    GConf.GPIO_Pin = (1 << LCD_RST) | (1 << LCD_A0);
+#ifdef TIMING_DEBUG
+    GConf.GPIO_Pin |= (1 << LCD_TEST);
+#endif
+#ifdef FPS_COUNTER
+    GConf.GPIO_Pin |= (1 << LCD_FPS);
+#endif
+    GConf.GPIO_Pin_high = 0;
+    GConf.GPIO_Mode = GPIO_Mode_Output;
+    GConf.GPIO_Pullup = GPIO_PullUp_DIS;
+    GConf.GPIO_Pulldown = GPIO_PullDown_DIS;
+    GConf.GPIO_IntrType = GPIO_PIN_INTR_DISABLE;
+    gpio_config(&GConf);
+
+    // SPI clk = 13.3MHz (80 / 6)
+    WRITE_PERI_REG(SPI_CLOCK(SPIDEV), (0 << SPI_CLKDIV_PRE_S) | (5 << SPI_CLKCNT_N_S) | (3 << SPI_CLKCNT_L_S) | (0 << SPI_CLKCNT_H_S));
+    WRITE_PERI_REG(SPI_CTRL(SPIDEV), 0);
+    // Little-endian byte order, framebuffer words go to SPI_Wn as they are
+    WRITE_PERI_REG(SPI_USER(SPIDEV), SPI_CS_SETUP | SPI_CS_HOLD | SPI_USR_MOSI);
+    WRITE_PERI_REG(SPI_USER1(SPIDEV), (9 << SPI_USR_MOSI_BITLEN_S));
+
+    // Route SPI to pins
+    // LCD_CS  VSPICS0 19
+    // LCD_CLK VSPICLK 20
+    // LCD_SDI VSPID   21
+    WRITE_PERI_REG(GPIO_ENABLE, 0xfffffff);
+    SET_PERI_REG_BITS(GPIO_FUNC_OUT_SEL4, GPIO_GPIO_FUNC19_OUT_SEL, VSPICS0_OUT_IDX, GPIO_GPIO_FUNC19_OUT_SEL_S);
+    SET_PERI_REG_BITS(PERIPHS_IO_MUX_GPIO19_U, MCU_SEL, 0, MCU_SEL_S);
+    SET_PERI_REG_BITS(GPIO_FUNC_OUT_SEL5, GPIO_GPIO_FUNC20_OUT_SEL, VSPICLK_OUT_MUX_IDX, GPIO_GPIO_FUNC20_OUT_SEL_S);
+    SET_PERI_REG_BITS(PERIPHS_IO_MUX_GPIO20_U, MCU_SEL, 0, MCU_SEL_S);
+    SET_PERI_REG_BITS(GPIO_FUNC_OUT_SEL5, GPIO_GPIO_FUNC21_OUT_SEL, VSPID_OUT_IDX, GPIO_GPIO_FUNC21_OUT_SEL_S);
+    SET_PERI_REG_BITS(PERIPHS_IO_MUX_GPIO21_U, MCU_SEL, 0, MCU_SEL_S);
+}
+
+
+uint32 lcdHalSpiBitCycles16()
+{
+    uint32 clock = READ_PERI_REG(SPI_CLOCK(SPIDEV));
+    uint32 apbCycles = 1;   // SPI clock derives from the 80MHz APB clock
+
+    if (!(clock & SPI_CLK_EQU_SYSCLK))
+    {
+        apbCycles = (((clock >> SPI_CLKDIV_PRE_S) & SPI_CLKDIV_PRE) + 1) *
+                    (((clock >> SPI_CLKCNT_N_S) & SPI_CLKCNT_N) + 1);
+    }
+    return apbCycles * system_get_cpu_freq() * 16 / 80;
+}
+
+
+uint32 lcdHalMsCycles()
+{
+    return system_get_cpu_freq() * 1000;
+}
@@ -0,0 +1,101 @@
+#ifndef __LCD_HAL_H__
+#define __LCD_HAL_H__
+
+/*
+ * Everything lcd.c needs from the chip: the SPI master, the A0/reset pins
+ * and a CCOMPARE timer interrupt. lcd.c itself only talks to
+ * these helpers, so another target only has to provide this header and
+ * lcd_hal.c.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/xtensa_api.h"
+#include "esp_common.h"
+#include "gpio.h"
+#include "spi_register.h"
+
+// #define TIMING_DEBUG
+// #define LCD_3WIRE   // 9-bit SPI with the D/C bit in each word, panel IM pins strapped for 3-wire, A0 unused
+#define FPS_COUNTER
+
+#ifdef TIMING_DEBUG
+#define LCD_TEST 23
+#endif
+
+#ifdef FPS_COUNTER
+#define LCD_FPS 22
+#endif
+
+#define LCD_A0  17
+#define LCD_RST 18
+#define LCD_CS  19
+#define LCD_CLK 20
+#define LCD_SDI 21
+
+#define SPIDEV 3    // SPI Device 3
+
+#define LCD_SPI_WORDS 16    // SPI_W0 ~ SPI_W15
+
+// Configure pins and the SPI master
+void lcdHalInit();
+
+// CPU cycles per SPI bit for the configured clock, 12.4 fixed point
+uint32 lcdHalSpiBitCycles16();
+
+// CPU cycles per millisecond
+uint32 lcdHalMsCycles();
+
+static inline int lcdHalSpiBusy()
+{
+    return READ_PERI_REG(SPI_CMD(SPIDEV)) & SPI_USR;
+}
+
+static inline void lcdHalSpiWord(int index, uint32 word)
+{
+    WRITE_PERI_REG(SPI_W0(SPIDEV) + (index * 4), word);
+}
+
+// Clock out the first bits of SPI_W0 ~ SPI_W15
+static inline void lcdHalSpiStart(int bits)
+{
+    WRITE_PERI_REG(SPI_USER1(SPIDEV), ((bits - 1) << SPI_USR_MOSI_BITLEN_S));
+    WRITE_PERI_REG(SPI_CMD(SPIDEV), SPI_USR);
+}
+
+static inline void lcdHalPinSet(int pin)
+{
+    GPIO_REG_WRITE(GPIO_OUT_W1TS, (1 << pin));
+}
+
+static inline void lcdHalPinClear(int pin)
+{
+    GPIO_REG_WRITE(GPIO_OUT_W1TC, (1 << pin));
+}
+
+static inline uint32 lcdHalCycles()
+{
+    return xthal_get_ccount();
+}
+
+// Fire the pump interrupt once the cycle counter reaches at
+static inline void lcdHalTimerArm(uint32 at)
+{
+    xthal_set_ccompare(1, at);
+    xt_ints_on(1 << XCHAL_TIMER_INTERRUPT(1));
+}
+
+static inline void lcdHalTimerStop()
+{
+    // ack int
+    xthal_set_ccompare(1, xthal_get_ccount() - 1);
+    // disable int
+    xt_ints_off(1 << XCHAL_TIMER_INTERRUPT(1));
+}
+
+static inline void lcdHalTimerHandler(void (*handler)())
+{
+    xt_set_interrupt_handler(XCHAL_TIMER_INTERRUPT(1), handler, NULL);
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Presentation times for FRAME_TIMED, see pace.h
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_common.h"
+#include "pace.h"
+
+static int paceSynced = 0;
+static uint32 paceOffset;       // local ms minus sender ms of the quickest frame
+static uint16 paceSeq;
+static uint32 pacePts;
+static uint32 paceInterval;     // sender ms between the last two frames
+static int paceCreep;
+
+static struct paceStats paceStats;
+
+
+void paceReset()
+{
+    paceSynced = 0;
+}
+
+
+int paceDelay(uint16 seq, uint32 pts, int *late)
+{
+    uint32 now = system_get_time() / 1000;
+    uint32 transit = now - pts;
+    sint32 wait = 0;
+
+    ++paceStats.frames;
+    if (paceSynced)
+    {
+        if ((uint16)(seq - paceSeq) > 1 && (uint16)(seq - paceSeq) < 0x8000)
+            paceStats.missing += (uint16)(seq - paceSeq) - 1;
+        if (pts != pacePts && pts - pacePts < PACE_RESYNC_MS)
+            paceInterval = pts - pacePts;
+        if ((sint32)(transit - paceOffset) < 0)
+        {
+            paceOffset = transit;   // a quicker trip than any so far
+        }
+        else if (++paceCreep == PACE_CREEP)
+        {
+            ++paceOffset;
+            paceCreep = 0;
+        }
+        wait = pts + paceOffset + PACE_DELAY_MS - now;
+        if (wait < -PACE_RESYNC_MS || wait > PACE_DELAY_MS + PACE_RESYNC_MS)
+            paceSynced = 0;
+    }
+    if (!paceSynced)
+    {
+        // Sender restarted, the stream was paused or the clocks wandered off
+        paceSynced = 1;
+        paceOffset = transit;
+        paceInterval = PACE_DELAY_MS;
+        paceCreep = 0;
+        wait = PACE_DELAY_MS;
+        ++paceStats.resyncs;
+    }
+    if (transit - paceOffset > paceStats.jitterMs && transit - paceOffset < PACE_RESYNC_MS)
+        paceStats.jitterMs = transit - paceOffset;
+    paceSeq = seq;
+    pacePts = pts;
+
+    *late = paceInterval;
+    return wait;
+}
+
+
+void paceGetStats(struct paceStats *stats)
+{
+    *stats = paceStats;
+}
@@ -0,0 +1,31 @@
+#ifndef __PACE_H__
+#define __PACE_H__
+
+/*
+ * Presentation times for FRAME_TIMED. The sender's clock is mapped onto
+ * the local one by the quickest trip any frame has made, and every frame
+ * is shown PACE_DELAY_MS after that. Frames that take longer than the
+ * quickest one by less than PACE_DELAY_MS still make their time, so
+ * network jitter up to that much never reaches the panel.
+ */
+#define PACE_DELAY_MS 100       // jitter absorbed, and latency added
+#define PACE_RESYNC_MS 1000     // a frame this far out of line starts the mapping over
+#define PACE_CREEP 16           // frames per ms the mapping drifts later, to follow a slow local clock
+
+struct paceStats
+{
+    uint32 frames;      // timed frames received
+    uint32 missing;     // sequence numbers skipped
+    uint32 resyncs;     // times the clocks were mapped afresh
+    uint32 jitterMs;    // the longest a frame took over the quickest one
+};
+
+// Start over, for a new connection
+void paceReset();
+// ms from now the frame with this sequence number and sender timestamp in
+// ms should be shown, and in late how many ms after that it is not worth
+// showing any more
+int paceDelay(uint16 seq, uint32 pts, int *late);
+void paceGetStats(struct paceStats *stats);
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * Lossless QOI-style frames, see qoi.h
+ *
+ * One pass from the payload into the framebuffer. Working memory is the
+ * colour table and a small input buffer.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_common.h"
+#include "lcd.h"
+#include "frame.h"
+#include "qoi.h"
+
+#pragma GCC optimize ("O2")
+
+static struct frameStream qoiStream;
+
+
+// Next code byte, -1 at the end or if reading failed
+static inline int qoiByte()
+{
+    return frameStreamByte(&qoiStream);
+}
+
+
+int qoiDecode(frameReadFn read, void *ctx, size_t length, uint8 *buffer)
+{
+    uint16 index[64];
+    uint8 *out = buffer;
+    uint8 *end = buffer + LCD_FRAME_LEN;
+    int r = 0, g = 0, b = 0;
+    int op, run, arg, dg;
+
+    frameStreamInit(&qoiStream, read, ctx, length);
+    memset(index, 0, sizeof(index));
+
+    while (out < end && (op = qoiByte()) >= 0)
+    {
+        uint16 pixel;
+
+        run = 1;
+        arg = 0;
+        if (op == QOI_OP_RGB565 || op == QOI_OP_LONG_RUN)
+        {
+            arg = qoiByte() << 8;
+            arg |= qoiByte();
+            if (arg < 0)
+                break;
+            if (op == QOI_OP_LONG_RUN)
+                run = arg;
+            else
+            {
+                r = arg >> 11;
+                g = (arg >> 5) & 63;
+                b = arg & 31;
+            }
+        }
+        else
+        {
+            switch (op & 0xc0)
+            {
+            case QOI_OP_INDEX:
+                pixel = index[op];
+                r = pixel >> 11;
+                g = (pixel >> 5) & 63;
+                b = pixel & 31;
+                break;
+            case QOI_OP_DIFF:
+                r = (r + ((op >> 4) & 3) - 2) & 31;
+                g = (g + ((op >> 2) & 3) - 2) & 63;
+                b = (b + (op & 3) - 2) & 31;
+                break;
+            case QOI_OP_LUMA:
+                if ((arg = qoiByte()) < 0)
+                    break;
+                dg = (op & 63) - 32;
+                r = (r + (dg >> 1) + (arg >> 4) - 8) & 31;
+                g = (g + dg) & 63;
+                b = (b + (dg >> 1) + (arg & 15) - 8) & 31;
+                break;
+            case QOI_OP_RUN:
+                run = (op & 63) + 1;
+                break;
+            }
+            if (arg < 0)
+                break;
+        }
+
+        pixel = (r << 11) | (g << 5) | b;
+        index[QOI_HASH(r, g, b)] = pixel;
+        if (run < 1 || run > (end - out) / 2)
+            return QOI_BAD;
+        while (run--)
+        {
+            out[0] = pixel >> 8;
+            out[1] = pixel;
+            out += 2;
+        }
+    }
+
+    if (qoiStream.failed)
+        return QOI_READ_FAILED;
+    // Every code used up on exactly one frame of pixels
+    if (out != end || qoiStream.pos != qoiStream.len || qoiStream.remain)
+        return QOI_BAD;
+    return QOI_OK;
+}
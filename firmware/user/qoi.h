@@ -0,0 +1,29 @@
+#ifndef __QOI_H__
+#define __QOI_H__
+
+#include "frame.h"
+
+/*
+ * Lossless full frames after QOI, on RGB565 instead of RGBA. Pixels are
+ * coded against the previous one, starting from black, and against a
+ * table of 64 recently seen colours indexed by QOI_HASH(). Channel
+ * differences wrap around within the channel.
+ */
+#define QOI_OP_INDEX 0x00       // 00iiiiii: colour from the table
+#define QOI_OP_DIFF 0x40        // 01rrggbb: each channel moves by -2..1, stored + 2
+#define QOI_OP_LUMA 0x80        // 10gggggg rrrrbbbb: green moves by -32..31, stored + 32,
+                                // red and blue by green / 2 (rounded down) plus -8..7, stored + 8
+#define QOI_OP_RUN 0xc0         // 11nnnnnn: previous pixel 1..62 more times, stored - 1
+#define QOI_OP_RGB565 0xfe      // then the pixel, big-endian
+#define QOI_OP_LONG_RUN 0xff    // then a big-endian count of previous pixels, at least 1
+
+#define QOI_HASH(r, g, b) (((r) * 3 + (g) * 5 + (b) * 7) & 63)
+
+#define QOI_OK 0
+#define QOI_BAD 1               // codes ran past the frame or stopped short of it
+#define QOI_READ_FAILED 2       // read() failed, the connection is gone
+
+// Decode length bytes of codes into an RGB565 framebuffer in one pass
+int qoiDecode(frameReadFn read, void *ctx, size_t length, uint8 *buffer);
+
+#endif
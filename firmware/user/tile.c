@@ -0,0 +1,172 @@
+/*
+ * Tile cache for FRAME_TILES, see tile.h
+ *
+ * The slots form a doubly linked list from least to most recently used,
+ * so a hit or an insert is a constant time unlink and append.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "esp_common.h"
+#include "lcd.h"
+#include "frame.h"
+#include "tile.h"
+
+#define TILE_NONE 0xff
+
+static uint8 tiles[TILE_SLOTS][TILE_BYTES];
+static uint8 tileFilled[TILE_SLOTS];
+static uint8 tilePrev[TILE_SLOTS];
+static uint8 tileNext[TILE_SLOTS];
+static uint8 tileOldest = TILE_NONE;
+static uint8 tileNewest = TILE_NONE;
+
+static struct tileStats tileStats;
+static struct frameStream tileStream;
+
+
+static void tileUnlink(int slot)
+{
+    if (tilePrev[slot] != TILE_NONE)
+        tileNext[tilePrev[slot]] = tileNext[slot];
+    else
+        tileOldest = tileNext[slot];
+    if (tileNext[slot] != TILE_NONE)
+        tilePrev[tileNext[slot]] = tilePrev[slot];
+    else
+        tileNewest = tilePrev[slot];
+}
+
+
+static void tileAppend(int slot)
+{
+    tilePrev[slot] = tileNewest;
+    tileNext[slot] = TILE_NONE;
+    if (tileNewest != TILE_NONE)
+        tileNext[tileNewest] = slot;
+    else
+        tileOldest = slot;
+    tileNewest = slot;
+}
+
+
+static void tileTouch(int slot)
+{
+    if (slot != tileNewest)
+    {
+        tileUnlink(slot);
+        tileAppend(slot);
+    }
+}
+
+
+void tileReset()
+{
+    int i;
+
+    tileOldest = tileNewest = TILE_NONE;
+    for (i = 0; i < TILE_SLOTS; ++i)
+        tileAppend(i);
+    memset(tileFilled, 0, sizeof(tileFilled));
+    tileStats.used = 0;
+}
+
+
+static void tileDraw(uint8 *buffer, int cell, const uint8 *tile)
+{
+    uint8 *out = buffer + ((cell / (LCD_WIDTH / TILE_SIZE)) * LCD_WIDTH * TILE_SIZE +
+                           (cell % (LCD_WIDTH / TILE_SIZE)) * TILE_SIZE) * 2;
+    int y;
+
+    for (y = 0; y < TILE_SIZE; ++y, out += LCD_WIDTH * 2, tile += TILE_SIZE * 2)
+        memcpy(out, tile, TILE_SIZE * 2);
+}
+
+
+int tileDecode(frameReadFn read, void *ctx, size_t length, uint8 *buffer)
+{
+    static uint8 fill[TILE_BYTES];
+    const uint8 *last = NULL;
+    int cells = (LCD_WIDTH / TILE_SIZE) * (LCD_HEIGHT / TILE_SIZE);
+    int cell, code, slot, n, i;
+
+    if (tileOldest == TILE_NONE)
+        tileReset();
+    frameStreamInit(&tileStream, read, ctx, length);
+    for (cell = 0; cell < cells; )
+    {
+        if ((code = frameStreamByte(&tileStream)) < 0)
+            break;
+        if (code < TILE_SLOTS)
+        {
+            if (!tileFilled[code])
+                return TILE_BAD;
+            tileTouch(code);
+            last = tiles[code];
+            ++tileStats.hits;
+        }
+        else if (code == TILE_NEW)
+        {
+            slot = tileOldest;
+            for (i = 0; i < TILE_BYTES; ++i)
+            {
+                if ((n = frameStreamByte(&tileStream)) < 0)
+                    break;
+                tiles[slot][i] = n;
+            }
+            if (n < 0)
+                break;
+            if (tileFilled[slot])
+                ++tileStats.evictions;
+            else
+                ++tileStats.used;
+            tileFilled[slot] = 1;
+            tileTouch(slot);
+            last = tiles[slot];
+            ++tileStats.misses;
+        }
+        else if (code == TILE_FILL)
+        {
+            int hi = frameStreamByte(&tileStream);
+            int lo = frameStreamByte(&tileStream);
+
+            if (lo < 0)
+                break;
+            for (i = 0; i < TILE_BYTES; i += 2)
+            {
+                fill[i] = hi;
+                fill[i + 1] = lo;
+            }
+            last = fill;
+            ++tileStats.fills;
+        }
+        else if (code == TILE_REPEAT)
+        {
+            if ((n = frameStreamByte(&tileStream)) < 0)
+                break;
+            if (!last || cell + n + 1 > cells)
+                return TILE_BAD;
+            for (; n >= 0; --n)
+                tileDraw(buffer, cell++, last);
+            continue;
+        }
+        else
+        {
+            return TILE_BAD;
+        }
+        tileDraw(buffer, cell++, last);
+    }
+
+    if (tileStream.failed)
+        return TILE_READ_FAILED;
+    // Every tile drawn and every code used up
+    if (cell != cells || tileStream.pos != tileStream.len || tileStream.remain)
+        return TILE_BAD;
+    return TILE_OK;
+}
+
+
+void tileGetStats(struct tileStats *stats)
+{
+    *stats = tileStats;
+    stats->memory = sizeof(tiles) + sizeof(tileFilled) + sizeof(tilePrev) + sizeof(tileNext);
+}
@@ -0,0 +1,43 @@
+#ifndef __TILE_H__
+#define __TILE_H__
+
+#include "frame.h"
+
+/*
+ * Cache of 8x8 RGB565 tiles for FRAME_TILES. Slots are kept in least
+ * recently used order, starting out as 0 to TILE_SLOTS - 1. Showing a
+ * cached or new tile makes its slot the most recently used, a new tile
+ * goes into the least recently used slot. The sender keeps the same order
+ * to know which slot each tile went to.
+ */
+#define TILE_SIZE 8
+#define TILE_BYTES (TILE_SIZE * TILE_SIZE * 2)
+#define TILE_SLOTS 128
+
+// Codes of a FRAME_TILES frame, one per tile row by row. Codes below
+// TILE_SLOTS show the tile cached in that slot.
+#define TILE_NEW 0x80       // then TILE_BYTES of RGB565, row by row
+#define TILE_FILL 0x81      // then one big-endian RGB565 colour for the whole tile, not cached
+#define TILE_REPEAT 0x82    // then n: the tile before n + 1 more times, slot order unchanged
+
+#define TILE_OK 0
+#define TILE_BAD 1          // codes ran past the frame or named an empty slot
+#define TILE_READ_FAILED 2  // read() failed, the connection is gone
+
+struct tileStats
+{
+    uint32 hits;        // tiles shown from the cache
+    uint32 misses;      // new tiles received
+    uint32 evictions;   // of those, ones that replaced a cached tile
+    uint32 fills;       // single colour tiles
+    uint32 used;        // slots holding a tile
+    uint32 memory;      // bytes of cache
+};
+
+// Empty the cache, the sender has to start over
+void tileReset();
+// Draw length bytes of tile codes into an RGB565 framebuffer
+int tileDecode(frameReadFn read, void *ctx, size_t length, uint8 *buffer);
+void tileGetStats(struct tileStats *stats);
+
+#endif
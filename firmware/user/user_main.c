@@ -8,6 +8,11 @@
 #include "esp_common.h"
 
 #include "lcd.h"
+#include "frame.h"
+#include "jpeg.h"
+#include "tile.h"
+#include "clip.h"
+#include "pace.h"
 
 #include "websocket.h"
 
@@ -81,11 +86,12 @@ static void wifi_task(void *pvParameters)
 
 
 
-#define LCD_BUF_LEN (128 * 160 * 2)
-#define WS_BUF_LEN (LCD_BUF_LEN + 128)
+#define WS_BUF_LEN 2048     // Handshake and control frames only, binary frames are decoded as they arrive
 
-uint8 *lcdBuffer = (uint8*)0x3ffa8000;
-uint8 *wsBuffer = (uint8*)0x3ffb2000;
+// Framebuffer ring, add a third region here for triple buffering
+#define LCD_FB_COUNT 2
+uint8 *lcdBuffers[LCD_FB_COUNT] = { (uint8*)0x3ffa8000, (uint8*)0x3ffb2000 };
+static uint8 wsBuffer[WS_BUF_LEN];
 
 
 // #define PACKET_DUMP
@@ -116,9 +122,129 @@ int safeSend(int clientSocket, const uint8_t *buffer, size_t bufferSize)
 }
 
 
+int safeRecv(int clientSocket, uint8_t *buffer, size_t bufferSize)
+{
+    while (bufferSize)
+    {
+        ssize_t readed = recv(clientSocket, buffer, bufferSize, 0);
+        if (readed <= 0)
+        {
+            printf("recv failed\n");
+            return EXIT_FAILURE;
+        }
+#ifdef PACKET_DUMP
+        printf("in packet:\n");
+        fwrite(buffer, 1, readed, stdout);
+        printf("\n");
+#endif
+        buffer += readed;
+        bufferSize -= readed;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+struct payloadReader
+{
+    int socket;
+    struct wsParser *parser;
+};
+
+
+// frameReadFn over the payload of the current frame, unmasking as it arrives
+static int readPayload(void *ctx, uint8 *buffer, size_t length)
+{
+    struct payloadReader *reader = ctx;
+
+    if (length > reader->parser->payloadLength - reader->parser->unmaskedLength)
+    {
+        printf("read past end of frame\n");
+        return EXIT_FAILURE;
+    }
+    while (length)
+    {
+        ssize_t readed = recv(reader->socket, buffer, length, 0);
+        if (readed <= 0)
+        {
+            printf("recv failed\n");
+            return EXIT_FAILURE;
+        }
+        wsParserUnmask(reader->parser, buffer, readed);
+        buffer += readed;
+        length -= readed;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+// Skip whatever is left of the current frame's payload
+static int drainPayload(struct payloadReader *reader)
+{
+    size_t remain;
+
+    while ((remain = reader->parser->payloadLength - reader->parser->unmaskedLength) > 0)
+    {
+        if (readPayload(reader, wsBuffer, (remain < WS_BUF_LEN) ? remain : WS_BUF_LEN) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/*
+ * Receive one frame, header first. Knowing the payload size up front lets
+ * binary frames be decoded as they arrive, straight into a framebuffer, so
+ * only handshake and control traffic ever goes through wsBuffer.
+ * frameType is WS_INCOMPLETE_FRAME if a control payload did not fit; it
+ * has been drained so the stream stays in sync.
+ */
+static int recvFrame(int clientSocket, enum wsFrameType *frameType, uint8_t **dataPtr, size_t *dataLength)
+{
+    struct wsParser parser;
+    struct payloadReader reader = { clientSocket, &parser };
+    uint8_t header[14];
+    size_t headerLength = 0;
+
+    wsParserInit(&parser);
+    do
+    {
+        if (safeRecv(clientSocket, header + headerLength, parser.headerLength - headerLength) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        headerLength = parser.headerLength;
+        *frameType = wsParseFrameHeader(&parser, header, headerLength);
+    } while (*frameType == WS_INCOMPLETE_FRAME);
+
+    if (*frameType == WS_ERROR_FRAME)
+        return EXIT_SUCCESS;
+
+    if (*frameType == WS_BINARY_FRAME)
+    {
+        if (frameDisplay(readPayload, &reader, parser.payloadLength) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        *dataPtr = NULL;
+    }
+    else if (parser.payloadLength <= WS_BUF_LEN)
+    {
+        if (readPayload(&reader, wsBuffer, parser.payloadLength) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        *dataPtr = wsBuffer;
+    }
+    else
+    {
+        *frameType = WS_INCOMPLETE_FRAME;
+    }
+    *dataLength = parser.payloadLength;
+
+    return drainPayload(&reader);
+}
+
+
 void clientWorker(int clientSocket)
 {
-    memset(wsBuffer, 0, WS_BUF_LEN);
+    memset(wsBuffer, 0, WS_BUF_LEN);    // handshake parsing relies on a NUL after the request
     size_t readedLength = 0;
     size_t frameSize = WS_BUF_LEN;
     enum wsState state = WS_STATE_OPENING;
@@ -127,36 +253,39 @@ void clientWorker(int clientSocket)
     enum wsFrameType frameType = WS_INCOMPLETE_FRAME;
     struct handshake hs;
     nullHandshake(&hs);
+    frameReset();
 
-    #define prepareBuffer frameSize = WS_BUF_LEN; memset(wsBuffer, 0, WS_BUF_LEN);
-    #define initNewFrame frameType = WS_INCOMPLETE_FRAME; readedLength = 0; memset(wsBuffer, 0, WS_BUF_LEN);
+    #define prepareBuffer frameSize = WS_BUF_LEN;
+    #define initNewFrame frameType = WS_INCOMPLETE_FRAME; readedLength = 0;
 
     while (frameType == WS_INCOMPLETE_FRAME)
     {
-        ssize_t readed = recv(clientSocket, wsBuffer + readedLength, WS_BUF_LEN - readedLength, 0);
-        if (!readed)
+        if (state == WS_STATE_OPENING)
         {
-            close(clientSocket);
-            printf("recv failed\n");
-            return;
-        }
+            ssize_t readed = recv(clientSocket, wsBuffer + readedLength, WS_BUF_LEN - 1 - readedLength, 0);
+            if (readed <= 0)
+            {
+                close(clientSocket);
+                printf("recv failed\n");
+                freeHandshake(&hs);
+                return;
+            }
 #ifdef PACKET_DUMP
-        printf("in packet:\n");
-        fwrite(wsBuffer, 1, readed, stdout);
-        printf("\n");
+            printf("in packet:\n");
+            fwrite(wsBuffer + readedLength, 1, readed, stdout);
+            printf("\n");
 #endif
-        readedLength += readed;
-        // assert(readedLength <= BUF_LEN);
-        if (state == WS_STATE_OPENING)
-        {
+            readedLength += readed;
             frameType = wsParseHandshake(wsBuffer, readedLength, &hs);
         }
         else
         {
-            frameType = wsParseInputFrame(wsBuffer, readedLength, &data, &dataSize);
+            if (recvFrame(clientSocket, &frameType, &data, &dataSize) == EXIT_FAILURE)
+                break;
         }
 
-        if ((frameType == WS_INCOMPLETE_FRAME && readedLength == WS_BUF_LEN) || frameType == WS_ERROR_FRAME)
+        if ((frameType == WS_INCOMPLETE_FRAME && (state != WS_STATE_OPENING || readedLength == WS_BUF_LEN - 1)) ||
+            frameType == WS_ERROR_FRAME)
         {
             if (frameType == WS_INCOMPLETE_FRAME)
                 printf("buffer too small\n");
@@ -223,50 +352,62 @@ void clientWorker(int clientSocket)
                     break;
                 }
             }
-            else if (frameType == WS_BINARY_FRAME)
+            else if (frameType == WS_PING_FRAME)
             {
-                if (dataSize == LCD_BUF_LEN)
-                {
-                    printf("FRM\n");
-                    memcpy(lcdBuffer, data, LCD_BUF_LEN);
-                    lcdWriteFrame();
-                }
-                if (readedLength > dataSize)
-                {
-                    // Copy next frame to the beginning and continue
-                    readedLength = readedLength - dataSize - (data - wsBuffer);
-                    memcpy(wsBuffer, data + dataSize, readedLength);
-                    frameType = WS_INCOMPLETE_FRAME;
-                }
-                else
+                if (state != WS_STATE_CLOSING)
                 {
+                    prepareBuffer;
+                    wsMakeFrame(NULL, 0, wsBuffer, &frameSize, WS_PONG_FRAME);
+                    if (safeSend(clientSocket, wsBuffer, frameSize) == EXIT_FAILURE)
+                        break;
                     initNewFrame;
                 }
             }
-            else if (frameType == WS_PING_FRAME)
+            else
             {
-                if (state != WS_STATE_CLOSING)
+                if (frameType == WS_BINARY_FRAME && frameKeyframeWanted())
                 {
                     prepareBuffer;
-                    wsMakeFrame(NULL, 0, wsBuffer, &frameSize, WS_PONG_FRAME);
+                    wsMakeFrame((const uint8_t *)"keyframe", 8, wsBuffer, &frameSize, WS_TEXT_FRAME);
                     if (safeSend(clientSocket, wsBuffer, frameSize) == EXIT_FAILURE)
                         break;
-                    initNewFrame;
                 }
+                initNewFrame;
             }
         }
     } // read/write cycle
 
+    freeHandshake(&hs);
     close(clientSocket);
 }
 
 
+// clipWaitFn: stop playing once a client is waiting to be accepted
+static int clientWaiting(void *ctx, uint32 ms)
+{
+    int listenSocket = *(int *)ctx;
+    fd_set readable;
+    struct timeval timeout;
+
+    FD_ZERO(&readable);
+    FD_SET(listenSocket, &readable);
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    return select(listenSocket + 1, &readable, NULL, NULL, &timeout) != 0;
+}
+
+
 void svr_task(void *pvParameters)
 {
     while (1)
     {
         struct sockaddr_in local;
         int listenSocket;
+        struct lcdStats stats;
+        struct jpegStats jpegStats;
+        struct tileStats tileStats;
+        struct clipStats clipStats;
+        struct paceStats paceStats;
 
         do
         {
@@ -305,6 +446,7 @@ void svr_task(void *pvParameters)
                 int clientSocket;
 
                 printf("S > wait client\n");
+                clipPlay(clientWaiting, &listenSocket);
                 if ((clientSocket = accept(listenSocket, (struct sockaddr *) &remote, &sockaddrLen)) < 0)
                 {
                     printf("S > accept fail\n");
@@ -313,6 +455,38 @@ void svr_task(void *pvParameters)
                 printf("S > Client from %s %d\n", inet_ntoa(remote.sin_addr), htons(remote.sin_port));
                 clientWorker(clientSocket);
                 printf("heap free size: %d\n", system_get_free_heap_size());
+                lcdWaitDone(100 / portTICK_RATE_MS);    // let the last frame count
+                lcdGetStats(&stats);
+                printf("LCD frames: %u submitted, %u shown, %u dropped, %u repeated\n",
+                       stats.submitted, stats.shown, stats.dropped, stats.repeated);
+                printf("LCD SPI: %u bytes in %u transactions, last frame %u bytes in %u transactions\n",
+                       stats.spiBytes, stats.spiTransactions, stats.frameBytes, stats.frameTransactions);
+                printf("LCD pump: %u early, %u underruns, %u aborts, %u cycles per frame\n",
+                       stats.spiWaits, stats.spiUnderruns, stats.aborts,
+                       stats.shown ? stats.pumpCycles / stats.shown : 0);
+                printf("LCD diff: %u of %u pixel bytes skipped\n",
+                       stats.skippedBytes, stats.pixelBytes);
+                printf("LCD timing: %u timed, %u dropped late, %u shown %u us after due on average, %u us at worst\n",
+                       stats.timed, stats.lateDrops, stats.presented,
+                       stats.presented ? stats.presentUs / stats.presented : 0, stats.presentMaxUs);
+                jpegGetStats(&jpegStats);
+                printf("JPEG: %u decoded, %u bad, %u bytes and %u cycles per frame\n",
+                       jpegStats.decoded, jpegStats.bad,
+                       jpegStats.decoded ? jpegStats.bytes / jpegStats.decoded : 0,
+                       jpegStats.decoded ? jpegStats.cycles / jpegStats.decoded : 0);
+                tileGetStats(&tileStats);
+                printf("Tiles: %u hits, %u misses, %u evictions, %u fills, %u%% hit rate\n",
+                       tileStats.hits, tileStats.misses, tileStats.evictions, tileStats.fills,
+                       (tileStats.hits + tileStats.misses) ?
+                       (uint32)(100ULL * tileStats.hits / (tileStats.hits + tileStats.misses)) : 0);
+                printf("Tiles: %u of %u slots used, %u bytes\n",
+                       tileStats.used, TILE_SLOTS, tileStats.memory);
+                clipGetStats(&clipStats);
+                printf("Clip: %u frames played in %u loops, %u late\n",
+                       clipStats.frames, clipStats.loops, clipStats.late);
+                paceGetStats(&paceStats);
+                printf("Pace: %u timed frames, %u missing, %u resyncs, %u ms worst jitter\n",
+                       paceStats.frames, paceStats.missing, paceStats.resyncs, paceStats.jitterMs);
             }
         } while (0);
     }
@@ -339,7 +513,8 @@ void user_init(void)
         system_restart();
     }
 
-    lcdInit(lcdBuffer);
+    lcdInit(lcdBuffers, LCD_FB_COUNT);
+    clipOpen();
     lcdWriteFrame();
 
     vSemaphoreCreateBinary(wifi_alive);
@@ -5,33 +5,128 @@ let processor = {
     }
     this.computeFrame();
     let self = this;
+    // Keep to the frame interval however long computeFrame() took
+    this.due += this.interval;
+    let wait = this.due - performance.now();
+    if (wait < 0) {
+      this.due -= wait;
+      wait = 0;
+    }
     setTimeout(function () {
         self.timerCallback();
-      }, 50);
+      }, wait);
   },
 
   doLoad: function() {
     this.width = 160;
     this.height = 128;
+    this.interval = 50;
     this.ws = new WebSocket("ws://192.168.4.1/video");
     this.ws.binaryType = 'arraybuffer';
+    let self = this;
+    this.ws.onmessage = function(event) {
+      // The device lost track of the delta chain, or emptied its tile cache
+      if (event.data == "keyframe") {
+        if (self.clipLeft > 0) {
+          self.liveEncoder.keyNext = true;
+          self.liveEncoder.tileOrder = null;
+        } else {
+          self.keyNext = true;
+          self.resetTiles();
+        }
+      }
+    };
     this.bytearray = new Uint8Array(40960);
+    this.lastarray = null;
+    // Send packed RGB444 frames, 30720 bytes instead of 40960
+    this.rgb444 = false;
+    this.packed = new Uint8Array(1 + 30720);
+    // Send planar YUV 4:2:0, 30720 bytes, the device converts to RGB565
+    this.yuv420 = false;
+    this.planes = new Uint8Array(1 + 30720);
+    // Send 4 bpp block compressed frames, 10240 bytes, expanded by the device as it scans out
+    this.blocks = false;
+    this.blockarray = new Uint8Array(1 + 10240);
+    // Send 80x64 frames, the device doubles pixels and lines
+    this.lowres = false;
+    // Send frames with few colours as palette indices
+    this.indexed = true;
+    // Send XOR deltas against the previous frame, a keyframe every keyInterval frames
+    this.delta = false;
+    this.keyInterval = 50;
+    this.deltaSeq = 0;
+    this.sinceKey = 0;
+    this.deltaRef = new Uint8Array(40960);
+    this.deltaOut = new Uint8Array(40960);
+    this.keyNext = true;
+    // Send 8x8 tiles by cache slot once the device has seen them
+    this.tiles = false;
+    this.tile = new Uint8Array(128);
+    this.tileOut = new Uint8Array(1 + 320 * 129);
+    this.resetTiles();
+    // Send lossless QOI-style frames when they come out smaller than raw ones
+    this.lossless = false;
+    this.qoi = new Uint8Array(40960);
+    // Record the next clipFrames frames into the device's flash instead of
+    // showing them, played every clipInterval ms while no one is connected
+    this.clipFrames = 0;
+    this.clipInterval = 50;
+    this.clipLeft = 0;
+    this.liveEncoder = null;
+    // Stamp frames with the video time, the device shows them at that pace
+    this.timed = false;
+    this.timedSeq = 0;
+    this.pts = 0;
+    // JPEG still being encoded, later messages wait for it
+    this.pending = null;
+    // Send baseline JPEGs, a few KB a frame instead of 40960 bytes
+    this.jpeg = false;
+    this.jpegQuality = 0.75;
     this.video = document.getElementById("video");
     this.c1 = document.getElementById("c1");
     this.ctx1 = this.c1.getContext("2d");
     this.c2 = document.getElementById("c2");
     this.ctx2 = this.c2.getContext("2d");
-    let self = this;
     this.video.addEventListener("play", function() {
+        self.due = performance.now();
         self.timerCallback();
       }, false);
   },
 
   computeFrame: function() {
+    this.pts = Math.round(this.video.currentTime * 1000);
+    if (this.clipFrames > 0) {
+      this.beginClip();
+    }
+    if (this.lowres) {
+      this.sendScaled(this.width / 2, this.height / 2);
+      return;
+    }
     this.ctx1.drawImage(this.video, 0, 0, this.width, this.height);
+    if (this.jpeg) {
+      this.sendJpeg();
+      this.ctx2.drawImage(this.c1, 0, 0);
+      return;
+    }
     let frame = this.ctx1.getImageData(0, 0, this.width, this.height);
 		let l = frame.data.length / 4;
 
+    if (this.rgb444) {
+      this.sendRgb444(frame);
+      this.ctx2.putImageData(frame, 0, 0);
+      return;
+    }
+    if (this.yuv420) {
+      this.sendYuv420(frame);
+      this.ctx2.putImageData(frame, 0, 0);
+      return;
+    }
+    if (this.blocks) {
+      this.sendBlocks(frame);
+      this.ctx2.putImageData(frame, 0, 0);
+      return;
+    }
+
     for (let i = 0; i < l; i++) {
       let r = frame.data[i * 4 + 0] & 0xF8;
       let g = frame.data[i * 4 + 1] & 0xFC;
@@ -43,8 +138,619 @@ let processor = {
       this.bytearray[i * 2] = (r & 0xF8) | (g >> 5);
       this.bytearray[i * 2 + 1] = ((g & 0x1C) << 3) | (b >> 3);
     }
-    this.ws.send(this.bytearray.buffer);
+    if (this.delta) {
+      this.sendDelta();
+    } else if ((!this.tiles || !this.sendTiles()) && (!this.lossless || !this.sendQoi()) && (!this.indexed || !this.sendIndexed())) {
+      this.sendChanges();
+    }
     this.ctx2.putImageData(frame, 0, 0);
     return;
+  },
+
+  // FRAME_CLIP: start a clip, each frame encoded as for a new connection.
+  // The device shows none of them, so the encoder picks up where it left
+  // off once the clip is complete.
+  beginClip: function() {
+    let self = this;
+    let begin = new Uint8Array([0x0A, 0x01, this.clipInterval >> 8, this.clipInterval & 0xFF]).buffer;
+    this.inOrder(function() {
+      self.ws.send(begin);
+    });
+    this.liveEncoder = this.saveEncoder();
+    this.clipLeft = this.clipFrames;
+    this.clipFrames = 0;
+    this.lastarray = null;
+    this.keyNext = true;
+    this.deltaSeq = 0;
+    this.sinceKey = 0;
+    this.resetTiles();
+  },
+
+  // What the encoders know of the frame on the device
+  saveEncoder: function() {
+    return {
+      lastarray: this.lastarray,
+      keyNext: this.keyNext,
+      deltaSeq: this.deltaSeq,
+      sinceKey: this.sinceKey,
+      deltaRef: new Uint8Array(this.deltaRef),
+      tileOrder: this.tileOrder,
+      tileKeys: this.tileKeys,
+      tileSlots: this.tileSlots
+    };
+  },
+
+  restoreEncoder: function(state) {
+    this.lastarray = state.lastarray;
+    this.keyNext = state.keyNext;
+    this.deltaSeq = state.deltaSeq;
+    this.sinceKey = state.sinceKey;
+    this.deltaRef.set(state.deltaRef);
+    if (state.tileOrder === null) {
+      this.resetTiles();
+    } else {
+      this.tileOrder = state.tileOrder;
+      this.tileKeys = state.tileKeys;
+      this.tileSlots = state.tileSlots;
+    }
+  },
+
+  // Run fn once the JPEG being encoded, if any, has gone out, so messages
+  // leave in the order their frames were taken
+  inOrder: function(fn) {
+    if (!this.pending) {
+      fn();
+      return;
+    }
+    let self = this;
+    let pending = this.pending.then(fn).then(function() {
+      if (self.pending === pending) {
+        self.pending = null;
+      }
+    });
+    this.pending = pending;
+  },
+
+  // Send a frame to the device, as FRAME_TIMED if asked to, or add it to
+  // the clip being recorded
+  send: function(data) {
+    let self = this;
+    let pts = this.pts;
+    this.inOrder(function() {
+      self.sendNow(data, pts);
+    });
+  },
+
+  // send() for a frame taken at video time pts
+  sendNow: function(data, pts) {
+    let frame = ArrayBuffer.isView(data) ? data : new Uint8Array(data);
+    // A message as long as a raw frame would be taken for one, such a
+    // frame goes out untimed and the device shows it right after the one before
+    if (this.clipLeft == 0 && this.timed && 7 + frame.length != 40960) {
+      let out = new Uint8Array(7 + frame.length);
+      out[0] = 0x0B;
+      out[1] = this.timedSeq >> 8;
+      out[2] = this.timedSeq & 0xFF;
+      out[3] = (pts >>> 24) & 0xFF;
+      out[4] = (pts >> 16) & 0xFF;
+      out[5] = (pts >> 8) & 0xFF;
+      out[6] = pts & 0xFF;
+      out.set(frame, 7);
+      this.timedSeq = (this.timedSeq + 1) & 0xFFFF;
+      this.ws.send(out.buffer);
+      return;
+    }
+    if (this.clipLeft == 0) {
+      this.ws.send(data);
+      return;
+    }
+    // A message as long as a raw frame would be taken for one, skip a byte
+    let pad = (2 + frame.length == 40960) ? 1 : 0;
+    let add = new Uint8Array(2 + pad + frame.length);
+    add[0] = 0x0A;
+    add[1] = pad ? 0x05 : 0x02;
+    add.set(frame, 2 + pad);
+    this.ws.send(add.buffer);
+    if (--this.clipLeft == 0) {
+      this.ws.send(new Uint8Array([0x0A, 0x03]).buffer);
+      this.restoreEncoder(this.liveEncoder);
+    }
+  },
+
+  // FRAME_RGB444: two pixels in three bytes, R0G0 B0R1 G1B1
+  sendRgb444: function(frame) {
+    let d = frame.data;
+    let out = this.packed;
+    out[0] = 0x02;
+    let n = 1;
+    for (let i = 0; i < d.length; i += 8) {
+      let r0 = d[i] >> 4, g0 = d[i + 1] >> 4, b0 = d[i + 2] >> 4;
+      let r1 = d[i + 4] >> 4, g1 = d[i + 5] >> 4, b1 = d[i + 6] >> 4;
+      out[n++] = (r0 << 4) | g0;
+      out[n++] = (b0 << 4) | r1;
+      out[n++] = (g1 << 4) | b1;
+      for (let k = 0; k < 8; k += 4) {
+        d[i + k] &= 0xF0;
+        d[i + k + 1] &= 0xF0;
+        d[i + k + 2] &= 0xF0;
+        d[i + k + 3] = 0;
+      }
+    }
+    this.send(out.buffer);
+    this.lastarray = null;
+  },
+
+  // FRAME_JPEG: the canvas as a JPEG file, its SOI marker is the format byte.
+  // The browser encodes it in the background, it goes out with the time the
+  // frame was taken and everything sent after it waits for it.
+  sendJpeg: function() {
+    let self = this;
+    let pts = this.pts;
+    let encoded = new Promise(function(resolve) {
+      self.c1.toBlob(resolve, "image/jpeg", self.jpegQuality);
+    }).then(function(blob) {
+      return blob.arrayBuffer();
+    });
+    let pending = Promise.all([encoded, this.pending]).then(function(done) {
+      let buffer = done[0];
+      // 40960 bytes would be taken for a raw frame, pad after the EOI marker
+      if (buffer.byteLength == 40960) {
+        let padded = new Uint8Array(40961);
+        padded.set(new Uint8Array(buffer));
+        buffer = padded.buffer;
+      }
+      self.sendNow(buffer, pts);
+    }).catch(function() {
+      // A frame that did not encode is skipped, the ones after it still go
+    }).then(function() {
+      if (self.pending === pending) {
+        self.pending = null;
+      }
+    });
+    this.pending = pending;
+    this.lastarray = null;
+  },
+
+  // FRAME_BLOCKS: each 4x4 block gets its two colours furthest apart, every
+  // pixel the nearest of those and the two the device mixes between them
+  sendBlocks: function(frame) {
+    let d = frame.data;
+    let w = this.width;
+    let out = this.blockarray;
+    let px = new Uint16Array(16);
+    let pal = new Uint16Array(4);
+    let mix = function(a, b) {
+      let r = Math.floor(((a >> 11) * 2 + (b >> 11) + 1) / 3);
+      let g = Math.floor((((a >> 5) & 0x3F) * 2 + ((b >> 5) & 0x3F) + 1) / 3);
+      let bl = Math.floor(((a & 0x1F) * 2 + (b & 0x1F) + 1) / 3);
+      return (r << 11) | (g << 5) | bl;
+    };
+    // Squared distance with red and blue scaled to green's 6 bits
+    let dist = function(a, b) {
+      let dr = ((a >> 11) - (b >> 11)) * 2;
+      let dg = ((a >> 5) & 0x3F) - ((b >> 5) & 0x3F);
+      let db = ((a & 0x1F) - (b & 0x1F)) * 2;
+      return dr * dr + dg * dg + db * db;
+    };
+    out[0] = 0x07;
+    let n = 1;
+    for (let by = 0; by < this.height; by += 4) {
+      for (let bx = 0; bx < w; bx += 4) {
+        for (let k = 0; k < 16; k++) {
+          let i = ((by + (k >> 2)) * w + bx + (k & 3)) * 4;
+          px[k] = ((d[i] & 0xF8) << 8) | ((d[i + 1] & 0xFC) << 3) | (d[i + 2] >> 3);
+        }
+        let best = -1;
+        for (let a = 0; a < 16; a++) {
+          for (let b = a + 1; b < 16; b++) {
+            let e = dist(px[a], px[b]);
+            if (e > best) {
+              best = e;
+              pal[0] = px[a];
+              pal[1] = px[b];
+            }
+          }
+        }
+        pal[2] = mix(pal[0], pal[1]);
+        pal[3] = mix(pal[1], pal[0]);
+        out[n++] = pal[0] >> 8;
+        out[n++] = pal[0] & 0xFF;
+        out[n++] = pal[1] >> 8;
+        out[n++] = pal[1] & 0xFF;
+        for (let k = 0; k < 16; k++) {
+          let j = 0;
+          for (let t = 1; t < 4; t++) {
+            if (dist(px[k], pal[t]) < dist(px[k], pal[j])) {
+              j = t;
+            }
+          }
+          if ((k & 3) == 0) {
+            out[n] = 0;
+          }
+          out[n] = (out[n] << 2) | j;
+          if ((k & 3) == 3) {
+            n++;
+          }
+          // Show what the panel will
+          let i = ((by + (k >> 2)) * w + bx + (k & 3)) * 4;
+          d[i] = (pal[j] >> 8) & 0xF8;
+          d[i + 1] = (pal[j] >> 3) & 0xFC;
+          d[i + 2] = (pal[j] << 3) & 0xF8;
+          d[i + 3] = 0;
+        }
+      }
+    }
+    this.send(out.buffer);
+    this.lastarray = null;
+  },
+
+  // FRAME_SCALED: w x h RGB565 source, shown at full size
+  sendScaled: function(w, h) {
+    this.ctx1.drawImage(this.video, 0, 0, w, h);
+    let frame = this.ctx1.getImageData(0, 0, w, h);
+    let d = frame.data;
+    let out = new Uint8Array(3 + w * h * 2);
+    out[0] = 0x05;
+    out[1] = w;
+    out[2] = h;
+    for (let i = 0; i < w * h; i++) {
+      let r = d[i * 4] & 0xF8, g = d[i * 4 + 1] & 0xFC, b = d[i * 4 + 2] & 0xF8;
+      out[3 + i * 2] = r | (g >> 5);
+      out[4 + i * 2] = ((g & 0x1C) << 3) | (b >> 3);
+    }
+    this.send(out.buffer);
+    this.lastarray = null;
+    this.ctx2.drawImage(this.c1, 0, 0, w, h, 0, 0, this.width, this.height);
+  },
+
+  // FRAME_YUV420: BT.601 studio range, chroma averaged over each 2x2 block
+  sendYuv420: function(frame) {
+    let d = frame.data;
+    let w = this.width, h = this.height;
+    let out = this.planes;
+    let u = 1 + w * h, v = u + w * h / 4;
+    out[0] = 0x04;
+    for (let i = 0; i < w * h; i++) {
+      let r = d[i * 4], g = d[i * 4 + 1], b = d[i * 4 + 2];
+      out[1 + i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+    }
+    for (let y = 0; y < h; y += 2) {
+      for (let x = 0; x < w; x += 2) {
+        let r = 0, g = 0, b = 0;
+        for (let k of [0, 1, w, w + 1]) {
+          let i = (y * w + x + k) * 4;
+          r += d[i];
+          g += d[i + 1];
+          b += d[i + 2];
+        }
+        r >>= 2;
+        g >>= 2;
+        b >>= 2;
+        out[u++] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        out[v++] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+      }
+    }
+    // Draw what the device shows, converted back as its pump does
+    let clamp = function(c) {
+      return c < 0 ? 0 : c > 255 ? 255 : c;
+    };
+    for (let y = 0; y < h; y++) {
+      for (let x = 0; x < w; x++) {
+        let i = y * w + x;
+        let k = (y >> 1) * (w >> 1) + (x >> 1);
+        let c = 298 * (out[1 + i] - 16);
+        let cd = out[1 + w * h + k] - 128, ce = out[1 + w * h * 5 / 4 + k] - 128;
+        d[i * 4] = clamp((c + 409 * ce + 128) >> 8);
+        d[i * 4 + 1] = clamp((c - 100 * cd - 208 * ce + 128) >> 8);
+        d[i * 4 + 2] = clamp((c + 516 * cd + 128) >> 8);
+      }
+    }
+    this.send(out.buffer);
+    this.lastarray = null;
+  },
+
+  // FRAME_INDEXED at the fewest bits per pixel that hold every colour of the frame
+  sendIndexed: function() {
+    let cur = this.bytearray;
+    let l = cur.length / 2;
+    let colors = new Map();
+    let index = new Uint8Array(l);
+    for (let i = 0; i < l; i++) {
+      let c = (cur[i * 2] << 8) | cur[i * 2 + 1];
+      let n = colors.get(c);
+      if (n === undefined) {
+        if (colors.size == 256) {
+          return false;
+        }
+        n = colors.size;
+        colors.set(c, n);
+      }
+      index[i] = n;
+    }
+    let bits = 8;
+    while (bits > 1 && colors.size <= (1 << (bits >> 1))) {
+      bits >>= 1;
+    }
+    let out = new Uint8Array(3 + colors.size * 2 + l * bits / 8);
+    out[0] = 0x03;
+    out[1] = bits;
+    out[2] = colors.size & 0xFF;
+    let n = 3;
+    for (let c of colors.keys()) {
+      out[n++] = c >> 8;
+      out[n++] = c & 0xFF;
+    }
+    let perByte = 8 / bits;
+    for (let i = 0; i < l; i += perByte) {
+      let v = 0;
+      for (let k = 0; k < perByte; k++) {
+        v = (v << bits) | index[i + k];
+      }
+      out[n++] = v;
+    }
+    this.send(out.buffer);
+    this.lastarray = null;
+    return true;
+  },
+
+  // FRAME_QOI: runs, a table of recent colours and small steps from the
+  // previous pixel. Returns false if the codes would not fit in a raw frame.
+  sendQoi: function() {
+    let cur = this.bytearray;
+    let out = this.qoi;
+    let index = new Uint16Array(64);
+    let prev = 0, run = 0, n = 1;
+    out[0] = 0x06;
+    for (let i = 0; i <= cur.length; i += 2) {
+      let px = (i < cur.length) ? (cur[i] << 8) | cur[i + 1] : -1;
+      if (px == prev) {
+        run++;
+        continue;
+      }
+      if (n + 6 >= out.length) {
+        return false;
+      }
+      if (run > 62) {
+        out[n++] = 0xFF;
+        out[n++] = run >> 8;
+        out[n++] = run & 0xFF;
+      } else if (run > 0) {
+        out[n++] = 0xC0 | (run - 1);
+      }
+      run = 0;
+      if (px < 0) {
+        break;
+      }
+      let r = px >> 11, g = (px >> 5) & 0x3F, b = px & 0x1F;
+      let h = (r * 3 + g * 5 + b * 7) & 0x3F;
+      if (index[h] == px) {
+        out[n++] = h;
+      } else {
+        index[h] = px;
+        // Channel steps wrap around, so take the short way
+        let dr = ((r - (prev >> 11) + 16) & 0x1F) - 16;
+        let dg = ((g - ((prev >> 5) & 0x3F) + 32) & 0x3F) - 32;
+        let db = ((b - (prev & 0x1F) + 16) & 0x1F) - 16;
+        let vr = dr - (dg >> 1), vb = db - (dg >> 1);
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          out[n++] = 0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+        } else if (vr >= -8 && vr <= 7 && vb >= -8 && vb <= 7) {
+          out[n++] = 0x80 | (dg + 32);
+          out[n++] = ((vr + 8) << 4) | (vb + 8);
+        } else {
+          out[n++] = 0xFE;
+          out[n++] = px >> 8;
+          out[n++] = px & 0xFF;
+        }
+      }
+      prev = px;
+    }
+    this.send(out.subarray(0, n));
+    this.lastarray = null;
+    return true;
+  },
+
+  // The device's tile cache: slots from least to most recently used, the
+  // tile in each slot and the slot of each tile
+  resetTiles: function() {
+    this.tileOrder = [];
+    for (let i = 0; i < 128; i++) {
+      this.tileOrder.push(i);
+    }
+    this.tileKeys = new Array(128).fill(null);
+    this.tileSlots = new Map();
+  },
+
+  // FRAME_TILES: a code per 8x8 tile, its cache slot where the device has
+  // it. Returns false, leaving the cache as it was, if the frame would not
+  // come out smaller than a raw one.
+  sendTiles: function() {
+    let cur = this.bytearray;
+    let tile = this.tile;
+    let out = this.tileOut;
+    let order = this.tileOrder.slice();
+    let keys = this.tileKeys.slice();
+    let slots = new Map(this.tileSlots);
+    let last = null, repeat = 0, n = 1;
+    out[0] = 0x09;
+    for (let ty = 0; ty < this.height; ty += 8) {
+      for (let tx = 0; tx < this.width; tx += 8) {
+        for (let y = 0; y < 8; y++) {
+          let i = ((ty + y) * this.width + tx) * 2;
+          tile.set(cur.subarray(i, i + 16), y * 16);
+        }
+        let key = String.fromCharCode.apply(null, tile);
+        if (key === last && repeat < 256) {
+          repeat++;
+          continue;
+        }
+        if (repeat > 0) {
+          out[n++] = 0x82;
+          out[n++] = repeat - 1;
+          repeat = 0;
+        }
+        last = key;
+        let fill = true;
+        for (let i = 2; i < 128 && fill; i += 2) {
+          fill = tile[i] == tile[0] && tile[i + 1] == tile[1];
+        }
+        if (fill) {
+          out[n++] = 0x81;
+          out[n++] = tile[0];
+          out[n++] = tile[1];
+          continue;
+        }
+        let slot = slots.get(key);
+        if (slot !== undefined) {
+          order.splice(order.indexOf(slot), 1);
+          out[n++] = slot;
+        } else {
+          // Into the least recently used slot, as the device does
+          slot = order.shift();
+          if (keys[slot] !== null) {
+            slots.delete(keys[slot]);
+          }
+          keys[slot] = key;
+          slots.set(key, slot);
+          out[n++] = 0x80;
+          out.set(tile, n);
+          n += 128;
+        }
+        order.push(slot);
+      }
+    }
+    if (repeat > 0) {
+      out[n++] = 0x82;
+      out[n++] = repeat - 1;
+    }
+    if (n >= 40960) {
+      return false;
+    }
+    this.tileOrder = order;
+    this.tileKeys = keys;
+    this.tileSlots = slots;
+    this.send(out.subarray(0, n));
+    this.lastarray = null;
+    return true;
+  },
+
+  // FRAME_DELTA: runs of pixels XORed with the last frame sent, or with
+  // black for a keyframe
+  sendDelta: function() {
+    let cur = this.bytearray;
+    let ref = this.deltaRef;
+    let out = this.deltaOut;
+    let key = this.keyNext || this.sinceKey >= this.keyInterval;
+    if (key) {
+      ref.fill(0);
+      this.sinceKey = 0;
+    }
+    this.sinceKey++;
+    this.deltaSeq = (this.deltaSeq + 1) & 0xFFFF;
+    out[0] = 0x08;
+    out[1] = this.deltaSeq >> 8;
+    out[2] = this.deltaSeq & 0xFF;
+    out[3] = key ? 0x01 : 0x00;
+    let n = 4;
+    let skip = 0;
+    let l = cur.length / 2;
+    for (let i = 0; i < l && n + 3 < out.length; ) {
+      if (cur[i * 2] == ref[i * 2] && cur[i * 2 + 1] == ref[i * 2 + 1]) {
+        skip++;
+        i++;
+        continue;
+      }
+      for (; skip > 64; skip -= Math.min(skip, 0x4000)) {
+        let k = Math.min(skip, 0x4000) - 1;
+        out[n++] = 0xC0 | (k >> 8);
+        out[n++] = k & 0xFF;
+      }
+      if (skip > 0) {
+        out[n++] = skip - 1;
+        skip = 0;
+      }
+      // A run of pixels that only differ in the low byte, or of any changed pixels
+      let low = cur[i * 2] == ref[i * 2];
+      let j = i;
+      while (j < l && j - i < 64 && (cur[j * 2] != ref[j * 2] || cur[j * 2 + 1] != ref[j * 2 + 1]) &&
+             (cur[j * 2] == ref[j * 2]) == low) {
+        j++;
+      }
+      if (n + 1 + (j - i) * 2 >= out.length) {
+        n = out.length;
+        break;
+      }
+      out[n++] = (low ? 0x40 : 0x80) | (j - i - 1);
+      for (; i < j; i++) {
+        if (!low) {
+          out[n++] = cur[i * 2] ^ ref[i * 2];
+        }
+        out[n++] = cur[i * 2 + 1] ^ ref[i * 2 + 1];
+      }
+    }
+    ref.set(cur);
+    this.lastarray = null;
+    this.keyNext = false;
+    if (n + 3 >= out.length) {
+      // Bigger than a raw frame, send that instead. It restarts the chain at 0.
+      this.send(cur.buffer);
+      this.deltaSeq = 0;
+      this.sinceKey = 1;
+      return;
+    }
+    this.send(out.subarray(0, n));
+  },
+
+  // Send only the bounding box of what changed since the last frame
+  sendChanges: function() {
+    let cur = this.bytearray;
+    let last = this.lastarray;
+    if (last === null) {
+      this.lastarray = new Uint8Array(cur);
+      this.send(cur.buffer);
+      return;
+    }
+    let x0 = this.width, y0 = this.height, x1 = -1, y1 = -1;
+    for (let y = 0; y < this.height; y++) {
+      for (let x = 0; x < this.width; x++) {
+        let i = (y * this.width + x) * 2;
+        if (cur[i] != last[i] || cur[i + 1] != last[i + 1]) {
+          if (x < x0) x0 = x;
+          if (x > x1) x1 = x;
+          if (y < y0) y0 = y;
+          if (y > y1) y1 = y;
+        }
+      }
+    }
+    if (x1 < 0) {
+      // An empty frame keeps a clip in step
+      if (this.clipLeft > 0) {
+        this.send(new ArrayBuffer(0));
+      }
+      return;
+    }
+    last.set(cur);
+    let w = x1 - x0 + 1;
+    let h = y1 - y0 + 1;
+    let len = 2 + 4 + w * h * 2;
+    if (len >= cur.length) {
+      this.send(cur.buffer);
+      return;
+    }
+    // FRAME_RECTS with a single rectangle
+    let rect = new Uint8Array(len);
+    rect[0] = 0x01;
+    rect[1] = 1;
+    rect[2] = x0;
+    rect[3] = y0;
+    rect[4] = w;
+    rect[5] = h;
+    let n = 6;
+    for (let y = y0; y <= y1; y++) {
+      let i = (y * this.width + x0) * 2;
+      rect.set(cur.subarray(i, i + w * 2), n);
+      n += w * 2;
+    }
+    this.send(rect.buffer);
   }
 };